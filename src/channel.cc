@@ -0,0 +1,79 @@
+#include "include/channel.hh"
+
+namespace Sylar {
+
+int Selector::Select(int64_t timeout) {
+  if (cases_.empty()) {
+    throw std::logic_error("Selector::Select: no case");
+  }
+  if (timeout > 0 && Schedule::GetInvokeDeepth() < 2) {
+    throw std::logic_error("Selector::Select: timeout needs coroutine");
+  }
+  // the waiter records current coroutine and epoll, create it before locking
+  std::shared_ptr<ChanWaitState> state;
+  if (timeout != 0) {
+    state = std::make_shared<ChanWaitState>();
+  }
+
+  // lock all channels in the order of address, so that concurrent selects
+  // over the same channels won't deadlock. a channel may appear in several
+  // cases, lock it only once
+  std::vector<SpinLock *> locks;
+  for (auto &cs : cases_) {
+    locks.push_back(cs.mu_);
+  }
+  std::sort(locks.begin(), locks.end());
+  locks.erase(std::unique(locks.begin(), locks.end()), locks.end());
+  for (auto mu : locks) {
+    mu->Lock();
+  }
+  auto unlock_all = [&locks]() {
+    for (auto it = locks.rbegin(); it != locks.rend(); it++) {
+      (*it)->Unlock();
+    }
+  };
+
+  size_t n = cases_.size();
+  size_t first = start_++ % n;
+  std::shared_ptr<ChanWaitState> wake;
+  for (size_t i = 0; i < n; i++) {
+    size_t idx = (first + i) % n;
+    if (cases_[idx].try_(wake) != 0) {
+      unlock_all();
+      if (wake) {
+        wake->waiter_.Wake();
+      }
+      return idx;
+    }
+  }
+  if (timeout == 0) {
+    unlock_all();
+    return -1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    cases_[i].enqueue_(state, i);
+  }
+  unlock_all();
+
+  TimerHandle timer;
+  if (timeout > 0) {
+    timer = Epoll::GetThreadEpoll()->AddTimer(timeout, [state]() {
+      if (state->Fire(-1)) {
+        state->waiter_.Wake();
+      }
+    });
+  }
+  state->waiter_.Suspend();
+  if (timer) {
+    state->waiter_.epoll_->CancelTimer(timer);
+  }
+
+  // remove the waiters left in channels which are not fired
+  for (auto &cs : cases_) {
+    cs.remove_(state.get());
+  }
+  return state->index_;
+}
+
+} // namespace Sylar
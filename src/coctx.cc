@@ -0,0 +1,72 @@
+#include "include/coctx.hh"
+#include <cstring>
+
+namespace Sylar {
+
+#ifdef SYLAR_COCTX_UCONTEXT
+
+void CoctxMake(CoContext *ctx, void *stack, size_t size, void (*func)(void *),
+               void *arg) {
+  getcontext(&ctx->uctx_);
+  ctx->uctx_.uc_stack.ss_sp = stack;
+  ctx->uctx_.uc_stack.ss_size = size;
+  ctx->uctx_.uc_link = nullptr;
+  makecontext(&ctx->uctx_, (void (*)())func, 1, arg);
+}
+
+void CoctxInit(CoContext *ctx) { getcontext(&ctx->uctx_); }
+
+void *CoctxStackPointer(const CoContext *ctx) {
+#if defined(__x86_64__)
+  return (void *)ctx->uctx_.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  return (void *)ctx->uctx_.uc_mcontext.sp;
+#else
+  return nullptr;
+#endif
+}
+
+#elif defined(__x86_64__)
+
+void CoctxMake(CoContext *ctx, void *stack, size_t size, void (*func)(void *),
+               void *arg) {
+  memset(ctx, 0, sizeof(CoContext));
+  // System V ABI requires (%rsp + 8) to be 16 bytes aligned at the entry of
+  // function, which is the state after a call instruction pushing return
+  // address. func never returns, so we just leave a zero return address
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)0xf;
+  top -= sizeof(void *);
+  *reinterpret_cast<void **>(top) = nullptr;
+
+  ctx->regs_[0] = (void *)func; // rip
+  ctx->regs_[1] = (void *)top;  // rsp
+  // default value of mxcsr and x87 control word
+  uint32_t csr[2] = {0x1f80, 0x037f};
+  memcpy(&ctx->regs_[8], csr, sizeof(csr));
+  ctx->regs_[9] = arg; // rdi
+}
+
+void CoctxInit(CoContext *ctx) { memset(ctx, 0, sizeof(CoContext)); }
+
+void *CoctxStackPointer(const CoContext *ctx) { return ctx->regs_[1]; }
+
+#elif defined(__aarch64__)
+
+void CoctxMake(CoContext *ctx, void *stack, size_t size, void (*func)(void *),
+               void *arg) {
+  memset(ctx, 0, sizeof(CoContext));
+  // AAPCS64 requires sp to be 16 bytes aligned
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)0xf;
+
+  ctx->regs_[11] = (void *)func; // x30(lr)
+  ctx->regs_[12] = (void *)top;  // sp
+  ctx->regs_[21] = arg;          // x0
+}
+
+void CoctxInit(CoContext *ctx) { memset(ctx, 0, sizeof(CoContext)); }
+
+void *CoctxStackPointer(const CoContext *ctx) { return ctx->regs_[12]; }
+
+#endif
+
+} // namespace Sylar
@@ -1,38 +1,146 @@
 #include "include/coroutine.hh"
 #include "include/epoll.hh"
+#include "include/introspect.hh"
 #include "include/timewheel.hh"
+#include <sys/mman.h>
 
 namespace Sylar {
 
+// let the last 12 bits of stack size to be zero
+static void AlignStackSize(const std::shared_ptr<CoroutineAttr> &attr) {
+  if (attr->stack_size_ & 0xfff) {
+    attr->stack_size_ &= ~0xfff;
+    attr->stack_size_ += 0x1000;
+  }
+}
+
+// coroutines with different kind of stack cannot reuse each other. the size of
+// stack is multiple of page size, so we use the lowest bit as the kind
+static size_t PoolKey(size_t stack_size, bool use_mmap) {
+  return stack_size | (use_mmap ? 1 : 0);
+}
+
+size_t MmapStackStats::GetStackCount() {
+  SpinLock::ScopeLock lock(mu_);
+  return stacks_.size();
+}
+
+size_t MmapStackStats::GetReservedBytes() {
+  SpinLock::ScopeLock lock(mu_);
+  return reserved_;
+}
+
+size_t MmapStackStats::GetResidentBytes() {
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> vec;
+  size_t resident = 0;
+  SpinLock::ScopeLock lock(mu_);
+  for (auto &item : stacks_) {
+    vec.resize((item.second + page - 1) / page);
+    if (mincore(item.first, item.second, vec.data()) != 0) {
+      continue;
+    }
+    for (auto v : vec) {
+      if (v & 1) {
+        resident += page;
+      }
+    }
+  }
+  return resident;
+}
+
+void MmapStackStats::AddStack(void *stack, size_t size) {
+  SpinLock::ScopeLock lock(mu_);
+  stacks_[stack] = size;
+  reserved_ += size;
+}
+
+void MmapStackStats::DelStack(void *stack) {
+  SpinLock::ScopeLock lock(mu_);
+  auto it = stacks_.find(stack);
+  if (it != stacks_.end()) {
+    reserved_ -= it->second;
+    stacks_.erase(it);
+  }
+}
+
+std::shared_ptr<void> MemoryAlloc::AllocMmapStack(size_t size) {
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  size = (size + page - 1) / page * page;
+  // MAP_NORESERVE: don't reserve swap space, physical pages are allocated on
+  // the first touch
+  char *base =
+      (char *)mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                   0);
+  if (base == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  // stack grows towards lower address, so the guard page is the lowest page
+  if (mprotect(base, page, PROT_NONE) != 0) {
+    munmap(base, size + page);
+    throw std::bad_alloc();
+  }
+  char *stack = base + page;
+  // the stack may be released in another thread, we record it in the
+  // statistics of allocating thread
+  auto stats = MmapStackStats::GetThreadStats();
+  stats->AddStack(stack, size);
+  return std::shared_ptr<void>(stack, [stats, base, size](void *stack) {
+    stats->DelStack(stack);
+    munmap(base, size + page);
+  });
+}
+
 thread_local std::shared_ptr<Schedule> Schedule::t_schedule_ = nullptr;
 
+// logical clock of evicting coroutine from shared stack
+static thread_local uint64_t t_evict_clock = 0;
+
+// the id of next coroutine, 0 is reserved for main coroutine
+static std::atomic<uint64_t> s_co_id{1};
+
+// the destructors of CoroutineLocal slots
+static std::atomic<size_t> s_local_slots{0};
+static void (*s_local_dtors[Coroutine::kMaxLocalSlots])(void *);
+
+uint64_t GetCoroutineId() {
+  // don't initialize schedule, log may be written in any thread
+  Schedule *sc = Schedule::t_schedule_.get();
+  return sc ? sc->running_co_->GetId() : 0;
+}
+
 void Schedule::InitThreadSchedule() {
   t_schedule_ = Schedule::Instance();
+  t_schedule_->tid_ = GetThreadId();
+  t_schedule_->switch_cycles_ = ReadCycles();
+  CoroutineRegistry::AddSchedule(t_schedule_.get());
   auto main_co = Coroutine::CreateCoroutine(t_schedule_, nullptr, nullptr);
   main_co->is_main_co_ = true;
   main_co->co_state_ = Coroutine::CO_RUNNING;
+  main_co->id_ = 0;
   // we should init context of main_co in this place
-  t_schedule_->co_stack_.push_back(main_co);
+  t_schedule_->main_co_ = main_co;
+  t_schedule_->co_stack_.push_back(main_co.get());
   t_schedule_->stack_top_ = 1;
-  t_schedule_->running_co_ = main_co;
+  t_schedule_->running_co_ = main_co.get();
 }
 
+Schedule::~Schedule() { CoroutineRegistry::RemoveSchedule(this); }
+
 std::shared_ptr<Coroutine> Schedule::GetCurrentCo() {
-  if (!GetThreadSchedule()) {
-    InitThreadSchedule();
-  }
-  auto schedule = Schedule::GetThreadSchedule();
-  auto top = schedule->co_stack_.back();
-  return top;
+  return Current()->co_stack_.back()->shared_from_this();
 }
 
 void Schedule::Yield() {
-  auto t_schedule = Schedule::Instance();
+  // don't hold any shared_ptr in this frame, a coroutine which is never resumed
+  // again will never destruct them, which makes coroutine cannot be released
+  Schedule *t_schedule = Schedule::Current();
   if (t_schedule->co_stack_.size() < 2) {
     throw std::runtime_error("only main coroutine running, cannot yield");
   }
-  auto running_co = t_schedule->co_stack_[t_schedule->stack_top_ - 1];
-  auto pending_co = t_schedule->co_stack_[t_schedule->stack_top_ - 2];
+  Coroutine *running_co = t_schedule->co_stack_[t_schedule->stack_top_ - 1];
+  Coroutine *pending_co = t_schedule->co_stack_[t_schedule->stack_top_ - 2];
   t_schedule->co_stack_.pop_back();
   t_schedule->stack_top_--;
 
@@ -43,8 +151,7 @@ void Schedule::Yield() {
   SwapContext(running_co, pending_co);
 }
 
-void Schedule::SwapContext(std::shared_ptr<Coroutine> prev,
-                           std::shared_ptr<Coroutine> next) {
+void Schedule::SwapContext(Coroutine *prev, Coroutine *next) {
   // if the next coroutine use shared memroy, its stack memory may be used by
   // another coroutine, we should save this stack memory to that coroutine. we
   // always save the stack of next coroutine.
@@ -56,59 +163,138 @@ void Schedule::SwapContext(std::shared_ptr<Coroutine> prev,
   char dummy;
   prev->dummy_ = &dummy;
 
+  // statistics of CoroutineRegistry, only relaxed loads and stores
+  if (CoroutineRegistry::IsTiming()) {
+    // coroutines may be created in the schedule of another thread, the
+    // switching thread is what matters
+    auto &switch_cycles = t_schedule_->switch_cycles_;
+    uint64_t now = ReadCycles();
+    uint64_t last = switch_cycles.load(std::memory_order_relaxed);
+    prev->run_cycles_.store(prev->run_cycles_.load(std::memory_order_relaxed) +
+                                now - last,
+                            std::memory_order_relaxed);
+    switch_cycles.store(now, std::memory_order_relaxed);
+  }
+  next->switches_.store(next->switches_.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+  if (!prev->is_main_co_) {
+    size_t depth = (char *)prev->stack_mem_->stack_buffer_.get() +
+                   prev->stack_mem_->size_ - &dummy;
+    if (depth > prev->stack_hwm_.load(std::memory_order_relaxed)) {
+      prev->stack_hwm_.store(depth, std::memory_order_relaxed);
+    }
+  }
+
   if (next->use_shared_stk_) {
     // save the previous coroutine occupied in next->stack_mem_
-    auto occupy_co = next->stack_mem_->occupy_co_;
-    next->stack_mem_->occupy_co_ = next;
-    if (occupy_co && occupy_co != next) {
-      occupy_co->SaveStack();
+    Coroutine *occupy_co = next->stack_mem_->occupy_co_;
+    if (occupy_co != next) {
+      // terminated coroutine will never run again, its stack is garbage. the
+      // occupier may also have been destructed
+      if (occupy_co && occupy_co->co_state_ != Coroutine::CO_TERMINAL) {
+        occupy_co->SaveStack();
+        next->stack_mem_->last_evict_ = ++t_evict_clock;
+      }
       // resume the stack memory saved in next
       next->ResumeStack();
+      next->stack_mem_->occupy_co_ = next;
     }
   }
 
-  swapcontext(&prev->coctx_, &next->coctx_);
+  CoctxSwap(&prev->coctx_, &next->coctx_);
 }
 
 void Schedule::Eventloop(std::shared_ptr<Epoll> epoll) {
   const uint64_t MAX_TIMEOUT = 1000;
-  const int MAX_EVENT = 1024;
-  epoll_event *evs = (epoll_event *)calloc(MAX_EVENT, sizeof(epoll_event));
-  std::shared_ptr<epoll_event> deleter(evs, free);
   while (!epoll->Stoped()) {
-    // we can set granularity in epoll
-    uint64_t now = GetElapseFromRebootMS();
-    uint64_t interval = epoll->GetNextTimeout(now);
-    uint64_t timeout =
-        (interval == 0 ? MAX_TIMEOUT : std::min(interval + 1, MAX_TIMEOUT));
-    int cnt = epoll_wait(epoll->epfd_, evs, MAX_EVENT, timeout);
-    if (cnt <= 0) {
-      if (errno == EAGAIN) {
-        std::cout << "epoll_wait timeout" << std::endl;
-      }
+    EventloopOnce(epoll, MAX_TIMEOUT);
+  }
+}
+
+// the callback may cancel or replace itself, so it's taken out of EventCtx
+// while running, and put back if the event is still registered without a new
+// waiter. moving avoids copying the callback and the refcount of coroutine
+static void DispatchEvent(Epoll::EventCtx *ctx, int type,
+                          std::function<void()> &callback,
+                          std::shared_ptr<Coroutine> &co) {
+  if (callback) {
+    std::function<void()> func;
+    func.swap(callback);
+    func();
+    if ((ctx->type_ & type) && !callback && !co) {
+      callback.swap(func);
+    }
+  } else if (co) {
+    std::shared_ptr<Coroutine> waiter(std::move(co));
+    waiter->Resume();
+    if ((ctx->type_ & type) && !callback && !co) {
+      co = std::move(waiter);
     }
-    for (int i = 0; i < cnt; i++) {
-      auto &ev = evs[i];
-      auto ptr = epoll->reg_event_[ev.data.fd];
+  }
+}
 
-      if (ev.events & EPOLLIN) {
-        if (ptr->r_callback_) {
-          ptr->r_callback_();
-        } else if (ptr->r_co_) {
-          ptr->r_co_->Resume();
-        }
+int Schedule::EventloopOnce(const std::shared_ptr<Epoll> &epoll,
+                            uint64_t max_timeout) {
+  const int MAX_EVENT = 1024;
+  if (epoll->events_.size() < MAX_EVENT) {
+    epoll->events_.resize(MAX_EVENT);
+  }
+  epoll_event *evs = epoll->events_.data();
+  epoll->FlushChanges();
+  // we can set granularity in epoll. the clock isn't cached here, see
+  // Clock::Release below
+  uint64_t timeout = epoll->PrepareTimeout(Clock::NowUS(), max_timeout);
+  int cnt = BusyPollWait(epoll->epfd_, evs, MAX_EVENT, timeout,
+                         epoll->busy_poll_ns_, epoll->stats_);
+  if (cnt < 0) {
+    // interrupted by signal
+    cnt = 0;
+  }
+  // the only read of clock in this iteration, it's cached for callbacks and
+  // timers, see Clock
+  uint64_t now = Clock::Refresh();
+  uint64_t returned = ReadCycles();
+  for (int i = 0; i < cnt; i++) {
+    auto &ev = evs[i];
+    epoll->stats_.latency_.Record(ReadCycles() - returned);
+    auto ctx = static_cast<Epoll::EventCtx *>(ev.data.ptr);
+    int ready = ctx->type_;
+    bool oneshot = ctx->flags_ & Epoll::EventFlag::ONESHOT;
+    if (oneshot) {
+      // kernel has disarmed fd, the registration is consumed
+      ctx->type_ = Epoll::EventType::NONE;
+      ctx->armed_ = 0;
+    }
+    // a callback handled earlier in this batch may cancel the event
+    if ((ev.events & EPOLLIN) && (ready & Epoll::EventType::READ)) {
+      DispatchEvent(ctx, Epoll::EventType::READ, ctx->r_callback_,
+                    ctx->r_co_);
+    }
+    if ((ev.events & EPOLLOUT) && (ready & Epoll::EventType::WRITE) &&
+        (oneshot || (ctx->type_ & Epoll::EventType::WRITE))) {
+      // a consumed registration is cancelled by clearing the waiter
+      DispatchEvent(ctx, Epoll::EventType::WRITE, ctx->w_callback_,
+                    ctx->w_co_);
+    }
+    if (oneshot) {
+      // release the waiter not woken up unless it's registered again
+      if ((ctx->type_ & Epoll::EventType::READ) == 0) {
+        ctx->r_callback_ = nullptr;
+        ctx->r_co_ = nullptr;
       }
-      if (ev.events & EPOLLOUT) {
-        if (ptr->w_callback_) {
-          ptr->w_callback_();
-        } else if (ptr->w_co_) {
-          ptr->w_co_->Resume();
-        }
+      if ((ctx->type_ & Epoll::EventType::WRITE) == 0) {
+        ctx->w_callback_ = nullptr;
+        ctx->w_co_ = nullptr;
       }
     }
-    now = GetElapseFromRebootMS();
-    epoll->ExecuteTimeout(now);
   }
+  epoll->ExecuteTimeoutUS(now);
+  Clock::Release();
+  // requested by signal, see CoroutineRegistry::InstallDumpSignal
+  if (CoroutineRegistry::IsDumpRequested()) {
+    CoroutineRegistry::HandleDumpRequest();
+  }
+  return cnt;
 }
 
 void Coroutine::SaveStack() {
@@ -142,29 +328,74 @@ void Coroutine::SaveStack() {
   // |------------------|  (low address)
   // clang-format on
 
-  if (this->dummy_ == nullptr) {
-    // dummy somehow is nullptr, we just save all its stace space
-    this->saved_stack_ =
-        MemoryAlloc::AllocSharedMemory(this->stack_mem_->size_);
-    memcpy(this->saved_stack_.get(), this->stack_mem_->stack_buffer_.get(),
-           this->stack_mem_->size_);
+  char *top = (char *)this->stack_mem_->stack_buffer_.get() +
+              this->stack_mem_->size_;
+  // the frames below dummy, e.g. the switch function when it's not inlined
+  // in debug build, are live as well. the saved stack pointer is the real
+  // bottom of live region
+  char *sp = (char *)CoctxStackPointer(&this->coctx_);
+  if (sp == nullptr || sp > (char *)this->dummy_) {
+    // unknown, we just save all its stack space
+    sp = (char *)this->stack_mem_->stack_buffer_.get();
   }
-
-  size_t len = (char *)this->stack_mem_->stack_buffer_.get() +
-               this->stack_mem_->size_ - (char *)this->dummy_;
-  this->saved_stack_ = MemoryAlloc::AllocSharedMemory(len);
+  // ResumeStack copies the saved region back here
+  this->dummy_ = sp;
+  size_t len = top - sp;
+  memcpy(SaveBuffer(len), sp, len);
   this->saved_size_ = len;
-  memcpy(this->saved_stack_.get(), this->dummy_, len);
+}
+
+char *Coroutine::SaveBuffer(size_t len) {
+  if (len <= kInlineSaveSize) {
+    return saved_inline_;
+  }
+  if (len > saved_capacity_) {
+    // grow by power of 2, the size of live stack region usually fluctuates
+    // around a value, which won't trigger reallocation frequently
+    size_t cap = std::max(saved_capacity_, kInlineSaveSize * 2);
+    while (cap < len) {
+      cap <<= 1;
+    }
+    saved_heap_.reset(new char[cap]);
+    saved_capacity_ = cap;
+  }
+  return saved_heap_.get();
 }
 
 void Coroutine::ResumeStack() {
-  memcpy(this->dummy_, this->saved_stack_.get(), this->saved_size_);
+  if (this->saved_size_ == 0) {
+    return;
+  }
+  char *buf = (this->saved_size_ <= kInlineSaveSize ? saved_inline_
+                                                     : saved_heap_.get());
+  memcpy(this->dummy_, buf, this->saved_size_);
+}
+
+Coroutine::~Coroutine() {
+  if (schedule_) {
+    CoroutineRegistry::Unlink(schedule_.get(), this);
+  }
+  ClearLocal();
+  if (use_shared_stk_ && stack_mem_) {
+    stack_mem_->bind_cnt_--;
+    if (stack_mem_->occupy_co_ == this) {
+      stack_mem_->occupy_co_ = nullptr;
+    }
+  }
 }
 
 std::shared_ptr<Coroutine>
 Coroutine::CreateCoroutine(std::shared_ptr<Schedule> sc,
                            std::shared_ptr<CoroutineAttr> attr,
                            std::function<void()> func) {
+  return Create(std::move(sc), std::move(attr), std::move(func),
+                __builtin_return_address(0));
+}
+
+std::shared_ptr<Coroutine>
+Coroutine::Create(std::shared_ptr<Schedule> sc,
+                  std::shared_ptr<CoroutineAttr> attr,
+                  std::function<void()> func, void *site) {
   if (!Schedule::GetThreadSchedule()) {
     Schedule::InitThreadSchedule();
   }
@@ -172,50 +403,59 @@ Coroutine::CreateCoroutine(std::shared_ptr<Schedule> sc,
   std::shared_ptr<Coroutine> co(new Coroutine(), Deletor());
 
   if (attr) {
-    // let the last 12 bits to be zero
-    if (attr->stack_size_ & 0xfff) {
-      attr->stack_size_ &= ~0xfff;
-      attr->stack_size_ += 0x1000;
-    }
+    AlignStackSize(attr);
     if (attr->shared_mem_) {
       co->use_shared_stk_ = true;
       co->stack_mem_ = SharedMem::GetStackMem(attr->shared_mem_);
     } else {
       co->use_shared_stk_ = false;
-      co->stack_mem_ = StackMem::AllocStack(attr->stack_size_);
+      size_t stack_size = attr->stack_size_;
+      if (attr->auto_stack_size_) {
+        stack_size = StackProfiler::PickStackSize(site, stack_size);
+      }
+      co->stack_mem_ = StackMem::AllocStack(stack_size, attr->use_mmap_stack_);
+      co->paint_stack_ = attr->paint_stack_ || attr->auto_stack_size_;
     }
   }
 
   co->schedule_ = sc;
   co->is_main_co_ = false;
   co->co_state_ = CoState::CO_READY;
-  co->saved_stack_ = nullptr;
+  co->saved_capacity_ = 0;
   co->saved_size_ = 0;
   co->dummy_ = nullptr;
-  getcontext(&co->coctx_);
+  co->id_ = s_co_id++;
+  memset(co->local_slots_, 0, sizeof(co->local_slots_));
+  co->local_inline_ = 0;
+  co->site_ = site;
+  if (sc) {
+    CoroutineRegistry::Link(sc.get(), co.get());
+  }
 
   if (attr) {
     co->func_.swap(func);
-    co->coctx_.uc_stack.ss_sp = co->stack_mem_->stack_buffer_.get();
-    co->coctx_.uc_stack.ss_size = co->stack_mem_->size_;
-    co->coctx_.uc_link = nullptr;
-    makecontext(&co->coctx_, (void (*)()) & Coroutine::CoMainFunc, 1,
-                (void *)co.get());
+    co->PaintStack();
+    CoctxMake(&co->coctx_, co->stack_mem_->stack_buffer_.get(),
+              co->stack_mem_->size_, &Coroutine::CoMainFunc, (void *)co.get());
+  } else {
+    CoctxInit(&co->coctx_);
   }
 
   return co;
 }
 
 void Coroutine::Resume() {
-  auto t_schedule = Schedule::GetThreadSchedule();
+  Schedule *t_schedule = Schedule::Current();
   if (co_state_ == CO_TERMINAL) {
     return;
   }
   SYLAR_ASSERT(co_state_ == CO_READY);
   SYLAR_ASSERT(t_schedule->running_co_->co_state_ == CO_RUNNING);
 
-  auto prev = t_schedule->running_co_;
-  auto next = shared_from_this();
+  // the resuming coroutine may never be resumed again, don't hold shared_ptr in
+  // this frame, see Schedule::Yield
+  Coroutine *prev = t_schedule->running_co_;
+  Coroutine *next = this;
   if (t_schedule->co_stack_.size() > 1) {
     // we cannot change the state of main coroutine
     prev->co_state_ = CO_READY;
@@ -227,19 +467,218 @@ void Coroutine::Resume() {
   t_schedule->SwapContext(prev, next);
 }
 
+void Coroutine::SwitchTo() {
+  Schedule *t_schedule = Schedule::Current();
+  if (co_state_ == CO_TERMINAL || t_schedule->running_co_ == this) {
+    return;
+  }
+  if (t_schedule->co_stack_.size() < 2) {
+    // main coroutine has nobody to return to, we cannot replace it
+    Resume();
+    return;
+  }
+  // the coroutines below the top are READY as well, but they are waiting for
+  // their callees to return
+  for (size_t i = 0; i + 1 < t_schedule->co_stack_.size(); i++) {
+    if (t_schedule->co_stack_[i] == this) {
+      throw std::runtime_error("cannot switch to a coroutine in execute stack");
+    }
+  }
+  SYLAR_ASSERT(co_state_ == CO_READY);
+
+  // no push and pop, the next coroutine just replaces the top of execute
+  // stack. don't hold shared_ptr in this frame, see Schedule::Yield
+  Coroutine *prev = t_schedule->running_co_;
+  Coroutine *next = this;
+  prev->co_state_ = CO_READY;
+  next->co_state_ = CO_RUNNING;
+  t_schedule->co_stack_[t_schedule->stack_top_ - 1] = next;
+  t_schedule->running_co_ = next;
+  t_schedule->SwapContext(prev, next);
+}
+
+size_t Coroutine::RegisterLocalSlot(void (*dtor)(void *)) {
+  size_t idx = s_local_slots++;
+  if (idx >= kMaxLocalSlots) {
+    throw std::runtime_error("too many CoroutineLocal");
+  }
+  s_local_dtors[idx] = dtor;
+  return idx;
+}
+
+void Coroutine::ClearLocal() {
+  size_t cnt = std::min(s_local_slots.load(), kMaxLocalSlots);
+  for (size_t i = 0; i < cnt; i++) {
+    // destructor may access other CoroutineLocal, clear the slot first
+    void *ptr = local_slots_[i];
+    if (ptr) {
+      local_slots_[i] = nullptr;
+      // a value stored inline needs no destructor
+      if (s_local_dtors[i]) {
+        s_local_dtors[i](ptr);
+      }
+    }
+  }
+  local_inline_ = 0;
+}
+
+void Coroutine::Cancel() {
+  cancelled_ = true;
+  // pairs with Park, which publishes parking before checking cancelled_
+  uint64_t seq = park_seq_.load();
+  if (seq != 0 && Wake(seq, WAKE_CANCEL)) {
+    // it's parked, so park_epoll_ is stable. resume it in its own thread
+    park_epoll_->PostResume(shared_from_this());
+  }
+}
+
+uint64_t Coroutine::Park(Epoll *epoll) {
+  park_epoll_ = epoll;
+  wake_reason_ = WAKE_NONE;
+  park_seq_ = ++last_seq_;
+  return last_seq_;
+}
+
+bool Coroutine::Wake(uint64_t seq, WakeReason reason) {
+  if (!park_seq_.compare_exchange_strong(seq, 0)) {
+    return false;
+  }
+  wake_reason_ = reason;
+  return true;
+}
+
+Coroutine::WakeReason Coroutine::Unpark() {
+  // stale wakers fail if it's resumed without Wake
+  park_seq_ = 0;
+  return wake_reason_;
+}
+
+void Coroutine::Reset(std::function<void()> func) {
+  SYLAR_ASSERT(co_state_ == CO_TERMINAL);
+  SYLAR_ASSERT(!use_shared_stk_ && stack_mem_);
+  func_.swap(func);
+  // a reused coroutine is a new coroutine for user
+  id_ = s_co_id++;
+  ClearLocal();
+  deadline_ = 0;
+  cancelled_ = false;
+  switches_ = 0;
+  run_cycles_ = 0;
+  stack_hwm_ = 0;
+  co_state_ = CO_READY;
+  saved_size_ = 0;
+  dummy_ = nullptr;
+  PaintStack();
+  CoctxMake(&coctx_, stack_mem_->stack_buffer_.get(), stack_mem_->size_,
+            &Coroutine::CoMainFunc, (void *)this);
+}
+
+void Coroutine::PaintStack() {
+  if (paint_stack_) {
+    StackProfiler::Paint((char *)stack_mem_->stack_buffer_.get(),
+                         stack_mem_->size_);
+  }
+}
+
 void Coroutine::CoMainFunc(void *ptr) {
   auto co = reinterpret_cast<Coroutine *>(ptr);
   co->func_();
+  // release the resource captured by function, coroutine may be cached by
+  // CoroutinePool for a long time
+  co->func_ = nullptr;
+  co->ClearLocal();
+  if (co->paint_stack_) {
+    // the deepest point has been reached, what's left is shallower
+    size_t used = StackProfiler::MeasureUsage(
+        (const char *)co->stack_mem_->stack_buffer_.get(),
+        co->stack_mem_->size_);
+    StackProfiler::Record(co->site_, used, co->stack_mem_->size_);
+    if (used > co->stack_hwm_.load(std::memory_order_relaxed)) {
+      co->stack_hwm_.store(used, std::memory_order_relaxed);
+    }
+  }
   co->co_state_ = CO_TERMINAL;
 
-  auto t_schedule = Schedule::Instance();
-  auto running_co = t_schedule->co_stack_[t_schedule->stack_top_ - 1];
-  auto pending_co = t_schedule->co_stack_[t_schedule->stack_top_ - 2];
+  // this frame will never be resumed, see Schedule::Yield
+  Schedule *t_schedule = Schedule::Current();
+  Coroutine *running_co = t_schedule->co_stack_[t_schedule->stack_top_ - 1];
+  Coroutine *pending_co = t_schedule->co_stack_[t_schedule->stack_top_ - 2];
   t_schedule->co_stack_.pop_back();
   t_schedule->stack_top_--;
 
   t_schedule->running_co_ = pending_co;
+  // it's not always the resumer of this coroutine, which was READY when this
+  // coroutine was entered by SwitchTo
+  pending_co->co_state_ = CO_RUNNING;
   t_schedule->SwapContext(running_co, pending_co);
 }
 
+std::shared_ptr<Coroutine>
+CoroutinePool::Acquire(std::shared_ptr<CoroutineAttr> attr,
+                       std::function<void()> func) {
+  // the creation site is our caller rather than this function
+  void *site = __builtin_return_address(0);
+  std::shared_ptr<Coroutine> co;
+  if (!attr || attr->shared_mem_) {
+    return Coroutine::Create(Schedule::GetThreadSchedule(), attr,
+                             std::move(func), site);
+  }
+  AlignStackSize(attr);
+  size_t stack_size = attr->stack_size_;
+  if (attr->auto_stack_size_) {
+    stack_size = StackProfiler::PickStackSize(site, stack_size);
+  }
+  auto it = free_.find(PoolKey(stack_size, attr->use_mmap_stack_));
+  if (it == free_.end() || it->second.empty()) {
+    stats_.misses_++;
+    return Coroutine::Create(Schedule::GetThreadSchedule(), attr,
+                             std::move(func), site);
+  }
+  stats_.hits_++;
+  co = std::move(it->second.back());
+  it->second.pop_back();
+  cached_--;
+  co->paint_stack_ = attr->paint_stack_ || attr->auto_stack_size_;
+  co->Reset(std::move(func));
+  co->site_ = site;
+  return co;
+}
+
+bool CoroutinePool::Release(std::shared_ptr<Coroutine> &co) {
+  if (!co || co->co_state_ != Coroutine::CO_TERMINAL || co->use_shared_stk_ ||
+      co->is_main_co_ || !co->stack_mem_ || co.use_count() != 1) {
+    return false;
+  }
+  stats_.releases_++;
+  auto key = PoolKey(co->stack_mem_->size_, co->stack_mem_->use_mmap_);
+  free_[key].emplace_back(std::move(co));
+  cached_++;
+  if (cached_ > high_watermark_) {
+    Trim(low_watermark_);
+  }
+  return true;
+}
+
+void CoroutinePool::SetWatermark(size_t low, size_t high) {
+  SYLAR_ASSERT(low <= high);
+  low_watermark_ = low;
+  high_watermark_ = high;
+  if (cached_ > high_watermark_) {
+    Trim(low_watermark_);
+  }
+}
+
+void CoroutinePool::Clear() { Trim(0); }
+
+void CoroutinePool::Trim(size_t target) {
+  for (auto &item : free_) {
+    auto &vec = item.second;
+    while (!vec.empty() && cached_ > target) {
+      vec.pop_back();
+      cached_--;
+      stats_.trims_++;
+    }
+  }
+}
+
 } // namespace Sylar
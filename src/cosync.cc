@@ -0,0 +1,178 @@
+#include "include/cosync.hh"
+#include <stdexcept>
+
+namespace Sylar {
+
+CoWaiter::CoWaiter() {
+  if (Schedule::GetInvokeDeepth() >= 2) {
+    co_ = Schedule::GetCurrentCo();
+    epoll_ = Epoll::GetThreadEpoll();
+  } else {
+    sem_ = std::make_shared<Semaphore>(0);
+  }
+}
+
+void CoWaiter::Suspend() {
+  if (co_) {
+    // the waker posts resuming to our event loop, which cannot run until we
+    // yield, so there is no lost wakeup
+    Schedule::Yield();
+  } else {
+    sem_->Wait();
+  }
+}
+
+void CoWaiter::Wake() {
+  if (co_) {
+    // the waiter is freed once it's resumed, copy what we need first
+    auto epoll = epoll_;
+    epoll->PostResume(co_);
+  } else {
+    // the waiter may be destructed as soon as it's notified
+    auto sem = sem_;
+    sem->Notify();
+  }
+}
+
+void CoMutex::Lock() {
+  SpinLock::ScopeLock lock(mu_);
+  if (!locked_) {
+    locked_ = true;
+    return;
+  }
+  CoWaiter waiter;
+  waiters_.push_back(&waiter);
+  lock.Unlock();
+  // the ownership is handed off to us when we are woken up
+  waiter.Suspend();
+}
+
+bool CoMutex::TryLock() {
+  SpinLock::ScopeLock lock(mu_);
+  if (locked_) {
+    return false;
+  }
+  locked_ = true;
+  return true;
+}
+
+void CoMutex::Unlock() {
+  SpinLock::ScopeLock lock(mu_);
+  if (!locked_) {
+    throw std::logic_error("CoMutex::Unlock: not locked");
+  }
+  if (waiters_.empty()) {
+    locked_ = false;
+    return;
+  }
+  CoWaiter *waiter = waiters_.front();
+  waiters_.pop_front();
+  lock.Unlock();
+  waiter->Wake();
+}
+
+void CoCondVar::Wait(CoMutex &mu) {
+  CoWaiter waiter;
+  {
+    SpinLock::ScopeLock lock(mu_);
+    waiters_.push_back(&waiter);
+  }
+  mu.Unlock();
+  waiter.Suspend();
+  mu.Lock();
+}
+
+void CoCondVar::NotifyOne() {
+  SpinLock::ScopeLock lock(mu_);
+  if (waiters_.empty()) {
+    return;
+  }
+  CoWaiter *waiter = waiters_.front();
+  waiters_.pop_front();
+  lock.Unlock();
+  waiter->Wake();
+}
+
+void CoCondVar::NotifyAll() {
+  std::deque<CoWaiter *> waiters;
+  {
+    SpinLock::ScopeLock lock(mu_);
+    waiters.swap(waiters_);
+  }
+  for (auto waiter : waiters) {
+    waiter->Wake();
+  }
+}
+
+void CoSemaphore::Wait() {
+  SpinLock::ScopeLock lock(mu_);
+  if (cnt_ > 0) {
+    cnt_--;
+    return;
+  }
+  CoWaiter waiter;
+  waiters_.push_back(&waiter);
+  lock.Unlock();
+  // the count is handed off to us when we are woken up
+  waiter.Suspend();
+}
+
+bool CoSemaphore::TryWait() {
+  SpinLock::ScopeLock lock(mu_);
+  if (cnt_ == 0) {
+    return false;
+  }
+  cnt_--;
+  return true;
+}
+
+void CoSemaphore::Notify() {
+  SpinLock::ScopeLock lock(mu_);
+  if (waiters_.empty()) {
+    cnt_++;
+    return;
+  }
+  CoWaiter *waiter = waiters_.front();
+  waiters_.pop_front();
+  lock.Unlock();
+  waiter->Wake();
+}
+
+size_t CoSemaphore::GetCount() {
+  SpinLock::ScopeLock lock(mu_);
+  return cnt_;
+}
+
+void WaitGroup::Add(size_t n) {
+  SpinLock::ScopeLock lock(mu_);
+  cnt_ += n;
+}
+
+void WaitGroup::Done() {
+  std::deque<CoWaiter *> waiters;
+  {
+    SpinLock::ScopeLock lock(mu_);
+    if (cnt_ == 0) {
+      throw std::logic_error("WaitGroup::Done: negative counter");
+    }
+    if (--cnt_ == 0) {
+      waiters.swap(waiters_);
+    }
+  }
+  for (auto waiter : waiters) {
+    waiter->Wake();
+  }
+}
+
+void WaitGroup::Wait() {
+  SpinLock::ScopeLock lock(mu_);
+  if (cnt_ == 0) {
+    return;
+  }
+  CoWaiter waiter;
+  waiters_.push_back(&waiter);
+  lock.Unlock();
+  waiter.Suspend();
+}
+
+} // namespace Sylar
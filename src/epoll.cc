@@ -1,13 +1,123 @@
 #include "include/epoll.hh"
+#include "include/coroutine.hh"
+#include <algorithm>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#ifndef EPIOCSPARAMS
+// since linux 6.9, the header of libc may lag behind
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 namespace Sylar {
 
 thread_local std::shared_ptr<Epoll> Epoll::t_epoll_ = nullptr;
-thread_local int64_t Epoll::reference_cnt_ = 0;
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p * count_);
+  if (rank >= count_) {
+    rank = count_ - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen > rank) {
+      if (i < (1 << kSubBits)) {
+        return i;
+      }
+      int shift = (i >> kSubBits) - 1;
+      uint64_t lower = (uint64_t)((1 << kSubBits) | (i & ((1 << kSubBits) - 1)))
+                       << shift;
+      return lower + ((1ull << shift) - 1);
+    }
+  }
+  return UINT64_MAX;
+}
+
+void LatencyHistogram::Reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+}
+
+double LoopStats::SpinHitRatio() const {
+  uint64_t spins = spin_hits_ + spin_misses_;
+  return spins == 0 ? 0 : (double)spin_hits_ / spins;
+}
+
+uint64_t LoopStats::LatencyNS(double p) const {
+  return CyclesToNS(latency_.Percentile(p));
+}
+
+static uint64_t MonotonicNS() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int BusyPollWait(int epfd, epoll_event *evs, int max, int timeout,
+                 uint64_t spin_ns, LoopStats &stats) {
+  stats.waits_++;
+  if (spin_ns == 0 || timeout == 0) {
+    return epoll_wait(epfd, evs, max, timeout);
+  }
+  if (timeout > 0) {
+    spin_ns = std::min(spin_ns, (uint64_t)timeout * 1000000);
+  }
+  uint64_t st = MonotonicNS();
+  uint64_t elapse = 0;
+  do {
+    int cnt = epoll_wait(epfd, evs, max, 0);
+    if (cnt != 0) {
+      stats.spin_hits_++;
+      return cnt;
+    }
+    elapse = MonotonicNS() - st;
+  } while (elapse < spin_ns);
+  stats.spin_misses_++;
+  if (timeout > 0) {
+    // the rest is rounded up, so that timers aren't handled before expiry
+    timeout -= std::min<uint64_t>(timeout, elapse / 1000000);
+  }
+  return epoll_wait(epfd, evs, max, timeout);
+}
+
+bool SetEpollBusyPoll(int epfd, uint64_t spin_us) {
+  epoll_params params;
+  memset(&params, 0, sizeof(params));
+  params.busy_poll_usecs = std::min<uint64_t>(spin_us, INT32_MAX);
+  // the default budget of busy polling sockets, a larger one needs
+  // CAP_NET_ADMIN
+  params.busy_poll_budget = spin_us > 0 ? 8 : 0;
+  params.prefer_busy_poll = spin_us > 0;
+  return ioctl(epfd, EPIOCSPARAMS, &params) == 0;
+}
 
 Epoll::~Epoll() {
-  if (--reference_cnt_ == 0) {
-    close(epfd_);
+  // the epoll of current thread is destructed when thread exits. don't use
+  // hooked close, which looks up the epoll of current thread again
+  if (epfd_ > 0) {
+    FdManager::Remove(epfd_);
+    close_f(epfd_);
+  }
+  if (wake_fd_ >= 0) {
+    FdManager::Remove(wake_fd_);
+    close_f(wake_fd_);
+  }
+  if (timer_fd_ >= 0) {
+    FdManager::Remove(timer_fd_);
+    close_f(timer_fd_);
   }
 }
 
@@ -15,112 +125,319 @@ std::shared_ptr<Epoll> Epoll::GetThreadEpoll() {
   if (!t_epoll_) {
     InitThreadEpoll();
   }
-  reference_cnt_++;
   return t_epoll_;
 }
 
 void Epoll::InitThreadEpoll() {
   t_epoll_ = Epoll::Instance();
   t_epoll_->epfd_ = epoll_create1(0);
+  t_epoll_->wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  FdManager::Reset(t_epoll_->wake_fd_, FdManager::FD_INIT |
+                                           FdManager::FD_POLLABLE |
+                                           FdManager::FD_NONBLOCK);
+  Epoll *epoll = t_epoll_.get();
+  t_epoll_->RegisterEvent(EventType::READ, t_epoll_->wake_fd_,
+                          [epoll]() { epoll->HandlePosted(); }, nullptr);
 }
 
-void Epoll::RegisterEvent(int type, int fd, std::function<void()> r_func,
-                          std::function<void()> w_func,
-                          std::shared_ptr<Coroutine> r_co,
-                          std::shared_ptr<Coroutine> w_co) {
-  // set O_NONBLOCKING to fd
-  auto state = fcntl(fd, F_GETFL);
-  if ((state & O_NONBLOCK) == 0) {
-    fcntl(fd, F_SETFL, state | O_NONBLOCK);
-  }
-
-  auto it = reg_event_.find(fd);
-  int op = 0;
-  if (it == reg_event_.end()) {
-    std::shared_ptr<EventCtx> ctx(new EventCtx);
-    ctx->type_ = type;
-    ctx->fd_ = fd;
-    ctx->r_callback_.swap(r_func);
-    ctx->w_callback_.swap(w_func);
-    ctx->r_co_ = r_co;
-    ctx->w_co_ = w_co;
-    reg_event_[fd] = ctx;
-    op = EPOLL_CTL_ADD;
-  } else {
-    if ((int)it->second->type_ & (int)type) {
+void Epoll::StopEventLoop(bool val) {
+  loop_.store(val, std::memory_order_release);
+  if (val) {
+    Wakeup();
+  }
+}
+
+void Epoll::SetBusyPoll(uint64_t spin_us) {
+  busy_poll_ns_ = spin_us * 1000;
+  SetEpollBusyPoll(epfd_, spin_us);
+}
+
+bool Epoll::SetPreciseTimer(bool val) {
+  if (!val) {
+    if (timer_fd_ >= 0) {
+      CancelEvent(EventType::READ, timer_fd_);
+      FlushEvent(timer_fd_);
+      FdManager::Remove(timer_fd_);
+      close_f(timer_fd_);
+      timer_fd_ = -1;
+    }
+    return true;
+  }
+  if (timer_fd_ >= 0) {
+    return true;
+  }
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd_ < 0) {
+    return false;
+  }
+  FdManager::Reset(timer_fd_, FdManager::FD_INIT | FdManager::FD_POLLABLE |
+                                  FdManager::FD_NONBLOCK);
+  timer_due_ = 0;
+  int fd = timer_fd_;
+  // timers are handled after waiting, the callback only drains timerfd
+  RegisterEvent(EventType::READ, fd,
+                [fd]() {
+                  uint64_t val;
+                  read_f(fd, &val, sizeof(val));
+                },
+                nullptr);
+  return true;
+}
+
+uint64_t Epoll::PrepareTimeout(uint64_t now, uint64_t max_timeout) {
+  uint64_t next = GetNextTimeoutUS(now);
+  if (next == 0) {
+    return 0;
+  }
+  if (timer_fd_ < 0 || next >= max_timeout * 1000) {
+    // rounded up, waking up earlier than the tick ends is useless
+    return next == kNoTimeout ? max_timeout
+                              : std::min((next + 999) / 1000, max_timeout);
+  }
+  // the earlier timer may be cancelled, then timerfd wakes us up for nothing
+  if (now + next != timer_due_) {
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = next / 1000000;
+    spec.it_value.tv_nsec = next % 1000000 * 1000;
+    timerfd_settime(timer_fd_, 0, &spec, nullptr);
+    timer_due_ = now + next;
+  }
+  return max_timeout;
+}
+
+void Epoll::Wakeup() {
+  uint64_t val = 1;
+  write_f(wake_fd_, &val, sizeof(val));
+}
+
+void Epoll::NotifyPosted() {
+  // pairs with the fence in HandlePosted, either the event loop sees the task
+  // or we see the flag cleared
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!post_notified_.load(std::memory_order_relaxed) &&
+      !post_notified_.exchange(true)) {
+    Wakeup();
+  }
+}
+
+void Epoll::Post(std::function<void()> func) {
+  posted_.Push(PostedTask{std::move(func), nullptr});
+  NotifyPosted();
+}
+
+void Epoll::PostResume(std::shared_ptr<Coroutine> co) {
+  // moving the reference into the slot allocates nothing
+  posted_.Push(PostedTask{nullptr, std::move(co)});
+  NotifyPosted();
+}
+
+void Epoll::HandlePosted() {
+  // drain eventfd before clearing the flag, producers setting it later write
+  // eventfd again. one read resets the counter
+  uint64_t val;
+  read_f(wake_fd_, &val, sizeof(val));
+  post_notified_.store(false, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // don't starve other events when tasks keep coming, the rest are handled by
+  // next iteration
+  const int kMaxBatch = 4096;
+  PostedTask task;
+  for (int i = 0; i < kMaxBatch; i++) {
+    if (!posted_.Pop(task)) {
       return;
     }
-    reg_event_[fd]->type_ = type;
-    reg_event_[fd]->r_callback_.swap(r_func);
-    reg_event_[fd]->r_co_ = r_co;
-    reg_event_[fd]->w_callback_.swap(w_func);
-    reg_event_[fd]->w_co_ = w_co;
-    op = EPOLL_CTL_MOD;
+    if (task.co_) {
+      std::shared_ptr<Coroutine> co(std::move(task.co_));
+      co->Resume();
+    } else {
+      std::function<void()> func(std::move(task.func_));
+      func();
+    }
   }
+  post_notified_.store(true);
+  Wakeup();
+}
+
+Epoll::EventCtx *Epoll::AllocEventCtx(int fd, uint32_t gen) {
+  size_t idx = fd >> kCtxChunkShift;
+  if (idx >= event_ctxs_.size()) {
+    event_ctxs_.resize(std::max(idx + 1, event_ctxs_.size() * 2));
+  }
+  if (!event_ctxs_[idx]) {
+    event_ctxs_[idx].reset(new EventCtx[kCtxChunkSize]);
+  }
+  EventCtx *ctx = &event_ctxs_[idx][fd & (kCtxChunkSize - 1)];
+  if (ctx->gen_ != gen) {
+    // the former fd was closed, which removed it from epoll
+    ctx->type_ = EventType::NONE;
+    ctx->flags_ = 0;
+    ctx->in_epoll_ = false;
+    ctx->armed_ = 0;
+    ctx->r_callback_ = nullptr;
+    ctx->w_callback_ = nullptr;
+    ctx->r_co_ = nullptr;
+    ctx->w_co_ = nullptr;
+    ctx->ptr_ = nullptr;
+    ctx->gen_ = gen;
+  }
+  ctx->fd_ = fd;
+  return ctx;
+}
+
+static int EpollCtl(int epfd, int op, int fd, int armed, void *ptr) {
+  FdManager::ThreadSyscalls().epoll_ctl_++;
   epoll_event ev;
   memset(&ev, 0, sizeof(ev));
-  ev.data.fd = fd;
-  if (type & EventType::READ) {
-    ev.events |= (EPOLLIN | EPOLLET);
+  ev.data.ptr = ptr;
+  if (armed & Epoll::EventType::READ) {
+    ev.events |= EPOLLIN;
   }
-  if (type & EventType::WRITE) {
-    ev.events |= (EPOLLOUT | EPOLLET);
+  if (armed & Epoll::EventType::WRITE) {
+    ev.events |= EPOLLOUT;
+  }
+  if ((armed & Epoll::EventFlag::LEVEL) == 0) {
+    ev.events |= EPOLLET;
+  }
+  if (armed & Epoll::EventFlag::ONESHOT) {
+    ev.events |= EPOLLONESHOT;
+  }
+  if (armed & Epoll::EventFlag::EXCLUSIVE) {
+    ev.events |= EPOLLEXCLUSIVE;
   }
-  epoll_ctl(epfd_, op, fd, &ev);
+  int rt = epoll_ctl(epfd, op, fd, &ev);
+  if (rt < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+    // fd was closed by close_f and the number is reused
+    rt = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  } else if (rt < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+    // the file is still opened by a dup of the closed fd
+    rt = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  return rt;
 }
 
-void Epoll::RegisterEvent(int type, int fd, std::shared_ptr<EventCtx> ptr) {
-  // set O_NONBLOCKING to fd
-  auto state = fcntl(fd, F_GETFL);
-  if ((state & O_NONBLOCK) == 0) {
-    fcntl(fd, F_SETFL, state | O_NONBLOCK);
+void Epoll::ApplyChange(EventCtx *ctx) {
+  int fd = ctx->fd_;
+  uint32_t gen = FdManager::GetGeneration(FdManager::GetState(fd));
+  if (ctx->gen_ != gen) {
+    // fd was closed after the change, nothing is left in kernel
+    AllocEventCtx(fd, gen);
+    return;
   }
-  int op = EPOLL_CTL_ADD;
-  if (reg_event_.find(fd) != reg_event_.end()) {
-    op = EPOLL_CTL_MOD;
+  int want = ctx->type_ == EventType::NONE ? 0 : ctx->type_ | ctx->flags_;
+  if (!ctx->in_epoll_) {
+    if (want != 0) {
+      EpollCtl(epfd_, EPOLL_CTL_ADD, fd, want, ctx);
+      ctx->in_epoll_ = true;
+    }
+  } else if (want == 0) {
+    EpollCtl(epfd_, EPOLL_CTL_DEL, fd, 0, ctx);
+    ctx->in_epoll_ = false;
+  } else if (want != ctx->armed_) {
+    if ((want | ctx->armed_) & EventFlag::EXCLUSIVE) {
+      // EPOLLEXCLUSIVE can only be set by EPOLL_CTL_ADD
+      EpollCtl(epfd_, EPOLL_CTL_DEL, fd, 0, ctx);
+      EpollCtl(epfd_, EPOLL_CTL_ADD, fd, want, ctx);
+    } else {
+      EpollCtl(epfd_, EPOLL_CTL_MOD, fd, want, ctx);
+    }
   }
-  reg_event_[fd] = ptr;
+  ctx->armed_ = want;
+}
 
-  epoll_event ev;
-  memset(&ev, 0, sizeof(ev));
-  ev.data.ptr = ptr.get();
-  printf("[Epoll::RegisterEvent] [fd]: %d, registing: %d\n", fd, type);
+void Epoll::FlushChanges() {
+  // the vector may grow when a change is applied, index instead of iterating
+  for (size_t i = 0; i < pending_.size(); i++) {
+    EventCtx *ctx = pending_[i];
+    if (ctx->pending_) {
+      ctx->pending_ = false;
+      ApplyChange(ctx);
+    }
+  }
+  pending_.clear();
+  if (uring_) {
+    uring_->Submit();
+  }
+}
+
+void Epoll::FlushEvent(int fd) {
+  EventCtx *ctx = GetEventCtx(fd);
+  if (ctx && ctx->pending_) {
+    // it's skipped by FlushChanges later
+    ctx->pending_ = false;
+    ApplyChange(ctx);
+  }
+}
+
+void Epoll::RegisterEvent(int type, int fd, std::function<void()> r_func,
+                          std::function<void()> w_func,
+                          std::shared_ptr<Coroutine> r_co,
+                          std::shared_ptr<Coroutine> w_co) {
+  FdManager::SetNonblock(fd);
+  uint32_t gen = FdManager::GetGeneration(FdManager::GetState(fd));
+  EventCtx *ctx = AllocEventCtx(fd, gen);
+  // the waiter of a registered event may change, always replace the
+  // callbacks of given type and keep the other one, e.g. a reader and a
+  // writer waiting on the same socket
   if (type & EventType::READ) {
-    ev.events |= (EPOLLIN | EPOLLET);
+    ctx->r_callback_.swap(r_func);
+    ctx->r_co_ = std::move(r_co);
   }
   if (type & EventType::WRITE) {
-    ev.events |= (EPOLLOUT | EPOLLET);
+    ctx->w_callback_.swap(w_func);
+    ctx->w_co_ = std::move(w_co);
   }
-  epoll_ctl(epfd_, op, fd, &ev);
+  ctx->type_ |= type & kEventMask;
+  ctx->flags_ = type & kFlagMask;
+  if ((ctx->type_ | ctx->flags_) != ctx->armed_ || !ctx->in_epoll_) {
+    MarkPending(ctx);
+  }
+}
+
+void Epoll::RegisterEvent(int type, int fd, std::shared_ptr<EventCtx> ptr) {
+  FdManager::SetNonblock(fd);
+  uint32_t gen = FdManager::GetGeneration(FdManager::GetState(fd));
+  EventCtx *ctx = AllocEventCtx(fd, gen);
+  ctx->type_ = type & kEventMask;
+  ctx->flags_ = type & kFlagMask;
+  ctx->r_callback_ = ptr->r_callback_;
+  ctx->w_callback_ = ptr->w_callback_;
+  ctx->r_co_ = ptr->r_co_;
+  ctx->w_co_ = ptr->w_co_;
+  ctx->ptr_ = ptr->ptr_;
+  MarkPending(ctx);
 }
 
 void Epoll::CancelEvent(int type, int fd) {
-  auto it = reg_event_.find(fd);
-  if (it == reg_event_.end()) {
+  EventCtx *ctx = GetEventCtx(fd);
+  if (!ctx) {
     return;
-  } else {
-    if ((it->second->type_ & type) == 0) {
-      return;
-    }
   }
-  epoll_event ev;
-  memset(&ev, 0, sizeof(ev));
-  ev.data.ptr = (void *)reg_event_[fd].get();
-  ev.events |= (EPOLLIN | EPOLLOUT | EPOLLET);
+  // release the resource captured by callbacks, even if the registration has
+  // been consumed by ONESHOT. the running callback has been taken out of
+  // EventCtx by event loop, see Schedule::EventloopOnce
   if (type & EventType::READ) {
-    ev.events &= ~EPOLLIN;
-    reg_event_[fd]->type_ &= ~EventType::READ;
+    ctx->r_callback_ = nullptr;
+    ctx->r_co_ = nullptr;
   }
   if (type & EventType::WRITE) {
-    ev.events &= ~EPOLLOUT;
-    reg_event_[fd]->type_ &= ~EventType::WRITE;
+    ctx->w_callback_ = nullptr;
+    ctx->w_co_ = nullptr;
+  }
+  if ((ctx->type_ & type) == 0) {
+    return;
+  }
+  uint32_t gen = FdManager::GetGeneration(FdManager::GetState(fd));
+  if (ctx->gen_ != gen) {
+    // the registration belongs to a closed fd, which is not in epoll
+    AllocEventCtx(fd, gen);
+    return;
   }
-  int op = EPOLL_CTL_MOD;
-  if (reg_event_[fd]->type_ == EventType::NONE) {
-    reg_event_.erase(fd);
-    op = EPOLL_CTL_DEL;
+  ctx->type_ &= ~(type & kEventMask);
+  if (ctx->type_ == EventType::NONE) {
+    ctx->ptr_ = nullptr;
   }
-  epoll_ctl(epfd_, op, fd, &ev);
+  MarkPending(ctx);
 }
 
-} // namespace Sylar
\ No newline at end of file
+} // namespace Sylar
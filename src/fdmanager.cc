@@ -0,0 +1,126 @@
+#include "include/fdmanager.hh"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace Sylar {
+
+std::atomic<std::atomic<uint32_t> *>
+    FdManager::s_chunks_[FdManager::kMaxChunks];
+
+std::atomic<uint32_t> *FdManager::GetSlot(int fd) {
+  if (fd < 0 || (fd >> kChunkShift) >= kMaxChunks) {
+    return nullptr;
+  }
+  auto &chunk = s_chunks_[fd >> kChunkShift];
+  std::atomic<uint32_t> *ptr = chunk.load(std::memory_order_acquire);
+  if (!ptr) {
+    std::atomic<uint32_t> *fresh = new std::atomic<uint32_t>[kChunkSize]();
+    if (chunk.compare_exchange_strong(ptr, fresh)) {
+      ptr = fresh;
+    } else {
+      // another thread allocated it first, ptr is updated by CAS
+      delete[] fresh;
+    }
+  }
+  return &ptr[fd & (kChunkSize - 1)];
+}
+
+// the flags of fd by its file type, 0 if fd is invalid
+static uint32_t Probe(int fd) {
+  FdManager::ThreadSyscalls().fstat_++;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return 0;
+  }
+  uint32_t flags = FdManager::FD_INIT;
+  switch (st.st_mode & S_IFMT) {
+  case S_IFSOCK:
+    flags |= FdManager::FD_SOCKET | FdManager::FD_POLLABLE;
+    break;
+  case S_IFIFO:
+  case 0:
+    // anonymous inode, e.g. eventfd and timerfd
+    flags |= FdManager::FD_POLLABLE;
+    break;
+  default:
+    // regular file and tty never return EAGAIN unless being set to nonblocking
+    break;
+  }
+  return flags;
+}
+
+uint32_t FdManager::GetState(int fd) {
+  auto slot = GetSlot(fd);
+  if (!slot) {
+    return 0;
+  }
+  uint32_t state = slot->load(std::memory_order_acquire);
+  if (state & FD_INIT) {
+    return state;
+  }
+  uint32_t flags = Probe(fd);
+  if (flags == 0) {
+    return state;
+  }
+  // keep the generation, lose to whoever set the flags first
+  uint32_t probed = (state & ~kFlagMask) | flags;
+  if (slot->compare_exchange_strong(state, probed)) {
+    return probed;
+  }
+  return state;
+}
+
+bool FdManager::SetNonblock(int fd) {
+  auto slot = GetSlot(fd);
+  uint32_t state = GetState(fd);
+  if ((state & FD_INIT) == 0) {
+    return false;
+  }
+  if (state & FD_NONBLOCK) {
+    return true;
+  }
+  ThreadSyscalls().fcntl_++;
+  int flag = fcntl(fd, F_GETFL);
+  if (flag < 0) {
+    return false;
+  }
+  if ((flag & O_NONBLOCK) == 0) {
+    ThreadSyscalls().fcntl_++;
+    fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+  }
+  // the fd may be closed and reused meanwhile, then the generation differs
+  slot->compare_exchange_strong(state, state | FD_NONBLOCK);
+  return true;
+}
+
+void FdManager::UpdateNonblock(int fd, bool nonblock) {
+  auto slot = GetSlot(fd);
+  if (!slot) {
+    return;
+  }
+  uint32_t state = slot->load(std::memory_order_relaxed);
+  uint32_t next;
+  do {
+    if ((state & FD_INIT) == 0) {
+      // it's probed by fcntl in SetNonblock
+      return;
+    }
+    next = nonblock ? state | FD_NONBLOCK : state & ~FD_NONBLOCK;
+  } while (next != state && !slot->compare_exchange_weak(state, next));
+}
+
+void FdManager::Remove(int fd) { Reset(fd, 0); }
+
+void FdManager::Reset(int fd, uint32_t flags) {
+  auto slot = GetSlot(fd);
+  if (!slot) {
+    return;
+  }
+  uint32_t state = slot->load(std::memory_order_relaxed);
+  uint32_t next;
+  do {
+    next = (((state >> kFlagBits) + 1) << kFlagBits) | flags;
+  } while (!slot->compare_exchange_weak(state, next));
+}
+
+} // namespace Sylar
@@ -1,6 +1,12 @@
 #include "include/hook.hh"
 #include "include/coroutine.hh"
 #include "include/epoll.hh"
+#include "include/fdmanager.hh"
+#include "include/uring.hh"
+#include <cerrno>
+#include <cstdarg>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 
 static bool is_hook_enable = true;
 
@@ -11,6 +17,7 @@ void SetHookEnable(bool val) { is_hook_enable = val; }
 #define HOOK_FUNC(XX)                                                          \
   XX(sleep)                                                                    \
   XX(usleep)                                                                   \
+  XX(nanosleep)                                                                \
   XX(read)                                                                     \
   XX(readv)                                                                    \
   XX(recv)                                                                     \
@@ -21,7 +28,16 @@ void SetHookEnable(bool val) { is_hook_enable = val; }
   XX(send)                                                                     \
   XX(sendto)                                                                   \
   XX(sendmsg)                                                                  \
-  XX(close)
+  XX(close)                                                                    \
+  XX(socket)                                                                   \
+  XX(socketpair)                                                               \
+  XX(accept)                                                                   \
+  XX(accept4)                                                                  \
+  XX(pipe)                                                                     \
+  XX(pipe2)                                                                    \
+  XX(connect)                                                                  \
+  XX(fcntl)                                                                    \
+  XX(ioctl)
 
 void hook_init() {
   static bool is_init = false;
@@ -38,6 +54,130 @@ struct _HookIniter {
 // function
 static _HookIniter _hook_initer;
 
+// return the errno of a coroutine which cannot wait any more, or 0
+static int CheckInterrupt(Coroutine *co) {
+  if (co->IsCancelled()) {
+    return ECANCELED;
+  }
+  uint64_t deadline = co->GetDeadline();
+  if (deadline != 0 && Clock::NowMS() >= deadline) {
+    return ETIMEDOUT;
+  }
+  return 0;
+}
+
+/**
+ * @brief suspend co which is parked at seq, until a waker registered by caller
+ * wakes it up, its deadline passes or it's cancelled. the deadline timer is
+ * removed before returning
+ */
+static Coroutine::WakeReason Suspend(const Coroutine::ptr &co, Epoll *epoll,
+                                     uint64_t seq) {
+  // Cancel invoked before parking cannot see the parking, check it again
+  bool woken = co->IsCancelled() && co->Wake(seq, Coroutine::WAKE_CANCEL);
+  TimerHandle timer;
+  uint64_t deadline = co->GetDeadline();
+  if (!woken && deadline != 0) {
+    uint64_t now = Clock::NowMS();
+    if (now >= deadline) {
+      woken = co->Wake(seq, Coroutine::WAKE_TIMEOUT);
+    } else {
+      timer = epoll->AddTimer(deadline - now, [co, seq]() {
+        if (co->Wake(seq, Coroutine::WAKE_TIMEOUT)) {
+          co->Resume();
+        }
+      });
+    }
+  }
+  if (!woken) {
+    Schedule::Yield();
+  }
+  if (timer) {
+    epoll->CancelTimer(timer);
+  }
+  return co->Unpark();
+}
+
+static int ReasonToErrno(Coroutine::WakeReason reason) {
+  if (reason == Coroutine::WAKE_TIMEOUT) {
+    return ETIMEDOUT;
+  }
+  if (reason == Coroutine::WAKE_CANCEL) {
+    return ECANCELED;
+  }
+  return 0;
+}
+
+// wait for fd to be ready, return 0 if it's ready, otherwise the errno
+static int WaitEvent(int fd, uint32_t event) {
+  auto co = Schedule::GetCurrentCo();
+  int err = CheckInterrupt(co.get());
+  if (err != 0) {
+    return err;
+  }
+  auto epoll = Epoll::GetThreadEpoll();
+  uint64_t seq = co->Park(epoll.get());
+  std::function<void()> func = [co, seq]() {
+    if (co->Wake(seq, Coroutine::WAKE_EVENT)) {
+      co->Resume();
+    }
+  };
+  if (event & Epoll::EventType::READ) {
+    epoll->RegisterEvent(Epoll::EventType::READ, fd, std::move(func), nullptr);
+  } else {
+    epoll->RegisterEvent(Epoll::EventType::WRITE, fd, nullptr, std::move(func));
+  }
+  auto reason = Suspend(co, epoll.get(), seq);
+  // the event may occur later, don't let it resume us somewhere else, and
+  // don't let the closure keep us alive after we return. it's batched until
+  // next epoll_wait, so waiting again on fd doesn't touch the kernel
+  epoll->CancelEvent(event, fd);
+  return ReasonToErrno(reason);
+}
+
+// suspend current coroutine for us microseconds, return 0 or the errno. the
+// precision depends on the granularity of TimeWheel, see Epoll::SetPreciseTimer
+static int SleepUS(uint64_t us) {
+  auto co = Schedule::GetCurrentCo();
+  int err = CheckInterrupt(co.get());
+  if (err != 0) {
+    return err;
+  }
+  auto epoll = Epoll::GetThreadEpoll();
+  uint64_t seq = co->Park(epoll.get());
+  auto timer = epoll->AddTimerUS(us, [co, seq]() {
+    if (co->Wake(seq, Coroutine::WAKE_EVENT)) {
+      co->Resume();
+    }
+  });
+  auto reason = Suspend(co, epoll.get(), seq);
+  epoll->CancelTimer(timer);
+  return ReasonToErrno(reason);
+}
+
+/**
+ * @brief perform the I/O on a socket by the io_uring of current thread if
+ * it's enabled, see IoUring::SetEnable
+ *
+ * @return false if it's not performed or kernel returns EAGAIN instead of
+ * polling, e.g. with MSG_DONTWAIT, then the caller goes on with epoll
+ */
+template <typename Op> static bool RingIO(int fd, ssize_t &n, Op op) {
+  if (!GetHookEnable() || !IoUring::IsEnabled() ||
+      Schedule::GetInvokeDeepth() < 2) {
+    return false;
+  }
+  if ((FdManager::GetState(fd) & FdManager::FD_SOCKET) == 0) {
+    return false;
+  }
+  IoUring *ring = IoUring::GetThreadRing();
+  if (!ring) {
+    return false;
+  }
+  n = op(ring);
+  return n >= 0 || errno != EAGAIN;
+}
+
 template <typename OriginFunc, typename... Args>
 static ssize_t do_io(int fd, OriginFunc func, uint32_t event, Args &&...args) {
 
@@ -45,8 +185,25 @@ static ssize_t do_io(int fd, OriginFunc func, uint32_t event, Args &&...args) {
     return func(fd, std::forward<Args>(args)...);
   }
 
-  int flag = fcntl(fd, F_GETFL);
-  fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+  // regular files and ttys are never waited, don't make them nonblocking
+  uint32_t state = FdManager::GetState(fd);
+  if ((state & FdManager::FD_POLLABLE) == 0) {
+    return func(fd, std::forward<Args>(args)...);
+  }
+  if ((state & FdManager::FD_NONBLOCK) == 0) {
+    FdManager::SetNonblock(fd);
+  }
+
+  // main coroutine cannot be suspended, it retries until fd is ready, and
+  // deadline and cancellation don't apply to it
+  bool in_co = Sylar::Schedule::GetInvokeDeepth() >= 2;
+  if (in_co) {
+    int err = CheckInterrupt(Sylar::Schedule::GetCurrentCo().get());
+    if (err != 0) {
+      errno = err;
+      return -1;
+    }
+  }
 
 retry:
   ssize_t n = func(fd, std::forward<Args>(args)...);
@@ -56,18 +213,12 @@ retry:
   }
   if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
     // if current call return immediately
-    auto epoll = Sylar::Epoll::GetThreadEpoll();
-    if (event & Sylar::Epoll::EventType::READ) {
-      epoll->RegisterEvent((Sylar::Epoll::EventType)event, fd, nullptr, nullptr,
-                           Sylar::Schedule::GetCurrentCo());
-    }
-    if (event & Sylar::Epoll::EventType::WRITE) {
-      epoll->RegisterEvent((Sylar::Epoll::EventType)event, fd, nullptr, nullptr,
-                           nullptr, Sylar::Schedule::GetCurrentCo());
-    }
-    // main coroutine may invoke these function, we cannot yield main coroutine
-    if (Sylar::Schedule::GetInvokeDeepth() >= 2) {
-      Sylar::Schedule::Yield();
+    if (in_co) {
+      int err = WaitEvent(fd, event);
+      if (err != 0) {
+        errno = err;
+        return -1;
+      }
     }
     goto retry;
   }
@@ -88,84 +239,347 @@ HOOK_FUNC(XX)
 #undef XX
 
 unsigned int sleep(unsigned int seconds) {
-  if (!Sylar::GetHookEnable()) {
+  if (!Sylar::GetHookEnable() || Sylar::Schedule::GetInvokeDeepth() < 2) {
     return sleep_f(seconds);
   }
   SYLAR_INFO_LOG(SYLAR_LOG_ROOT) << "hook sleep execute";
 
-  auto epoll = Sylar::Epoll::GetThreadEpoll();
-  epoll->AddTimer(seconds * 1000, nullptr, Sylar::Schedule::GetCurrentCo());
-  Sylar::Schedule::Yield();
-
+  uint64_t st = Sylar::GetElapseFromRebootMS();
+  int err = Sylar::SleepUS(seconds * 1000000ull);
+  if (err != 0) {
+    // the number of seconds left
+    errno = err;
+    uint64_t slept = Sylar::GetElapseFromRebootMS() - st;
+    return slept >= seconds * 1000ull ? 0 : seconds - slept / 1000;
+  }
   return 0;
 }
 
 int usleep(useconds_t usec) {
-  if (!Sylar::GetHookEnable()) {
+  if (!Sylar::GetHookEnable() || Sylar::Schedule::GetInvokeDeepth() < 2) {
     return usleep_f(usec);
   }
   SYLAR_INFO_LOG(SYLAR_LOG_ROOT) << "hook usleep execute";
-  auto epoll = Sylar::Epoll::GetThreadEpoll();
-  epoll->AddTimer(usec / 1000, nullptr, Sylar::Schedule::GetCurrentCo());
-  Sylar::Schedule::Yield();
+  int err = Sylar::SleepUS(usec);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  if (!Sylar::GetHookEnable() || Sylar::Schedule::GetInvokeDeepth() < 2) {
+    return nanosleep_f(req, rem);
+  }
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  // never sleep shorter than requested
+  uint64_t us = req->tv_sec * 1000000ull + (req->tv_nsec + 999) / 1000;
+  uint64_t st = Sylar::GetElapseFromRebootUS();
+  int err = Sylar::SleepUS(us);
+  if (err != 0) {
+    if (rem) {
+      uint64_t slept = Sylar::GetElapseFromRebootUS() - st;
+      uint64_t left = slept >= us ? 0 : us - slept;
+      rem->tv_sec = left / 1000000;
+      rem->tv_nsec = left % 1000000 * 1000;
+    }
+    errno = err;
+    return -1;
+  }
   return 0;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
+  ssize_t n;
+  if (Sylar::RingIO(fd, n, [&](Sylar::IoUring *ring) {
+        return ring->Recv(fd, buf, count, 0);
+      })) {
+    return n;
+  }
   return Sylar::do_io(fd, read_f, Sylar::Epoll::EventType::READ, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t n;
+  if (Sylar::RingIO(fd, n, [&](Sylar::IoUring *ring) {
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec *>(iov);
+        msg.msg_iovlen = iovcnt;
+        return ring->RecvMsg(fd, &msg, 0);
+      })) {
+    return n;
+  }
   return Sylar::do_io(fd, readv_f, Sylar::Epoll::EventType::READ, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        return ring->Recv(sockfd, buf, len, flags);
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, recv_f, Sylar::Epoll::EventType::READ, buf, len,
                       flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        iovec iov{buf, len};
+        msghdr msg{};
+        msg.msg_name = src_addr;
+        msg.msg_namelen = src_addr && addrlen ? *addrlen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t rt = ring->RecvMsg(sockfd, &msg, flags);
+        if (rt >= 0 && src_addr && addrlen) {
+          *addrlen = msg.msg_namelen;
+        }
+        return rt;
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, recvfrom_f, Sylar::Epoll::EventType::READ, buf,
                       len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        return ring->RecvMsg(sockfd, msg, flags);
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, recvmsg_f, Sylar::Epoll::EventType::READ, msg,
                       flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
+  ssize_t n;
+  if (Sylar::RingIO(fd, n, [&](Sylar::IoUring *ring) {
+        return ring->Send(fd, buf, count, 0);
+      })) {
+    return n;
+  }
   return Sylar::do_io(fd, write_f, Sylar::Epoll::EventType::WRITE, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-  return Sylar::do_io(fd, write_f, Sylar::Epoll::EventType::WRITE, iov, iovcnt);
+  ssize_t n;
+  if (Sylar::RingIO(fd, n, [&](Sylar::IoUring *ring) {
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec *>(iov);
+        msg.msg_iovlen = iovcnt;
+        return ring->SendMsg(fd, &msg, 0);
+      })) {
+    return n;
+  }
+  return Sylar::do_io(fd, writev_f, Sylar::Epoll::EventType::WRITE, iov,
+                      iovcnt);
 }
 
 ssize_t send(int sockfd, const void *buf, size_t len, int flags) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        return ring->Send(sockfd, buf, len, flags);
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, send_f, Sylar::Epoll::EventType::WRITE, buf, len,
                       flags);
 }
 
 ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
                const struct sockaddr *dest_addr, socklen_t addrlen) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        iovec iov{const_cast<void *>(buf), len};
+        msghdr msg{};
+        msg.msg_name = const_cast<sockaddr *>(dest_addr);
+        msg.msg_namelen = addrlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        return ring->SendMsg(sockfd, &msg, flags);
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, sendto_f, Sylar::Epoll::EventType::WRITE, buf,
                       len, flags, dest_addr, addrlen);
 }
 
 ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+  ssize_t n;
+  if (Sylar::RingIO(sockfd, n, [&](Sylar::IoUring *ring) {
+        return ring->SendMsg(sockfd, msg, flags);
+      })) {
+    return n;
+  }
   return Sylar::do_io(sockfd, sendmsg_f, Sylar::Epoll::EventType::WRITE, msg,
                       flags);
 }
 
 int close(int fd) {
-  if (!Sylar::GetHookEnable()) {
-    return close_f(fd);
+  if (Sylar::GetHookEnable()) {
+    auto epoll = Sylar::Epoll::GetThreadEpoll();
+    epoll->CancelEvent(Sylar::Epoll::EventType::READ, fd);
+    epoll->CancelEvent(Sylar::Epoll::EventType::WRITE, fd);
+    // don't defer it, a dup of fd may keep the file in epoll after closing
+    epoll->FlushEvent(fd);
+    if (epoll->uring_) {
+      epoll->uring_->CancelFd(fd);
+    }
   }
-  auto epoll = Sylar::Epoll::GetThreadEpoll();
-  epoll->CancelEvent(Sylar::Epoll::EventType::READ, fd);
-  epoll->CancelEvent(Sylar::Epoll::EventType::WRITE, fd);
+  // the cache is kept even if hook is disabled, the number may be reused
+  Sylar::FdManager::Remove(fd);
   return close_f(fd);
 }
+
+static const uint32_t kSocketFlags = Sylar::FdManager::FD_INIT |
+                                     Sylar::FdManager::FD_SOCKET |
+                                     Sylar::FdManager::FD_POLLABLE;
+
+static const uint32_t kPipeFlags =
+    Sylar::FdManager::FD_INIT | Sylar::FdManager::FD_POLLABLE;
+
+int socket(int domain, int type, int protocol) {
+  int fd = socket_f(domain, type, protocol);
+  if (fd >= 0) {
+    Sylar::FdManager::Reset(
+        fd, kSocketFlags |
+                (type & SOCK_NONBLOCK ? Sylar::FdManager::FD_NONBLOCK : 0));
+  }
+  return fd;
+}
+
+int socketpair(int domain, int type, int protocol, int sv[2]) {
+  int rt = socketpair_f(domain, type, protocol, sv);
+  if (rt == 0) {
+    uint32_t flags = kSocketFlags |
+                     (type & SOCK_NONBLOCK ? Sylar::FdManager::FD_NONBLOCK : 0);
+    Sylar::FdManager::Reset(sv[0], flags);
+    Sylar::FdManager::Reset(sv[1], flags);
+  }
+  return rt;
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+  ssize_t fd;
+  if (!Sylar::RingIO(sockfd, fd, [&](Sylar::IoUring *ring) {
+        return ring->Accept(sockfd, addr, addrlen, 0);
+      })) {
+    fd = accept_f(sockfd, addr, addrlen);
+  }
+  if (fd >= 0) {
+    // O_NONBLOCK of listening socket isn't inherited
+    Sylar::FdManager::Reset(fd, kSocketFlags);
+  }
+  return fd;
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+  ssize_t fd;
+  if (!Sylar::RingIO(sockfd, fd, [&](Sylar::IoUring *ring) {
+        return ring->Accept(sockfd, addr, addrlen, flags);
+      })) {
+    fd = accept4_f(sockfd, addr, addrlen, flags);
+  }
+  if (fd >= 0) {
+    Sylar::FdManager::Reset(
+        fd, kSocketFlags |
+                (flags & SOCK_NONBLOCK ? Sylar::FdManager::FD_NONBLOCK : 0));
+  }
+  return fd;
+}
+
+int pipe(int fds[2]) {
+  int rt = pipe_f(fds);
+  if (rt == 0) {
+    Sylar::FdManager::Reset(fds[0], kPipeFlags);
+    Sylar::FdManager::Reset(fds[1], kPipeFlags);
+  }
+  return rt;
+}
+
+int pipe2(int fds[2], int flags) {
+  int rt = pipe2_f(fds, flags);
+  if (rt == 0) {
+    uint32_t state =
+        kPipeFlags | (flags & O_NONBLOCK ? Sylar::FdManager::FD_NONBLOCK : 0);
+    Sylar::FdManager::Reset(fds[0], state);
+    Sylar::FdManager::Reset(fds[1], state);
+  }
+  return rt;
+}
+
+int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+  ssize_t rt;
+  if (Sylar::RingIO(sockfd, rt, [&](Sylar::IoUring *ring) {
+        return ring->Connect(sockfd, addr, addrlen);
+      })) {
+    return rt;
+  }
+  return connect_f(sockfd, addr, addrlen);
+}
+
+// the O_NONBLOCK set by the caller is recorded, otherwise hooked I/O trusts
+// the cached state and may block, see FdManager::SetNonblock
+int fcntl(int fd, int cmd, ...) {
+  va_list va;
+  va_start(va, cmd);
+  int rt;
+  switch (cmd) {
+  case F_SETFL: {
+    int arg = va_arg(va, int);
+    rt = fcntl_f(fd, cmd, arg);
+    if (rt == 0) {
+      Sylar::FdManager::UpdateNonblock(fd, arg & O_NONBLOCK);
+    }
+    break;
+  }
+  case F_DUPFD:
+  case F_DUPFD_CLOEXEC:
+  case F_SETFD:
+  case F_SETOWN:
+  case F_SETSIG:
+  case F_SETLEASE:
+  case F_NOTIFY:
+  case F_SETPIPE_SZ:
+  case F_ADD_SEALS:
+    rt = fcntl_f(fd, cmd, va_arg(va, int));
+    break;
+  case F_GETFD:
+  case F_GETFL:
+  case F_GETOWN:
+  case F_GETSIG:
+  case F_GETLEASE:
+  case F_GETPIPE_SZ:
+  case F_GET_SEALS:
+    rt = fcntl_f(fd, cmd);
+    break;
+  default:
+    // the rest take a pointer, e.g. struct flock
+    rt = fcntl_f(fd, cmd, va_arg(va, void *));
+    break;
+  }
+  va_end(va);
+  return rt;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  va_list va;
+  va_start(va, request);
+  void *arg = va_arg(va, void *);
+  va_end(va);
+  int rt = ioctl_f(fd, request, arg);
+  if (rt == 0 && request == FIONBIO) {
+    Sylar::FdManager::UpdateNonblock(fd, *(int *)arg != 0);
+  }
+  return rt;
+}
 }
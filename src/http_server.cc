@@ -1,4 +1,5 @@
 #include "include/http_server.hh"
+#include "include/introspect.hh"
 
 namespace Sylar {
 
@@ -19,6 +20,7 @@ HttpServer::HttpServer(const std::string &host, std::uint16_t port, bool use_co)
   worker_threads_.resize(kThreadPoolSize);
   worker_epoll_fd_.resize(kThreadPoolSize);
   worker_epoll_event_.resize(kThreadPoolSize);
+  worker_stats_.resize(kThreadPoolSize);
   for (int i = 0; i < kThreadPoolSize; i++) {
     worker_epoll_event_[i].resize(kMaxEvent);
   }
@@ -59,6 +61,9 @@ void HttpServer::Start() {
           << strerror(errno);
       throw std::runtime_error("[HttpServer::HttpServer] epoll create failed");
     }
+    if (busy_poll_us_ > 0) {
+      SetEpollBusyPoll(worker_epoll_fd_[i], busy_poll_us_);
+    }
   }
 
   // running thread
@@ -84,6 +89,17 @@ void HttpServer::Stop() {
   close(sock_fd_);
 }
 
+void HttpServer::RegisterCoroutineDump(const std::string &path) {
+  RegisterHttpRequestHandler(path, HttpMethod::GET,
+                             [](const HttpRequest &request) {
+                               HttpResponse response(HttpStatusCode::Ok);
+                               response.SetHeaders("Content-Type",
+                                                   "text/plain");
+                               response.SetContent(CoroutineRegistry::Dump());
+                               return response;
+                             });
+}
+
 void HttpServer::ListenClient() {
   EventData *client_data = nullptr;
   sockaddr_in client_addr;
@@ -103,6 +119,12 @@ void HttpServer::ListenClient() {
     }
     std::cout << "client connect, fd is " << client_fd << std::endl;
     active = true;
+    if (busy_poll_us_ > 0) {
+      // raising it above net.core.busy_read needs CAP_NET_ADMIN, the workers
+      // spin anyway
+      int usec = (int)std::min<std::uint64_t>(busy_poll_us_, INT32_MAX);
+      setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+    }
     // register in epoll
     client_data = new EventData();
     client_data->fd_ = client_fd;
@@ -116,20 +138,24 @@ void HttpServer::EventLoop(int thread) {
   EventData *client_data = nullptr;
   int epfd = worker_epoll_fd_[thread];
   auto &events = worker_epoll_event_[thread];
+  auto &stats = worker_stats_[thread];
   bool active = true;
   while (running_) {
-    if (!active) {
+    if (!active && busy_poll_us_ == 0) {
       std::this_thread::sleep_for(
           std::chrono::milliseconds(sleep_time_(random_engine_)));
     }
-    int cnt = epoll_wait(epfd, events.data(), kMaxEvent, kMaxEpollWaitTimeout);
+    int cnt = BusyPollWait(epfd, events.data(), kMaxEvent,
+                           kMaxEpollWaitTimeout, busy_poll_us_ * 1000, stats);
     if (cnt <= 0) {
       active = false;
       continue;
     }
     active = true;
+    uint64_t returned = ReadCycles();
     for (int i = 0; i < cnt; i++) {
       auto &ev = events[i];
+      stats.latency_.Record(ReadCycles() - returned);
       client_data = reinterpret_cast<EventData *>(ev.data.ptr);
       if ((ev.events & EPOLLHUP) || (ev.events & EPOLLERR)) {
         // the peer close socket
@@ -222,16 +248,32 @@ void HttpServer::HandleEpollEvent(int epfd, std::uint32_t event,
 
 void HttpServer::EventLoopWithCo(int thread) {
   auto schedule = Schedule::GetThreadSchedule();
+  // each READ or WRITE event is handled by a short-lived coroutine, we reuse
+  // terminated coroutines and their stacks instead of allocating new ones
+  auto pool = CoroutinePool::GetThreadPool();
+  auto attr = std::make_shared<CoroutineAttr>();
   int epfd = worker_epoll_fd_[thread];
   auto &events = worker_epoll_event_[thread];
+  auto &stats = worker_stats_[thread];
+  // the callbacks capture two pointers, which libstdc++ stores inside
+  // std::function only if they are trivially copyable and at most 16 bytes.
+  // std::bind with epfd doesn't fit and allocates on every event
+  struct LoopCtx {
+    HttpServer *server_;
+    int epfd_;
+  } loop{this, epfd};
+  LoopCtx *ctx = &loop;
   EventData *client_data = nullptr;
   while (running_) {
-    int cnt = epoll_wait(epfd, events.data(), kMaxEvent, kMaxEpollWaitTimeout);
+    int cnt = BusyPollWait(epfd, events.data(), kMaxEvent,
+                           kMaxEpollWaitTimeout, busy_poll_us_ * 1000, stats);
     if (cnt <= 0) {
       continue;
     }
+    uint64_t returned = ReadCycles();
     for (int i = 0; i < cnt; i++) {
       auto &ev = events[i];
+      stats.latency_.Record(ReadCycles() - returned);
       client_data = reinterpret_cast<EventData *>(ev.data.ptr);
       if ((ev.events & EPOLLHUP) || (ev.events & EPOLLERR)) {
         // the peer close socket
@@ -239,17 +281,17 @@ void HttpServer::EventLoopWithCo(int thread) {
         close(client_data->fd_);
         delete client_data;
       } else if (ev.events & EPOLLIN) {
-        auto attr = std::make_shared<CoroutineAttr>();
-        auto rco = Coroutine::CreateCoroutine(
-            schedule, attr,
-            std::bind(&HttpServer::HandleReadEvent, this, epfd, client_data));
+        auto rco = pool->Acquire(attr, [ctx, client_data]() {
+          ctx->server_->HandleReadEvent(ctx->epfd_, client_data);
+        });
         rco->Resume();
+        pool->Release(rco);
       } else if (ev.events & EPOLLOUT) {
-        auto attr = std::make_shared<CoroutineAttr>();
-        auto wco = Coroutine::CreateCoroutine(
-            schedule, attr,
-            std::bind(&HttpServer::HandleWriteEvent, this, epfd, client_data));
+        auto wco = pool->Acquire(attr, [ctx, client_data]() {
+          ctx->server_->HandleWriteEvent(ctx->epfd_, client_data);
+        });
         wco->Resume();
+        pool->Release(wco);
       } else {
         // unexpective error
         ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_data->fd_);
@@ -261,40 +303,29 @@ void HttpServer::EventLoopWithCo(int thread) {
 }
 
 void HttpServer::HandleReadEvent(int epfd, EventData *data) {
+  // the coroutine terminates after handling one READ event, so that it can be
+  // recycled by CoroutinePool. next READ event will be handled by another
+  // coroutine
   EventData *request = data;
   EventData *response = nullptr;
   int client_fd = request->fd_;
-  while (true) {
-    if (!request) {
-      Schedule::Yield();
-    }
-    auto bytes = recv(client_fd, request->buf_, kMaxBufferSize, 0);
-    if (bytes > 0) {
-      request->length_ = bytes;
-      response = new EventData();
-      response->fd_ = client_fd;
-      HandleRequestData(request, response);
-      ControlEpollEvent(epfd, EPOLL_CTL_MOD, client_fd, EPOLLOUT | EPOLLET,
-                        response);
-      Schedule::Yield();
-    } else if (bytes == 0) {
-      ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
-      close(client_fd);
-      delete request;
-      request = nullptr;
-      Schedule::Yield();
-    } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        Schedule::Yield();
-      } else {
-        // unexpective error occur
-        ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
-        close(client_fd);
-        delete request;
-        request = nullptr;
-        Schedule::Yield();
-      }
-    }
+  auto bytes = recv(client_fd, request->buf_, kMaxBufferSize, 0);
+  if (bytes > 0) {
+    request->length_ = bytes;
+    response = new EventData();
+    response->fd_ = client_fd;
+    HandleRequestData(request, response);
+    ControlEpollEvent(epfd, EPOLL_CTL_MOD, client_fd, EPOLLOUT | EPOLLET,
+                      response);
+  } else if (bytes == 0) {
+    ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
+    close(client_fd);
+    delete request;
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    // unexpective error occur
+    ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
+    close(client_fd);
+    delete request;
   }
 }
 
@@ -302,44 +333,32 @@ void HttpServer::HandleWriteEvent(int epfd, EventData *data) {
   EventData *request = nullptr;
   EventData *response = data;
   int client_fd = response->fd_;
-  while (true) {
-    if (!response) {
-      Schedule::Yield();
-    }
-    auto bytes = send(client_fd, response->buf_ + response->cursor_,
-                      response->length_, 0);
-    if (bytes > 0) {
-      response->cursor_ += bytes;
-      response->length_ -= bytes;
-      Schedule::Yield();
-    } else if (bytes == 0) {
-      if (response->keep_alive_) {
-        delete response;
-        response = nullptr;
-        request = new EventData();
-        request->fd_ = client_fd;
-        ControlEpollEvent(epfd, EPOLL_CTL_MOD, client_fd, EPOLLIN | EPOLLET,
-                          request);
-        Schedule::Yield();
-      } else {
-        delete response;
-        response = nullptr;
-        // don't keep alive
-        ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
-        close(client_fd);
-        Schedule::Yield();
-      }
+  auto bytes = send(client_fd, response->buf_ + response->cursor_,
+                    response->length_, 0);
+  if (bytes > 0) {
+    response->cursor_ += bytes;
+    response->length_ -= bytes;
+    // re-arm WRITE event, the next coroutine will go on writing or find
+    // there is nothing left to write
+    ControlEpollEvent(epfd, EPOLL_CTL_MOD, client_fd, EPOLLOUT | EPOLLET,
+                      response);
+  } else if (bytes == 0) {
+    if (response->keep_alive_) {
+      delete response;
+      request = new EventData();
+      request->fd_ = client_fd;
+      ControlEpollEvent(epfd, EPOLL_CTL_MOD, client_fd, EPOLLIN | EPOLLET,
+                        request);
     } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        Schedule::Yield();
-      } else {
-        ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
-        close(client_fd);
-        delete response;
-        response = nullptr;
-        Schedule::Yield();
-      }
+      delete response;
+      // don't keep alive
+      ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
+      close(client_fd);
     }
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    ControlEpollEvent(epfd, EPOLL_CTL_DEL, client_fd);
+    close(client_fd);
+    delete response;
   }
 }
 
@@ -0,0 +1,357 @@
+#ifndef __SYLAR_CHANNEL_HH__
+#define __SYLAR_CHANNEL_HH__
+
+#include "cosync.hh"
+#include "epoll.hh"
+#include "mutex.hh"
+#include <algorithm>
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace Sylar {
+
+class Selector;
+
+// the state of a blocked Send, Recv or Select. a Select is blocked on several
+// channels, whoever sets fired_ first completes it, the others skip it
+struct ChanWaitState {
+  std::atomic<bool> fired_{false};
+  int index_ = -1; // the index of fired case in Select, -1 means timeout
+  CoWaiter waiter_;
+
+  bool Fire(int index) {
+    bool expected = false;
+    if (!fired_.compare_exchange_strong(expected, true)) {
+      return false;
+    }
+    index_ = index;
+    return true;
+  }
+};
+
+/**
+ * @brief multi-producer multi-consumer channel passing T between coroutines.
+ * Send and Recv suspend current coroutine(or block the thread in main
+ * coroutine) instead of spinning, see cosync.hh
+ *
+ * capacity 0 means rendezvous, sender is suspended until a receiver takes the
+ * value. kUnbounded means Send never suspends
+ */
+template <typename T> class Channel : boost::noncopyable {
+public:
+  friend Selector;
+
+  typedef std::shared_ptr<Channel> ptr;
+
+  static constexpr size_t kUnbounded = SIZE_MAX;
+
+  explicit Channel(size_t capacity = kUnbounded)
+      : capacity_(capacity), closed_(false) {}
+
+  /**
+   * @brief val is moved into channel or a receiver directly
+   *
+   * @return false if channel is closed, val is left untouched
+   */
+  bool Send(T &&val) {
+    std::shared_ptr<ChanWaitState> wake;
+    SpinLock::ScopeLock lock(mu_);
+    int ret = TrySendLocked(val, wake);
+    if (ret != 0) {
+      lock.Unlock();
+      if (wake) {
+        wake->waiter_.Wake();
+      }
+      return ret > 0;
+    }
+    auto state = std::make_shared<ChanWaitState>();
+    bool ok = false;
+    sendq_.push_back(Waiter{state, 0, &val, &ok});
+    lock.Unlock();
+    state->waiter_.Suspend();
+    return ok;
+  }
+
+  bool Send(const T &val) {
+    T tmp(val);
+    return Send(std::move(tmp));
+  }
+
+  /**
+   * @return false if channel is closed and no value is left
+   */
+  bool Recv(T &out) {
+    std::shared_ptr<ChanWaitState> wake;
+    SpinLock::ScopeLock lock(mu_);
+    int ret = TryRecvLocked(out, wake);
+    if (ret != 0) {
+      lock.Unlock();
+      if (wake) {
+        wake->waiter_.Wake();
+      }
+      return ret > 0;
+    }
+    auto state = std::make_shared<ChanWaitState>();
+    bool ok = false;
+    recvq_.push_back(Waiter{state, 0, &out, &ok});
+    lock.Unlock();
+    state->waiter_.Suspend();
+    return ok;
+  }
+
+  // return false if the channel is full or closed
+  bool TrySend(T &&val) {
+    std::shared_ptr<ChanWaitState> wake;
+    SpinLock::ScopeLock lock(mu_);
+    int ret = TrySendLocked(val, wake);
+    lock.Unlock();
+    if (wake) {
+      wake->waiter_.Wake();
+    }
+    return ret > 0;
+  }
+
+  // return false if the channel is empty
+  bool TryRecv(T &out) {
+    std::shared_ptr<ChanWaitState> wake;
+    SpinLock::ScopeLock lock(mu_);
+    int ret = TryRecvLocked(out, wake);
+    lock.Unlock();
+    if (wake) {
+      wake->waiter_.Wake();
+    }
+    return ret > 0;
+  }
+
+  /**
+   * @brief blocked senders fail, receivers drain the buffered values and then
+   * fail
+   */
+  void Close() {
+    std::vector<std::shared_ptr<ChanWaitState>> wakes;
+    {
+      SpinLock::ScopeLock lock(mu_);
+      if (closed_) {
+        return;
+      }
+      closed_ = true;
+      // receivers are blocked only when buffer is empty
+      for (auto *queue : {&recvq_, &sendq_}) {
+        for (auto &w : *queue) {
+          if (w.state_->Fire(w.idx_)) {
+            wakes.push_back(w.state_);
+          }
+        }
+        queue->clear();
+      }
+    }
+    for (auto &state : wakes) {
+      state->waiter_.Wake();
+    }
+  }
+
+  bool IsClosed() {
+    SpinLock::ScopeLock lock(mu_);
+    return closed_;
+  }
+
+  // the number of buffered values
+  size_t Size() {
+    SpinLock::ScopeLock lock(mu_);
+    return buffer_.size();
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+private:
+  struct Waiter {
+    std::shared_ptr<ChanWaitState> state_;
+    int idx_;  // the index of case in Select
+    T *slot_;  // receiver: where to store the value, sender: the value to send
+    bool *ok_; // set to true when the operation succeeds
+  };
+
+  // return 1 on success, -1 if channel is closed, 0 if it would block. the
+  // waiter to be woken up is returned by wake
+  int TrySendLocked(T &val, std::shared_ptr<ChanWaitState> &wake) {
+    if (closed_) {
+      return -1;
+    }
+    // receivers are waiting, which means buffer is empty, hand it off
+    while (!recvq_.empty()) {
+      Waiter w = std::move(recvq_.front());
+      recvq_.pop_front();
+      if (!w.state_->Fire(w.idx_)) {
+        // fired by another channel of Select or timeout
+        continue;
+      }
+      *w.slot_ = std::move(val);
+      if (w.ok_) {
+        *w.ok_ = true;
+      }
+      wake = std::move(w.state_);
+      return 1;
+    }
+    if (buffer_.size() < capacity_) {
+      buffer_.push_back(std::move(val));
+      return 1;
+    }
+    return 0;
+  }
+
+  int TryRecvLocked(T &out, std::shared_ptr<ChanWaitState> &wake) {
+    if (!buffer_.empty()) {
+      out = std::move(buffer_.front());
+      buffer_.pop_front();
+      // there is room now, move the value of a blocked sender into buffer
+      TakeSender(&buffer_, nullptr, wake);
+      return 1;
+    }
+    // rendezvous channel, take the value from sender directly
+    if (TakeSender(nullptr, &out, wake)) {
+      return 1;
+    }
+    return closed_ ? -1 : 0;
+  }
+
+  bool TakeSender(std::deque<T> *buffer, T *out,
+                  std::shared_ptr<ChanWaitState> &wake) {
+    while (!sendq_.empty()) {
+      Waiter w = std::move(sendq_.front());
+      sendq_.pop_front();
+      if (!w.state_->Fire(w.idx_)) {
+        continue;
+      }
+      if (buffer) {
+        buffer->push_back(std::move(*w.slot_));
+      } else {
+        *out = std::move(*w.slot_);
+      }
+      if (w.ok_) {
+        *w.ok_ = true;
+      }
+      wake = std::move(w.state_);
+      return true;
+    }
+    return false;
+  }
+
+  void RemoveWaiter(const ChanWaitState *state) {
+    SpinLock::ScopeLock lock(mu_);
+    for (auto *queue : {&recvq_, &sendq_}) {
+      queue->erase(std::remove_if(queue->begin(), queue->end(),
+                                  [state](const Waiter &w) {
+                                    return w.state_.get() == state;
+                                  }),
+                   queue->end());
+    }
+  }
+
+  SpinLock mu_;
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> buffer_;
+  std::deque<Waiter> recvq_; // blocked receivers
+  std::deque<Waiter> sendq_; // blocked senders
+};
+
+/**
+ * @brief wait for the first ready operation among several channels, e.g.
+ *
+ *  Selector sel;
+ *  sel.AddRecv(ch1, v1);
+ *  sel.AddSend(ch2, v2);
+ *  switch (sel.Select(100)) {...}
+ *
+ * a Selector can be reused by calling Select again
+ */
+class Selector : boost::noncopyable {
+public:
+  /**
+   * @param ok set to false if the case is fired because the channel is closed
+   */
+  template <typename T>
+  void AddRecv(Channel<T> &ch, T &out, bool *ok = nullptr) {
+    Channel<T> *c = &ch;
+    T *slot = &out;
+    Case cs;
+    cs.mu_ = &ch.mu_;
+    cs.try_ = [c, slot, ok](std::shared_ptr<ChanWaitState> &wake) {
+      int ret = c->TryRecvLocked(*slot, wake);
+      if (ret != 0 && ok) {
+        *ok = ret > 0;
+      }
+      return ret;
+    };
+    cs.enqueue_ = [c, slot, ok](const std::shared_ptr<ChanWaitState> &state,
+                                int idx) {
+      if (ok) {
+        *ok = false;
+      }
+      c->recvq_.push_back(typename Channel<T>::Waiter{state, idx, slot, ok});
+    };
+    cs.remove_ = [c](const ChanWaitState *state) { c->RemoveWaiter(state); };
+    cases_.push_back(std::move(cs));
+  }
+
+  /**
+   * @param val moved into channel when the case is fired successfully
+   */
+  template <typename T>
+  void AddSend(Channel<T> &ch, T &val, bool *ok = nullptr) {
+    Channel<T> *c = &ch;
+    T *slot = &val;
+    Case cs;
+    cs.mu_ = &ch.mu_;
+    cs.try_ = [c, slot, ok](std::shared_ptr<ChanWaitState> &wake) {
+      int ret = c->TrySendLocked(*slot, wake);
+      if (ret != 0 && ok) {
+        *ok = ret > 0;
+      }
+      return ret;
+    };
+    cs.enqueue_ = [c, slot, ok](const std::shared_ptr<ChanWaitState> &state,
+                                int idx) {
+      if (ok) {
+        *ok = false;
+      }
+      c->sendq_.push_back(typename Channel<T>::Waiter{state, idx, slot, ok});
+    };
+    cs.remove_ = [c](const ChanWaitState *state) { c->RemoveWaiter(state); };
+    cases_.push_back(std::move(cs));
+  }
+
+  /**
+   * @param timeout milliseconds, negative means waiting forever and zero
+   * means polling without suspending
+   *
+   * @return the index of fired case in the order of adding, -1 on timeout
+   *
+   * @attention waiting with positive timeout relies on the timer of current
+   * thread, so it must be invoked in coroutine
+   */
+  int Select(int64_t timeout = -1);
+
+  size_t Size() const { return cases_.size(); }
+
+private:
+  struct Case {
+    SpinLock *mu_;
+    std::function<int(std::shared_ptr<ChanWaitState> &)> try_;
+    std::function<void(const std::shared_ptr<ChanWaitState> &, int)> enqueue_;
+    std::function<void(const ChanWaitState *)> remove_;
+  };
+
+  std::vector<Case> cases_;
+  uint64_t start_ = 0; // rotates the first case to try, for fairness
+};
+
+} // namespace Sylar
+
+#endif
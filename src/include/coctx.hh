@@ -0,0 +1,87 @@
+#ifndef __SYLAR_COCTX_HH__
+#define __SYLAR_COCTX_HH__
+
+#include <cstddef>
+#include <cstdint>
+
+// the hand-written context switch only saves callee-saved registers, which is
+// what the ABI requires us to preserve across a function call. ucontext also
+// saves and restores signal mask, which costs a rt_sigprocmask syscall in each
+// swapcontext. define SYLAR_USE_UCONTEXT (cmake -DSYLAR_USE_UCONTEXT=ON) or
+// build on other architecture to fall back to ucontext
+#if defined(SYLAR_USE_UCONTEXT) || !(defined(__x86_64__) || defined(__aarch64__))
+#define SYLAR_COCTX_UCONTEXT 1
+#include <ucontext.h>
+#endif
+
+namespace Sylar {
+
+struct CoContext {
+#ifdef SYLAR_COCTX_UCONTEXT
+  ucontext_t uctx_;
+#elif defined(__x86_64__)
+  // clang-format off
+  // the layout is shared with coctx_swap.S, don't reorder
+  //
+  // | rip | rsp | rbx | rbp | r12 | r13 | r14 | r15 | mxcsr/fpucw | rdi |
+  // 0     8     16    24    32    40    48    56    64            72
+  // clang-format on
+  static constexpr int kRegs = 10;
+  void *regs_[kRegs];
+#elif defined(__aarch64__)
+  // clang-format off
+  // | x19 - x28 | x29(fp) | x30(lr) | sp | d8 - d15 | x0 |
+  // 0           80        88        96   104        168
+  // clang-format on
+  static constexpr int kRegs = 22;
+  void *regs_[kRegs];
+#endif
+};
+
+/**
+ * @brief initialize context, when this context is switched in at the first
+ * time, func(arg) will be executed in stack [stack, stack + size)
+ *
+ * @attention func must not return, since there is no successor context
+ */
+void CoctxMake(CoContext *ctx, void *stack, size_t size, void (*func)(void *),
+               void *arg);
+
+/**
+ * @brief initialize context for main coroutine, which runs on thread stack and
+ * only be saved by CoctxSwap
+ */
+void CoctxInit(CoContext *ctx);
+
+/**
+ * @brief the stack pointer saved in ctx when it was switched out. the stack
+ * below it is dead, while everything above, including the frames of callers
+ * of the switch which may not be inlined, is live
+ *
+ * @return nullptr if it's unknown, e.g. ucontext on other architecture
+ */
+void *CoctxStackPointer(const CoContext *ctx);
+
+} // namespace Sylar
+
+#ifndef SYLAR_COCTX_UCONTEXT
+extern "C" {
+// implemented in coctx_swap.S, save current registers to from and load
+// registers from to
+void coctx_swap(Sylar::CoContext *from, Sylar::CoContext *to);
+}
+#endif
+
+namespace Sylar {
+
+inline void CoctxSwap(CoContext *from, CoContext *to) {
+#ifdef SYLAR_COCTX_UCONTEXT
+  swapcontext(&from->uctx_, &to->uctx_);
+#else
+  coctx_swap(from, to);
+#endif
+}
+
+} // namespace Sylar
+
+#endif
@@ -1,20 +1,61 @@
 #ifndef __SYLAR_COROUTINE_HH__
 #define __SYLAR_COROUTINE_HH__
 
+#include "coctx.hh"
 #include "epoll.hh"
+#include "mutex.hh"
 #include "util.hh"
 #include <atomic>
 #include <cstring>
 #include <functional>
 #include <memory>
-#include <ucontext.h>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace Sylar {
 
 class Coroutine;
+class CoroutinePool;
+class CoroutineRegistry;
 class Epoll;
 
+// statistics of coroutine stacks allocated by mmap in one thread. a stack may
+// be released in another thread, so it's protected by lock
+class MmapStackStats {
+public:
+  friend class MemoryAlloc;
+
+  typedef std::shared_ptr<MmapStackStats> ptr;
+
+  static std::shared_ptr<MmapStackStats> GetThreadStats() {
+    static thread_local std::shared_ptr<MmapStackStats> instance(
+        new MmapStackStats());
+    return instance;
+  }
+
+  // the number of living stacks
+  size_t GetStackCount();
+
+  // the bytes of address space reserved for stacks, guard pages excluded
+  size_t GetReservedBytes();
+
+  // the bytes of stacks backed by physical memory, which is measured by
+  // mincore. untouched stack pages cost nothing
+  size_t GetResidentBytes();
+
+private:
+  MmapStackStats() : reserved_(0) {}
+
+  void AddStack(void *stack, size_t size);
+  void DelStack(void *stack);
+
+  SpinLock mu_;
+  std::unordered_map<void *, size_t> stacks_; // [stack, size]
+  size_t reserved_;
+};
+
 class MemoryAlloc {
 public:
   static std::shared_ptr<void> AllocSharedMemory(size_t size) {
@@ -32,26 +73,53 @@ public:
     }
     return ptr;
   }
+
+  /**
+   * @brief reserve stack by mmap, with a PROT_NONE guard page below it. stack
+   * overflow will trigger SIGSEGV instead of corrupting heap, and pages are
+   * only committed when they are touched
+   *
+   * @param size the size of stack, must be multiple of page size
+   * @return the start point of stack, guard page is not included
+   */
+  static std::shared_ptr<void> AllocMmapStack(size_t size);
 };
 
 struct StackMem {
   // this stack memory is occupied by which coroutine, this field only used in
   // shared memory. in this scenario, this stack memory may be shared by
   // multiply coroutine, we should save this stack memory to previous
-  // coroutine's space and resume this stack memory from next coroutine's space
-  std::shared_ptr<Coroutine> occupy_co_;
+  // coroutine's space and resume this stack memory from next coroutine's space.
+  // it doesn't own the coroutine, which clears it when destructing
+  Coroutine *occupy_co_;
   // the size of stack memory
   size_t size_;
+  // whether allocated by mmap with guard page or not
+  bool use_mmap_;
+  // the number of living coroutines bound to this stack memory, only used in
+  // shared memory
+  size_t bind_cnt_;
+  // the logical time of the last eviction of occupy_co_, only used in shared
+  // memory
+  uint64_t last_evict_;
   // the start point of stack memory
   // the end point of stack memory, which is equal to
   // stack_buffer_ + size_
   std::shared_ptr<void> stack_buffer_;
 
-  static std::shared_ptr<StackMem> AllocStack(size_t size) {
+  static std::shared_ptr<StackMem> AllocStack(size_t size,
+                                              bool use_mmap = false) {
     std::shared_ptr<StackMem> ptr(new StackMem());
     ptr->size_ = size;
+    ptr->use_mmap_ = use_mmap;
+    ptr->bind_cnt_ = 0;
+    ptr->last_evict_ = 0;
     ptr->occupy_co_ = nullptr;
-    ptr->stack_buffer_ = MemoryAlloc::AllocUniqueMemory(size);
+    if (use_mmap) {
+      ptr->stack_buffer_ = MemoryAlloc::AllocMmapStack(size);
+    } else {
+      ptr->stack_buffer_ = MemoryAlloc::AllocUniqueMemory(size);
+    }
     return ptr;
   }
 };
@@ -64,8 +132,6 @@ struct SharedMem {
   // shared memory consist of an array of stack memory, each stack memory can be
   // used by one coroutine
   std::vector<std::shared_ptr<StackMem>> stack_array_;
-  // used to find empty stack memory in stack_array_
-  size_t idx_;
 
   /**
    * @param count the number of coroutine will share this shared memory
@@ -75,7 +141,6 @@ struct SharedMem {
     auto ptr = std::make_shared<SharedMem>();
     ptr->count_ = count;
     ptr->size_ = size;
-    ptr->idx_ = 0;
     ptr->stack_array_.resize(count);
     for (size_t i = 0; i < count; i++) {
       ptr->stack_array_[i] = StackMem::AllocStack(size);
@@ -83,13 +148,29 @@ struct SharedMem {
     return ptr;
   }
 
+  /**
+   * @brief pick the stack memory bound to the fewest coroutines, ties are
+   * broken by choosing the least-recently-evicted one. coroutines are spread
+   * over stack memories which are not switched frequently, so that fewer
+   * stacks need to be saved
+   */
   static std::shared_ptr<StackMem> GetStackMem(std::shared_ptr<SharedMem> ptr) {
     if (!ptr) {
       return nullptr;
     }
-    size_t i = ptr->idx_ % ptr->count_;
-    ptr->idx_++;
-    return ptr->stack_array_[i];
+    StackMem *best = nullptr;
+    size_t idx = 0;
+    for (size_t i = 0; i < ptr->count_; i++) {
+      StackMem *cur = ptr->stack_array_[i].get();
+      if (!best || cur->bind_cnt_ < best->bind_cnt_ ||
+          (cur->bind_cnt_ == best->bind_cnt_ &&
+           cur->last_evict_ < best->last_evict_)) {
+        best = cur;
+        idx = i;
+      }
+    }
+    best->bind_cnt_++;
+    return ptr->stack_array_[idx];
   }
 };
 
@@ -97,10 +178,21 @@ struct CoroutineAttr {
   typedef std::shared_ptr<CoroutineAttr> ptr;
   size_t stack_size_;
   std::shared_ptr<SharedMem> shared_mem_;
+  // allocate independent stack by mmap with guard page, ignored when
+  // shared_mem_ is set
+  bool use_mmap_stack_;
+  // measure the stack usage of independent stack, see StackProfiler
+  bool paint_stack_;
+  // shrink stack_size_ to the size recommended by StackProfiler for the
+  // creation site, implies paint_stack_
+  bool auto_stack_size_;
 
   CoroutineAttr() {
     stack_size_ = 64 * 1024;
     shared_mem_ = nullptr;
+    use_mmap_stack_ = false;
+    paint_stack_ = false;
+    auto_stack_size_ = false;
   }
 };
 
@@ -108,6 +200,7 @@ class Schedule {
 public:
   friend Coroutine;
   friend Epoll;
+  friend CoroutineRegistry;
 
   typedef std::shared_ptr<Schedule> ptr;
 
@@ -117,44 +210,76 @@ public:
    * either we declare destructor as public or privide custom private deletor
    * and delcare it as friend
    */
-  ~Schedule() = default;
+  ~Schedule();
 
-  static std::shared_ptr<Schedule> Instance() {
+  // return by reference, copying shared_ptr is an atomic operation
+  static const std::shared_ptr<Schedule> &Instance() {
     static thread_local std::shared_ptr<Schedule> instance(new Schedule());
     return instance;
   }
 
-  static std::shared_ptr<Schedule> GetThreadSchedule() {
+  static const std::shared_ptr<Schedule> &GetThreadSchedule() {
     if (!t_schedule_) {
       InitThreadSchedule();
     }
     return t_schedule_;
   }
 
+  // the raw pointer of GetThreadSchedule, used in the path of switching
+  static Schedule *Current() {
+    if (!t_schedule_) {
+      InitThreadSchedule();
+    }
+    return t_schedule_.get();
+  }
+
   static void InitThreadSchedule();
 
+  friend uint64_t GetCoroutineId();
+
   static void Eventloop(std::shared_ptr<Epoll> epoll);
 
+  /**
+   * @brief one iteration of Eventloop: wait at most max_timeout milliseconds
+   * (or until the next timeout event), then handle ready events and timeout
+   * events. it spins before blocking if Epoll::SetBusyPoll is set
+   *
+   * @return the number of ready events
+   */
+  static int EventloopOnce(const std::shared_ptr<Epoll> &epoll,
+                           uint64_t max_timeout);
+
   static std::shared_ptr<Coroutine> GetCurrentCo();
 
-  static size_t GetInvokeDeepth() {
-    return GetThreadSchedule()->co_stack_.size();
-  }
+  static size_t GetInvokeDeepth() { return Current()->co_stack_.size(); }
 
   static void Yield();
 
 private:
-  static void SwapContext(std::shared_ptr<Coroutine> prev,
-                          std::shared_ptr<Coroutine> next);
+  static void SwapContext(Coroutine *prev, Coroutine *next);
 
   Schedule() = default;
 
-  // the execute stack of coroutine. main coroutine always in stack buttom
-  std::vector<std::shared_ptr<Coroutine>> co_stack_;
+  // the execute stack of coroutine. main coroutine always in stack buttom.
+  // coroutines are kept alive by whom resumes them, so we only record raw
+  // pointers here, which avoids refcount traffic on every switch
+  std::vector<Coroutine *> co_stack_;
   // the stack pointer, always point to the top of stack
   size_t stack_top_;
   // the running coroutine
-  std::shared_ptr<Coroutine> running_co_;
+  Coroutine *running_co_;
+  // the main coroutine of current thread
+  std::shared_ptr<Coroutine> main_co_;
+
+  // coroutines created in this schedule, linked by Coroutine::live_next_.
+  // the lock is only taken when creating and destructing coroutines, and by
+  // CoroutineRegistry
+  SpinLock live_mu_;
+  Coroutine *live_head_ = nullptr;
+  size_t live_cnt_ = 0;
+  pid_t tid_ = 0; // the thread owning this schedule
+  // the cycles when running coroutine was switched in, see ReadCycles
+  std::atomic<uint64_t> switch_cycles_{0};
 
   static thread_local std::shared_ptr<Schedule> t_schedule_;
 };
@@ -162,17 +287,30 @@ private:
 class Coroutine : public std::enable_shared_from_this<Coroutine> {
 public:
   friend Schedule;
+  friend CoroutinePool;
+  friend CoroutineRegistry;
 
   typedef std::shared_ptr<Coroutine> ptr;
 
+  // the max number of CoroutineLocal
+  static constexpr size_t kMaxLocalSlots = 16;
+
   enum CoState {
     CO_READY = 0,
     CO_RUNNING = 1,
     CO_TERMINAL = 2,
   };
 
+  // why a coroutine parked in hooked function is woken up
+  enum WakeReason {
+    WAKE_NONE = 0,    // resumed by others directly
+    WAKE_EVENT = 1,   // the awaited event occurs
+    WAKE_TIMEOUT = 2, // the deadline passes
+    WAKE_CANCEL = 3,  // cancelled by Cancel
+  };
+
   struct Deletor {
-    void operator()(Coroutine *ptr) { free(ptr); }
+    void operator()(Coroutine *ptr) { delete ptr; }
   };
 
   static std::shared_ptr<Coroutine>
@@ -182,20 +320,120 @@ public:
 
   void Resume();
 
+  /**
+   * @brief transfer control from current coroutine to this coroutine directly.
+   * this coroutine takes the place of current coroutine in the execute stack,
+   * so when it yields or terminates, the control returns to whom resumed
+   * current coroutine. current coroutine is suspended and can be resumed or
+   * switched to later. it's equivalent to Resume when invoked in main
+   * coroutine
+   *
+   * @attention caller must keep this coroutine alive until it yields
+   *
+   * @throw std::runtime_error if this coroutine is waiting in the execute
+   * stack, e.g. the resumer of current coroutine, which would be on the stack
+   * twice
+   */
+  void SwitchTo();
+
   CoState GetCoState() { return co_state_; }
 
+  bool IsSharedStack() { return use_shared_stk_; }
+
+  // the id is unique in process, main coroutine is 0
+  uint64_t GetId() const { return id_; }
+
+  // 0 for main coroutine
+  size_t GetStackSize() const { return stack_mem_ ? stack_mem_->size_ : 0; }
+
+  /**
+   * @brief hooked I/O and sleep fail with ETIMEDOUT once the deadline passes,
+   * including the one this coroutine is parked in
+   *
+   * @param deadline absolute time in milliseconds, see GetElapseFromRebootMS.
+   * zero means no deadline
+   */
+  void SetDeadline(uint64_t deadline) { deadline_ = deadline; }
+
+  uint64_t GetDeadline() const { return deadline_; }
+
+  /**
+   * @brief hooked I/O and sleep of this coroutine fail with ECANCELED from now
+   * on, the one it's parked in is woken up. can be invoked in any thread
+   *
+   * @attention the thread owning this coroutine must be alive
+   */
+  void Cancel();
+
+  bool IsCancelled() const { return cancelled_.load(); }
+
+  /**
+   * @brief used by hooked functions to wait for several wakers, e.g. I/O
+   * event, deadline timer and Cancel. Park records the parking and returns
+   * its sequence, only the first waker calling Wake with this sequence wins
+   * and should resume the coroutine. after being resumed, the coroutine calls
+   * Unpark to get the reason
+   *
+   * @param epoll the epoll of current thread, Cancel resumes coroutine by it
+   */
+  uint64_t Park(Epoll *epoll);
+
+  bool Wake(uint64_t seq, WakeReason reason);
+
+  WakeReason Unpark();
+
+  /**
+   * @brief allocate a slot of coroutine local storage
+   *
+   * @param dtor destroy the value in slot when coroutine terminates, nullptr
+   * if the value is stored in the slot itself and trivially destructible
+   * @return the index of slot
+   *
+   * @throw std::runtime_error if kMaxLocalSlots have been allocated
+   */
+  static size_t RegisterLocalSlot(void (*dtor)(void *));
+
+  // the slot of running coroutine
+  static void *&GetLocalSlot(size_t idx) {
+    return Schedule::Current()->running_co_->local_slots_[idx];
+  }
+
+  // a bit per slot of running coroutine, set if it holds a value inline
+  static uint32_t &GetLocalInline() {
+    return Schedule::Current()->running_co_->local_inline_;
+  }
+
 private:
   static void CoMainFunc(void *ptr);
 
   void SaveStack();
   void ResumeStack();
+  char *SaveBuffer(size_t len);
+  // destroy values of coroutine local storage
+  void ClearLocal();
+
+  /**
+   * @brief reuse a terminated coroutine and its stack to execute func
+   *
+   * @attention only coroutine with independent stack can be reset
+   */
+  void Reset(std::function<void()> func);
 
   Coroutine() = default;
-  ~Coroutine() = default;
+  ~Coroutine();
+
+  // site is recorded as the creator, see CoroutineRegistry and StackProfiler
+  static std::shared_ptr<Coroutine> Create(std::shared_ptr<Schedule> sc,
+                                           std::shared_ptr<CoroutineAttr> attr,
+                                           std::function<void()> func,
+                                           void *site);
+
+  // paint the whole stack if paint_stack_ is set
+  void PaintStack();
 
   std::shared_ptr<Schedule> schedule_; // equivalent to execute environment
   std::function<void()> func_;         // the execute function of coroutine
-  ucontext_t coctx_;                   // context used for swapping
+  CoContext coctx_;                    // context used for swapping
   CoState co_state_;                   // the state of coroutine
   bool is_main_co_;                    // whether main coroutine or not
   bool use_shared_stk_;                // whether use shared stack or not
@@ -203,9 +441,181 @@ private:
   std::shared_ptr<StackMem>
       stack_mem_; // the execute memory of current coroutine
 
-  std::shared_ptr<void> saved_stack_; // used to save execute stack space
-  size_t saved_size_;                 // the size of saved stack space
+  // used to save execute stack space when this coroutine is evicted from
+  // shared stack. the live stack region is usually small, which is saved in
+  // saved_inline_ without touching allocator. otherwise it is saved in
+  // saved_heap_, which only grows and is reused by later evictions
+  static constexpr size_t kInlineSaveSize = 256;
+  char saved_inline_[kInlineSaveSize];
+  std::unique_ptr<char[]> saved_heap_;
+  size_t saved_capacity_; // the capacity of saved_heap_
+  size_t saved_size_;     // the size of saved stack space
   void *dummy_; // the effect of this field, plese check out coroutine.cc
+
+  uint64_t id_;
+  // values of CoroutineLocal, indexed by the slot registered
+  void *local_slots_[kMaxLocalSlots];
+  uint32_t local_inline_ = 0;
+
+  uint64_t deadline_ = 0;
+  std::atomic<bool> cancelled_{false};
+  // the sequence of current parking, zero if it's not parked
+  std::atomic<uint64_t> park_seq_{0};
+  uint64_t last_seq_ = 0;
+  WakeReason wake_reason_ = WAKE_NONE;
+  Epoll *park_epoll_ = nullptr;
+
+  // statistics read by CoroutineRegistry in other threads, only the thread
+  // running this coroutine writes them
+  void *site_ = nullptr;                 // the return address of creator
+  std::atomic<uint64_t> switches_{0};   // the times of being switched in
+  std::atomic<uint64_t> run_cycles_{0}; // accumulated running cycles
+  std::atomic<size_t> stack_hwm_{0}; // the deepest stack seen when switching
+  bool paint_stack_ = false; // the stack is painted, see StackProfiler
+  // linked in the live list of schedule_
+  Coroutine *live_prev_ = nullptr;
+  Coroutine *live_next_ = nullptr;
+};
+
+/**
+ * @brief the equivalent of thread_local for coroutine, each coroutine has its
+ * own value, which is default constructed on the first access and destroyed
+ * when coroutine terminates. in main coroutine, it behaves like thread_local
+ *
+ * a value no larger than a pointer and trivially destructible, e.g. an int or
+ * a pointer, is stored in the slot of Coroutine itself. others are allocated
+ * by new on the first access of each coroutine, and the slot points to it
+ *
+ * the slot is allocated when constructing and never released, so it should be
+ * declared as static or global variable. at most Coroutine::kMaxLocalSlots of
+ * them can exist in a process, the constructor of one more throws
+ * std::runtime_error, which terminates the program in static initialization
+ */
+template <typename T> class CoroutineLocal {
+public:
+  static constexpr bool kInline = sizeof(T) <= sizeof(void *) &&
+                                  alignof(T) <= alignof(void *) &&
+                                  std::is_trivially_destructible_v<T>;
+
+  CoroutineLocal()
+      : idx_(Coroutine::RegisterLocalSlot(kInline ? nullptr : &Destroy)) {}
+
+  CoroutineLocal(const CoroutineLocal &) = delete;
+  CoroutineLocal &operator=(const CoroutineLocal &) = delete;
+
+  T &Get() {
+    void *&slot = Coroutine::GetLocalSlot(idx_);
+    if constexpr (kInline) {
+      uint32_t &mask = Coroutine::GetLocalInline();
+      if ((mask & (1u << idx_)) == 0) {
+        new (&slot) T();
+        mask |= 1u << idx_;
+      }
+      return *std::launder(reinterpret_cast<T *>(&slot));
+    } else {
+      if (!slot) {
+        slot = new T();
+      }
+      return *static_cast<T *>(slot);
+    }
+  }
+
+  void Set(T val) { Get() = std::move(val); }
+
+  // whether the value of running coroutine has been constructed
+  bool Has() {
+    if constexpr (kInline) {
+      return Coroutine::GetLocalInline() & (1u << idx_);
+    } else {
+      return Coroutine::GetLocalSlot(idx_) != nullptr;
+    }
+  }
+
+  // destroy the value of running coroutine
+  void Reset() {
+    void *&slot = Coroutine::GetLocalSlot(idx_);
+    if constexpr (kInline) {
+      Coroutine::GetLocalInline() &= ~(1u << idx_);
+      slot = nullptr;
+    } else if (slot) {
+      Destroy(slot);
+      slot = nullptr;
+    }
+  }
+
+  T &operator*() { return Get(); }
+  T *operator->() { return &Get(); }
+
+private:
+  static void Destroy(void *ptr) { delete static_cast<T *>(ptr); }
+
+  size_t idx_;
+};
+
+// cache terminated coroutines and their stacks, which can be reused by later
+// coroutines with the same stack size. each thread has its own pool, so no
+// lock is needed
+class CoroutinePool {
+public:
+  typedef std::shared_ptr<CoroutinePool> ptr;
+
+  struct Stats {
+    uint64_t hits_;     // the times of Acquire reusing a cached coroutine
+    uint64_t misses_;   // the times of Acquire allocating a new coroutine
+    uint64_t releases_; // the times of Release caching a coroutine
+    uint64_t trims_;    // the number of coroutines freed due to high watermark
+  };
+
+  static std::shared_ptr<CoroutinePool> GetThreadPool() {
+    static thread_local std::shared_ptr<CoroutinePool> instance(
+        new CoroutinePool());
+    return instance;
+  }
+
+  /**
+   * @brief get a coroutine in CO_READY state from pool, if there is no cached
+   * coroutine with the same stack size, allocate a new one.
+   *
+   * @attention coroutine with shared stack is never cached, this function is
+   * equivalent to Coroutine::CreateCoroutine in this scenario
+   */
+  std::shared_ptr<Coroutine> Acquire(std::shared_ptr<CoroutineAttr> attr,
+                                     std::function<void()> func);
+
+  /**
+   * @brief give coroutine back to pool, co will be reset to nullptr on success
+   *
+   * @return false if co is not terminated, uses shared stack or is still
+   * referenced by others. in this scenario, co is left untouched
+   */
+  bool Release(std::shared_ptr<Coroutine> &co);
+
+  /**
+   * @brief when the number of cached coroutines exceeds high, the pool frees
+   * coroutines until low coroutines are left
+   */
+  void SetWatermark(size_t low, size_t high);
+
+  size_t GetLowWatermark() const { return low_watermark_; }
+  size_t GetHighWatermark() const { return high_watermark_; }
+  size_t GetCachedCount() const { return cached_; }
+  const Stats &GetStats() const { return stats_; }
+
+  // free all cached coroutines
+  void Clear();
+
+private:
+  CoroutinePool()
+      : cached_(0), low_watermark_(64), high_watermark_(1024), stats_() {}
+
+  void Trim(size_t target);
+
+  // [PoolKey(stack size, kind of stack), cached coroutines]
+  std::unordered_map<size_t, std::vector<std::shared_ptr<Coroutine>>> free_;
+  size_t cached_; // the number of cached coroutines
+  size_t low_watermark_;
+  size_t high_watermark_;
+  Stats stats_;
 };
 
 } // namespace Sylar
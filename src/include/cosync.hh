@@ -0,0 +1,112 @@
+#ifndef __SYLAR_COSYNC_HH__
+#define __SYLAR_COSYNC_HH__
+
+#include "coroutine.hh"
+#include "epoll.hh"
+#include "mutex.hh"
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <memory>
+
+namespace Sylar {
+
+/**
+ * primitives in this file suspend current coroutine instead of blocking the
+ * thread. the waiting coroutine is resumed by the event loop of its own thread
+ * through Epoll::PostResume, so it works both within one thread and across
+ * threads. the thread which waits in coroutine must run event loop, e.g.
+ * Schedule::Eventloop or IOManager.
+ *
+ * when invoked in main coroutine, the thread is blocked by a semaphore
+ */
+
+// a coroutine or thread waiting for a primitive
+struct CoWaiter {
+  CoWaiter();
+
+  // suspend current coroutine(or thread) until Wake is invoked
+  void Suspend();
+
+  // wake up the waiter, can be invoked in any thread
+  void Wake();
+
+  std::shared_ptr<Coroutine> co_; // nullptr if waiting in main coroutine
+  std::shared_ptr<Epoll> epoll_;  // the epoll of waiting thread
+  std::shared_ptr<Semaphore> sem_;
+};
+
+class CoMutex : boost::noncopyable {
+public:
+  typedef ScopeLockImpl<CoMutex> ScopeLock;
+
+  CoMutex() : locked_(false) {}
+
+  void Lock();
+
+  bool TryLock();
+
+  /**
+   * @brief the ownership is handed off to the first waiter directly, so a
+   * coroutine re-locking in a loop cannot starve waiters
+   */
+  void Unlock();
+
+private:
+  SpinLock mu_;
+  bool locked_;
+  std::deque<CoWaiter *> waiters_;
+};
+
+class CoCondVar : boost::noncopyable {
+public:
+  // mu must be locked by caller, it's locked again when returning
+  void Wait(CoMutex &mu);
+
+  void NotifyOne();
+
+  void NotifyAll();
+
+private:
+  SpinLock mu_;
+  std::deque<CoWaiter *> waiters_;
+};
+
+class CoSemaphore : boost::noncopyable {
+public:
+  explicit CoSemaphore(size_t cnt = 0) : cnt_(cnt) {}
+
+  void Wait();
+
+  bool TryWait();
+
+  void Notify();
+
+  size_t GetCount();
+
+private:
+  SpinLock mu_;
+  size_t cnt_;
+  std::deque<CoWaiter *> waiters_;
+};
+
+// wait for a group of tasks to finish
+class WaitGroup : boost::noncopyable {
+public:
+  WaitGroup() : cnt_(0) {}
+
+  void Add(size_t n = 1);
+
+  void Done();
+
+  // suspend until the counter drops to zero
+  void Wait();
+
+private:
+  SpinLock mu_;
+  size_t cnt_;
+  std::deque<CoWaiter *> waiters_;
+};
+
+} // namespace Sylar
+
+#endif
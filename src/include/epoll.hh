@@ -1,20 +1,209 @@
 #ifndef __SYLAR_EPOLL_HH__
 #define __SYLAR_EPOLL_HH__
 
+#include "fdmanager.hh"
 #include "hook.hh"
+#include "mutex.hh"
 #include "timewheel.hh"
+#include "uring.hh"
+#include <atomic>
 #include <cstring>
 #include <fcntl.h>
 #include <functional>
 #include <memory>
 #include <sys/epoll.h>
 #include <sys/types.h>
-#include <unordered_map>
+#include <vector>
 
 namespace Sylar {
 
 class Schedule;
 
+/**
+ * @brief multi-producer single-consumer FIFO queue, see the bounded queue of
+ * Dmitry Vyukov. producers claim a slot by one CAS and publish it by its
+ * sequence, so pushing takes no lock and allocates nothing.
+ *
+ * items pushed when the ring is full go to a locked overflow list. once it's
+ * used, producers keep using it until the consumer drains it, and the
+ * consumer drains it only after the ring, so items of one producer are
+ * popped in the order of pushing
+ */
+template <typename T> class MpscQueue {
+public:
+  explicit MpscQueue(size_t capacity = 1024)
+      : tail_(0), head_(0), overflowing_(false) {
+    size_t cap = 2;
+    while (cap < capacity) {
+      cap <<= 1;
+    }
+    mask_ = cap - 1;
+    slots_.reset(new Slot[cap]);
+    for (size_t i = 0; i < cap; i++) {
+      slots_[i].seq_.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  // can be invoked by any thread
+  void Push(T item) {
+    if (!overflowing_.load(std::memory_order_acquire)) {
+      uint64_t pos = tail_.load(std::memory_order_relaxed);
+      while (true) {
+        Slot &slot = slots_[pos & mask_];
+        uint64_t seq = slot.seq_.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1,
+                                          std::memory_order_relaxed)) {
+            slot.item_ = std::move(item);
+            slot.seq_.store(pos + 1, std::memory_order_release);
+            return;
+          }
+        } else if (diff < 0) {
+          // full, the slot isn't popped since last round
+          break;
+        } else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+    Mutex::ScopeLock lock(overflow_mu_);
+    overflow_.push_back(std::move(item));
+    if (!overflowing_.load(std::memory_order_relaxed)) {
+      overflowing_.store(true, std::memory_order_release);
+    }
+  }
+
+  /**
+   * @brief only invoked by consumer
+   *
+   * @return false if it's empty, or the next item is being pushed
+   */
+  bool Pop(T &item) {
+    Slot &slot = slots_[head_ & mask_];
+    if (slot.seq_.load(std::memory_order_acquire) == head_ + 1) {
+      item = std::move(slot.item_);
+      slot.item_ = T();
+      slot.seq_.store(head_ + mask_ + 1, std::memory_order_release);
+      head_++;
+      return true;
+    }
+    // a claimed slot is not published yet, its producer wakes consumer later.
+    // overflowed items are pushed after those in ring
+    if (tail_.load(std::memory_order_acquire) != head_) {
+      return false;
+    }
+    if (taken_idx_ == taken_.size()) {
+      if (!overflowing_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      // take all of them by one lock, producers go back to the ring once
+      // nothing is left
+      taken_.clear();
+      taken_idx_ = 0;
+      Mutex::ScopeLock lock(overflow_mu_);
+      taken_.swap(overflow_);
+      if (taken_.empty()) {
+        overflowing_.store(false, std::memory_order_release);
+        return false;
+      }
+    }
+    item = std::move(taken_[taken_idx_++]);
+    return true;
+  }
+
+private:
+  // a slot per cache line, so that the producer filling one doesn't disturb
+  // the consumer popping its neighbour
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq_;
+    T item_;
+  };
+
+  alignas(64) std::atomic<uint64_t> tail_; // the next slot to claim
+  alignas(64) uint64_t head_;              // the next slot to pop
+  size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::vector<T> taken_; // taken from overflow_ by consumer
+  size_t taken_idx_ = 0;
+  alignas(64) std::atomic<bool> overflowing_; // whether overflow_ is in use
+  Mutex overflow_mu_;
+  std::vector<T> overflow_;
+};
+
+/**
+ * @brief a histogram of non-negative values, e.g. latencies. each power of 2
+ * is divided into 8 buckets, so a percentile is within 1/8 of the recorded
+ * value
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram() { Reset(); }
+
+  void Record(uint64_t val) {
+    buckets_[BucketOf(val)]++;
+    count_++;
+  }
+
+  // the upper bound of the bucket holding percentile p(0~1), 0 if it's empty
+  uint64_t Percentile(double p) const;
+
+  uint64_t Count() const { return count_; }
+
+  void Reset();
+
+private:
+  static constexpr int kSubBits = 3;
+  static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  static int BucketOf(uint64_t val) {
+    if (val < (1u << kSubBits)) {
+      return (int)val;
+    }
+    int msb = 63 - __builtin_clzll(val);
+    int sub = (val >> (msb - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((msb - kSubBits + 1) << kSubBits) | sub;
+  }
+
+  uint64_t buckets_[kBuckets];
+  uint64_t count_;
+};
+
+// the statistics of an event loop, see BusyPollWait
+struct LoopStats {
+  uint64_t waits_;       // the number of waiting for events
+  uint64_t spin_hits_;   // events are found while spinning
+  uint64_t spin_misses_; // the spin budget runs out, then it blocks
+  // cycles of ReadCycles from epoll_wait returning an event to its handler
+  // starting, which includes the handlers before it in the same batch
+  LatencyHistogram latency_;
+
+  LoopStats() : waits_(0), spin_hits_(0), spin_misses_(0) {}
+
+  // the ratio of spinning waits that find events, 0 if it never spins
+  double SpinHitRatio() const;
+
+  // the percentile p(0~1) of latency_ in nanoseconds
+  uint64_t LatencyNS(double p) const;
+};
+
+/**
+ * @brief epoll_wait which polls with zero timeout for at most spin_ns
+ * nanoseconds before blocking for the rest of timeout milliseconds. spinning
+ * burns the cpu to save the latency of sleeping and being woken up
+ *
+ * @return the result of epoll_wait, stats is updated
+ */
+int BusyPollWait(int epfd, epoll_event *evs, int max, int timeout,
+                 uint64_t spin_ns, LoopStats &stats);
+
+// ask kernel to busy poll the device queues of sockets in epoll_wait of epfd
+// for spin_us microseconds(EPIOCSPARAMS, since linux 6.9), 0 disables it
+bool SetEpollBusyPoll(int epfd, uint64_t spin_us);
+
 class Epoll : public TimeWheel {
 public:
   typedef std::shared_ptr<Epoll> ptr;
@@ -22,12 +211,36 @@ public:
 
   enum EventType { NONE = 0x0, READ = 0x1, WRITE = 0x4 };
 
+  // the flags of registration, which are or-ed into type of RegisterEvent.
+  // they apply to the fd rather than one type, the last registration wins
+  enum EventFlag {
+    // the registration is consumed by the first event, the callback re-arms
+    // it by RegisterEvent, which costs one epoll_ctl
+    ONESHOT = 0x10,
+    // only one of the epolls waiting for fd is woken up, e.g. the listening
+    // socket shared by workers. it cannot be used with ONESHOT
+    EXCLUSIVE = 0x20,
+    // level triggered, the event is reported until it's handled
+    LEVEL = 0x40,
+  };
+  static constexpr int kEventMask = READ | WRITE;
+  static constexpr int kFlagMask = ONESHOT | EXCLUSIVE | LEVEL;
+
   struct EventCtx {
     EventCtx()
-        : type_(0), fd_(-1), r_callback_(nullptr), r_co_(nullptr),
+        : type_(0), flags_(0), fd_(-1), gen_(0), in_epoll_(false), armed_(0),
+          pending_(false), r_callback_(nullptr), r_co_(nullptr),
           w_callback_(nullptr), w_co_(nullptr), ptr_(nullptr) {}
-    int type_;
+    int type_;  // the registered EventType
+    int flags_; // EventFlag
     int fd_;
+    // the generation of fd when being registered, see FdManager
+    uint32_t gen_;
+    // the state in kernel, which catches up with type_ and flags_ when the
+    // pending change is flushed
+    bool in_epoll_;
+    int armed_;
+    bool pending_; // whether in the pending list
     // when listened event trigger, this funciton should be executed. attention:
     // coroutine won't execute this function
     std::function<void()> r_callback_;
@@ -48,9 +261,39 @@ public:
 
   static void InitThreadEpoll();
 
-  void StopEventLoop(bool val) { loop_ = val; }
+  /**
+   * @brief stop Schedule::Eventloop if val is true. it can be invoked in any
+   * thread, the loop is woken up instead of noticing it after its timeout
+   */
+  void StopEventLoop(bool val);
+
+  bool Stoped() { return loop_.load(std::memory_order_acquire); }
 
-  bool Stoped() { return loop_; }
+  // make epoll_wait of the owning thread return, it can be invoked in any
+  // thread
+  void Wakeup();
+
+  /**
+   * @brief let Schedule::EventloopOnce spin for spin_us microseconds before
+   * blocking, 0 disables it. kernel is also asked to busy poll in epoll_wait,
+   * see SetEpollBusyPoll, which is ignored if it's not supported
+   */
+  void SetBusyPoll(uint64_t spin_us);
+
+  uint64_t GetBusyPoll() const { return busy_poll_ns_ / 1000; }
+
+  /**
+   * @brief wake up for timers by a timerfd registered in this epoll, rather
+   * than the timeout of epoll_wait in milliseconds. it's meant for wheels of
+   * sub-millisecond granularity, see TimeWheel::SetGranularityUS
+   *
+   * @return false if timerfd cannot be created
+   */
+  bool SetPreciseTimer(bool val);
+
+  const LoopStats &GetLoopStats() const { return stats_; }
+
+  void ResetLoopStats() { stats_ = LoopStats(); }
 
   /**
    * @brief execute callback function when listened event occurs or resuming
@@ -62,7 +305,16 @@ public:
    * @attention if *_func and *_co both have value, we will execute function and
    * ignore coroutine
    *
-   * @param type    type to be listened
+   * @attention if fd is registered already, the callbacks of given type are
+   * replaced and the others are kept. epoll_ctl is skipped if the mask is
+   * armed already, which is enough for edge triggered epoll as long as the
+   * caller waits after read/write returns EAGAIN
+   *
+   * @attention changes are applied to kernel by FlushChanges, which is
+   * invoked by event loop before waiting, so registering and cancelling in
+   * one iteration cost at most one epoll_ctl per fd
+   *
+   * @param type    type to be listened, may be or-ed with EventFlag
    * @param fd      file descriptor
    * @param r_func  when fd can be read, execute this functione
    * @param w_func  when fd can be written, execute this function
@@ -74,18 +326,109 @@ public:
                      std::shared_ptr<Coroutine> r_co = nullptr,
                      std::shared_ptr<Coroutine> w_co = nullptr);
 
+  // the content of ptr is copied into the event table of this epoll
   void RegisterEvent(int type, int fd, std::shared_ptr<EventCtx> ptr);
 
   void CancelEvent(int type, int fd);
 
-  Epoll() : TimeWheel(), epfd_(false), loop_(false) {}
+  // apply pending changes to kernel, and submit the sqes queued in the
+  // io_uring of this thread, see IoUring::GetThreadRing
+  void FlushChanges();
+
+  // apply the pending change of fd at once, e.g. before closing it
+  void FlushEvent(int fd);
+
+  /**
+   * @brief the registration of fd, nullptr if fd is beyond the table. the
+   * type_ of EventCtx is NONE if fd isn't registered
+   */
+  EventCtx *GetEventCtx(int fd) {
+    size_t idx = fd >> kCtxChunkShift;
+    if (fd < 0 || idx >= event_ctxs_.size() || !event_ctxs_[idx]) {
+      return nullptr;
+    }
+    return &event_ctxs_[idx][fd & (kCtxChunkSize - 1)];
+  }
+
+  /**
+   * @brief execute func in the thread owning this epoll, it's invoked by event
+   * loop of that thread. this function can be invoked in any thread
+   *
+   * @attention tasks are pushed into a lock-free queue, and eventfd is
+   * written once until the event loop takes tasks, so a burst of tasks costs
+   * one wakeup. tasks of one thread run in the order of posting
+   */
+  void Post(std::function<void()> func);
+
+  /**
+   * @brief resume co in the thread owning this epoll, see Post
+   */
+  void PostResume(std::shared_ptr<Coroutine> co);
+
+  Epoll()
+      : TimeWheel(), epfd_(false), loop_(false), busy_poll_ns_(0),
+        wake_fd_(-1), timer_fd_(-1), timer_due_(0), post_notified_(false) {}
+
+  // get EventCtx of fd, the table grows if needed. the registration of a
+  // former fd with the same number is dropped
+  EventCtx *AllocEventCtx(int fd, uint32_t gen);
+
+  void MarkPending(EventCtx *ctx) {
+    if (!ctx->pending_) {
+      ctx->pending_ = true;
+      pending_.push_back(ctx);
+    }
+  }
+
+  // issue epoll_ctl to make kernel agree with ctx
+  void ApplyChange(EventCtx *ctx);
+
+  std::vector<EventCtx *> pending_; // EventCtx changed since last flush
 
   int epfd_;
-  std::unordered_map<int, std::shared_ptr<EventCtx>> reg_event_;
-  bool loop_;
+  // EventCtx indexed by fd. they are allocated by chunks and the array of
+  // chunks grows geometrically, so that the address of EventCtx, which is
+  // stored in epoll_event.data.ptr, is stable
+  static constexpr int kCtxChunkShift = 8;
+  static constexpr int kCtxChunkSize = 1 << kCtxChunkShift;
+  std::vector<std::unique_ptr<EventCtx[]>> event_ctxs_;
+  std::atomic<bool> loop_;
+  std::vector<epoll_event> events_; // the buffer of epoll_wait
+  uint64_t busy_poll_ns_; // the spin budget of each wait
+  LoopStats stats_;
+
+  // eventfd registered in this epoll, which is written when posting tasks
+  int wake_fd_;
+
+  // timerfd registered in this epoll if SetPreciseTimer, -1 otherwise
+  int timer_fd_;
+  uint64_t timer_due_; // the time armed in timerfd, microsecond
+
+  /**
+   * @brief the timeout of epoll_wait in milliseconds for the next timer,
+   * which is at most max_timeout. timerfd is armed instead if it's precise
+   *
+   * @param now microsecond, see GetElapseFromRebootUS
+   */
+  uint64_t PrepareTimeout(uint64_t now, uint64_t max_timeout);
+
+  // a task posted by Post or PostResume. the coroutine isn't wrapped by
+  // std::function, whose capture of shared_ptr is allocated on heap
+  struct PostedTask {
+    std::function<void()> func_;
+    std::shared_ptr<Coroutine> co_;
+  };
+  MpscQueue<PostedTask> posted_; // tasks posted by Post and PostResume
+  // whether eventfd has been written since the event loop took tasks, only
+  // the producer setting it writes eventfd
+  std::atomic<bool> post_notified_;
+  void NotifyPosted();
+  void HandlePosted();
+
+  // created by IoUring::GetThreadRing, nullptr if it's never used
+  std::unique_ptr<IoUring> uring_;
 
   static thread_local std::shared_ptr<Epoll> t_epoll_;
-  static thread_local int64_t reference_cnt_;
 };
 
 } // namespace Sylar
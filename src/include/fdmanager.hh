@@ -0,0 +1,83 @@
+#ifndef __SYLAR_FDMANAGER_HH__
+#define __SYLAR_FDMANAGER_HH__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Sylar {
+
+// the number of syscalls issued by Epoll and hooked I/O in current thread,
+// used to measure the effect of FdManager
+struct SyscallStats {
+  uint64_t fcntl_;
+  uint64_t fstat_;
+  uint64_t epoll_ctl_;
+};
+
+/**
+ * @brief the process-wide cache of what we know about fds, so that hooked I/O
+ * and Epoll only issue fcntl/fstat when the state actually changes.
+ *
+ * the state of each fd is a single atomic word: flags in the lowest bits and
+ * a generation in the rest. the generation is bumped when the fd is closed by
+ * hooked close or created by hooked socket/socketpair/accept/pipe, so that a
+ * reused fd number never sees the state of the former fd. Epoll compares the
+ * generation to decide whether its registration of fd is still armed.
+ *
+ * @attention fds closed by close_f must not be used by hooked I/O again,
+ * unless the number is returned by the hooked functions above
+ */
+class FdManager {
+public:
+  enum Flag {
+    FD_INIT = 0x1,     // the fd has been probed
+    FD_SOCKET = 0x2,   // the fd is a socket
+    FD_POLLABLE = 0x4, // the fd can be waited by epoll, e.g. socket or pipe
+    FD_NONBLOCK = 0x8, // O_NONBLOCK has been set
+  };
+  static constexpr int kFlagBits = 8;
+  static constexpr uint32_t kFlagMask = (1u << kFlagBits) - 1;
+
+  // the flags and generation of fd, it's probed by fstat on the first access.
+  // FD_INIT is not set if fd is invalid
+  static uint32_t GetState(int fd);
+
+  static uint32_t GetGeneration(uint32_t state) { return state >> kFlagBits; }
+
+  /**
+   * @brief set O_NONBLOCK on fd unless it's known to be set
+   *
+   * @return false if fd is invalid
+   */
+  static bool SetNonblock(int fd);
+
+  // record O_NONBLOCK changed by others, invoked by hooked fcntl and ioctl
+  static void UpdateNonblock(int fd, bool nonblock);
+
+  // forget fd, invoked when fd is closed
+  static void Remove(int fd);
+
+  // forget fd and record what the creator knows, invoked when fd is created
+  static void Reset(int fd, uint32_t flags);
+
+  static SyscallStats &ThreadSyscalls() {
+    static thread_local SyscallStats stats{0, 0, 0};
+    return stats;
+  }
+
+private:
+  // fds are divided into chunks, which are allocated on the first access and
+  // never freed, so they can be read without lock
+  static constexpr int kChunkShift = 12;
+  static constexpr int kChunkSize = 1 << kChunkShift;
+  static constexpr int kMaxChunks = 1 << 10;
+
+  static std::atomic<uint32_t> *GetSlot(int fd);
+
+  static std::atomic<std::atomic<uint32_t> *> s_chunks_[kMaxChunks];
+};
+
+} // namespace Sylar
+
+#endif
@@ -25,6 +25,9 @@ extern sleep_func sleep_f;
 typedef int (*usleep_func)(useconds_t);
 extern usleep_func usleep_f;
 
+typedef int (*nanosleep_func)(const struct timespec *, struct timespec *);
+extern nanosleep_func nanosleep_f;
+
 // read function
 typedef ssize_t (*read_func)(int, void *, size_t);
 extern read_func read_f;
@@ -62,6 +65,36 @@ extern sendmsg_func sendmsg_f;
 // close file
 typedef int (*close_func)(int);
 extern close_func close_f;
+
+// create fd, the hooked ones only reset the state cached by FdManager
+typedef int (*socket_func)(int, int, int);
+extern socket_func socket_f;
+
+typedef int (*socketpair_func)(int, int, int, int[2]);
+extern socketpair_func socketpair_f;
+
+typedef int (*accept_func)(int, struct sockaddr *, socklen_t *);
+extern accept_func accept_f;
+
+typedef int (*accept4_func)(int, struct sockaddr *, socklen_t *, int);
+extern accept4_func accept4_f;
+
+typedef int (*pipe_func)(int[2]);
+extern pipe_func pipe_f;
+
+typedef int (*pipe2_func)(int[2], int);
+extern pipe2_func pipe2_f;
+
+// connect, it goes through io_uring if it's enabled, see IoUring::SetEnable
+typedef int (*connect_func)(int, const struct sockaddr *, socklen_t);
+extern connect_func connect_f;
+
+// fd control, the hooked ones keep O_NONBLOCK cached by FdManager up to date
+typedef int (*fcntl_func)(int, int, ...);
+extern fcntl_func fcntl_f;
+
+typedef int (*ioctl_func)(int, unsigned long, ...);
+extern ioctl_func ioctl_f;
 }
 
 #endif
\ No newline at end of file
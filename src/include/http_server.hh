@@ -51,6 +51,22 @@ public:
     request_handlers_[path].insert(std::make_pair(method, std::move(handler)));
   }
 
+  // serve CoroutineRegistry::Dump by GET path, for diagnosing stalled workers
+  void RegisterCoroutineDump(const std::string &path = "/debug/coroutines");
+
+  /**
+   * @brief let workers spin for spin_us microseconds before blocking in
+   * epoll_wait, and set SO_BUSY_POLL on accepted sockets, see BusyPollWait.
+   * it should be invoked before Start, 0 disables it
+   */
+  void SetBusyPoll(uint64_t spin_us) { busy_poll_us_ = spin_us; }
+
+  // the statistics of worker thread, it's updated by the worker without lock,
+  // so read it after Stop for an exact value
+  const LoopStats &GetLoopStats(int thread) const {
+    return worker_stats_[thread];
+  }
+
   std::string GetHost() const { return host_; }
   std::uint16_t GetPort() const { return port_; }
   bool Running() const { return running_; }
@@ -118,6 +134,8 @@ private:
   std::vector<int> worker_epoll_fd_;        // size is kThreadPoolSize
   std::vector<std::vector<epoll_event>>
       worker_epoll_event_; // size is kThreadPoolSize(row) * KMaxEvent(col)
+  std::vector<LoopStats> worker_stats_; // size is kThreadPoolSize
+  std::uint64_t busy_poll_us_ = 0;
 
   std::random_device rdev_;
   std::mt19937 random_engine_;
@@ -0,0 +1,167 @@
+#ifndef __SYLAR_INTROSPECT_HH__
+#define __SYLAR_INTROSPECT_HH__
+
+#include "coroutine.hh"
+#include "mutex.hh"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <signal.h>
+#include <string>
+#include <sys/types.h>
+#include <unordered_set>
+#include <vector>
+
+namespace Sylar {
+
+// a snapshot of one coroutine, see CoroutineRegistry::Snapshot
+struct CoroutineInfo {
+  uint64_t id_;
+  pid_t tid_;      // the thread of schedule creating this coroutine
+  int state_;      // Coroutine::CoState
+  bool main_;      // whether main coroutine or not
+  bool running_;   // whether it's the running coroutine of its thread
+  bool shared_stack_;
+  void *site_;         // the return address of creator
+  uint64_t switches_;  // the times of being switched in
+  uint64_t run_ns_;    // accumulated running time, including current slice
+  uint64_t slice_ns_;  // how long it has been running, 0 if not running
+  size_t stack_size_;  // 0 for main coroutine
+  size_t stack_hwm_;   // the deepest stack seen when switching out
+};
+
+/**
+ * @brief the registry of live coroutines in all threads, which is used to
+ * find out what a stalled thread is doing.
+ *
+ * each Schedule links coroutines created in it, the lock is only taken when
+ * creating and destructing coroutines. switching only bumps counters of the
+ * two coroutines and reads the cycle counter(which can be disabled by
+ * SetTiming), so it's cheap enough to leave on.
+ *
+ * dump on demand in one of the following ways:
+ *  - Dump() returns the text
+ *  - InstallDumpSignal(SIGUSR1), then `kill -USR1 <pid>`, the next event loop
+ *    iteration of any thread writes the dump to the sink(root logger by
+ *    default)
+ *  - http::HttpServer::RegisterCoroutineDump serves it by http
+ */
+class CoroutineRegistry {
+public:
+  static std::vector<CoroutineInfo> Snapshot();
+
+  // one line per coroutine, threads are separated by a header line
+  static std::string Dump();
+
+  // whether measuring running time of coroutines, enabled by default
+  static void SetTiming(bool val) { s_timing_.store(val); }
+
+  static bool IsTiming() { return s_timing_.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief request a dump when receiving signo. the handler only sets a flag,
+   * the dump is done by event loop, see HandleDumpRequest
+   */
+  static void InstallDumpSignal(int signo = SIGUSR1);
+
+  // async-signal-safe
+  static void RequestDump() { s_dump_requested_.store(true); }
+
+  static bool IsDumpRequested() {
+    return s_dump_requested_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief write a dump to the sink if it's requested, invoked by event loop
+   *
+   * @return whether a dump is written
+   */
+  static bool HandleDumpRequest();
+
+  // where dumps requested by signal go, nullptr restores the root logger
+  static void SetDumpSink(std::function<void(const std::string &)> sink);
+
+  // "symbol+offset" if the site can be resolved, otherwise "binary+offset"
+  static std::string SymbolizeSite(void *site);
+
+private:
+  friend Schedule;
+  friend Coroutine;
+
+  static void AddSchedule(Schedule *sc);
+  static void RemoveSchedule(Schedule *sc);
+
+  // link co into the live list of sc
+  static void Link(Schedule *sc, Coroutine *co);
+  static void Unlink(Schedule *sc, Coroutine *co);
+
+  static std::atomic<bool> s_timing_;
+  static std::atomic<bool> s_dump_requested_;
+};
+
+// the stack usage of coroutines created at one site
+struct StackSiteStats {
+  void *site_;
+  uint64_t samples_;   // the number of terminated coroutines measured
+  size_t max_used_;    // the deepest stack among them
+  size_t total_used_;  // used to compute the average
+  size_t stack_size_;  // the stack size of the last one measured
+  size_t recommended_; // see StackProfiler::Recommend
+};
+
+/**
+ * @brief measure how deep coroutine stacks really grow, so that stack size
+ * can be shrunk safely.
+ *
+ * when CoroutineAttr::paint_stack_ is set, the independent stack is filled
+ * with a canary pattern before running, and the deepest overwritten word is
+ * found when the coroutine terminates. results are aggregated by creation
+ * site(the caller of Coroutine::CreateCoroutine or CoroutinePool::Acquire).
+ *
+ * with CoroutineAttr::auto_stack_size_, later coroutines of a site which has
+ * enough samples use the recommended size, which never exceeds the size in
+ * attribute.
+ *
+ * @attention painting touches every page of the stack, which costs a memset
+ * and commits the memory of mmap stack, so it's meant for profiling
+ */
+class StackProfiler {
+public:
+  static constexpr uint64_t kCanary = 0xdeadbeefcafebabeull;
+
+  // fill stack with canary, size must be multiple of 8
+  static void Paint(char *stack, size_t size);
+
+  // the number of bytes overwritten, counted from the top of stack
+  static size_t MeasureUsage(const char *stack, size_t size);
+
+  static void Record(void *site, size_t used, size_t stack_size);
+
+  /**
+   * @brief the deepest usage of site plus a headroom of half of it(at least
+   * kMinHeadroom), rounded up to page size
+   *
+   * @return 0 if the site has less samples than GetMinSamples
+   */
+  static size_t Recommend(void *site);
+
+  // the stack size used by a coroutine created at site
+  static size_t PickStackSize(void *site, size_t configured);
+
+  static void SetMinSamples(uint64_t n);
+
+  static uint64_t GetMinSamples();
+
+  static std::vector<StackSiteStats> GetStats();
+
+  // one line per site, sorted by the deepest usage
+  static std::string Dump();
+
+  static void Clear();
+
+  static constexpr size_t kMinHeadroom = 4096;
+};
+
+} // namespace Sylar
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef __SYLAR_IOMANAGER_HH__
+#define __SYLAR_IOMANAGER_HH__
+
+#include "coroutine.hh"
+#include "epoll.hh"
+#include "mutex.hh"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Sylar {
+
+/**
+ * @brief Chase-Lev work-stealing deque, see "Correct and Efficient
+ * Work-Stealing for Weak Memory Models"(Lê et al. PPoPP'13).
+ *
+ * the owner thread pushes and pops at the bottom(LIFO), other threads steal
+ * from the top(FIFO). T must be trivially copyable, e.g. pointer
+ */
+template <typename T> class WorkStealingQueue {
+public:
+  explicit WorkStealingQueue(size_t capacity = 1024)
+      : top_(0), bottom_(0), array_(new Array(RoundUp(capacity))) {
+    garbage_.emplace_back(array_.load(std::memory_order_relaxed));
+  }
+
+  WorkStealingQueue(const WorkStealingQueue &) = delete;
+  WorkStealingQueue &operator=(const WorkStealingQueue &) = delete;
+
+  // only invoked by owner
+  void Push(T item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array *a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity_ - 1) {
+      a = Grow(a, b, t);
+    }
+    a->Put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // only invoked by owner
+  bool Pop(T &item) {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array *a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      // empty
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    item = a->Get(b);
+    if (t == b) {
+      // the last item, race with thieves
+      bool ok = top_.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return ok;
+    }
+    return true;
+  }
+
+  // can be invoked by any thread
+  bool Steal(T &item) {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    Array *a = array_.load(std::memory_order_acquire);
+    T tmp = a->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      // lost the race with owner or other thieves
+      return false;
+    }
+    item = tmp;
+    return true;
+  }
+
+  size_t Size() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+  }
+
+  bool Empty() const { return Size() == 0; }
+
+  size_t Capacity() const {
+    return array_.load(std::memory_order_relaxed)->capacity_;
+  }
+
+private:
+  struct Array {
+    explicit Array(int64_t capacity)
+        : capacity_(capacity), mask_(capacity - 1),
+          buf_(new std::atomic<T>[capacity]) {}
+    T Get(int64_t i) { return buf_[i & mask_].load(std::memory_order_relaxed); }
+    void Put(int64_t i, T item) {
+      buf_[i & mask_].store(item, std::memory_order_relaxed);
+    }
+    int64_t capacity_;
+    int64_t mask_;
+    std::unique_ptr<std::atomic<T>[]> buf_;
+  };
+
+  static int64_t RoundUp(size_t capacity) {
+    int64_t cap = 2;
+    while (cap < (int64_t)capacity) {
+      cap <<= 1;
+    }
+    return cap;
+  }
+
+  Array *Grow(Array *a, int64_t b, int64_t t) {
+    Array *na = new Array(a->capacity_ * 2);
+    for (int64_t i = t; i < b; i++) {
+      na->Put(i, a->Get(i));
+    }
+    // thieves may still read the old array, it's released with the queue
+    garbage_.emplace_back(na);
+    array_.store(na, std::memory_order_release);
+    return na;
+  }
+
+  alignas(64) std::atomic<int64_t> top_;
+  alignas(64) std::atomic<int64_t> bottom_;
+  std::atomic<Array *> array_;
+  std::vector<std::unique_ptr<Array>> garbage_; // only touched by owner
+};
+
+/**
+ * @brief multi-threaded coroutine scheduler. each worker thread has its own
+ * Schedule, Epoll and run queue. tasks scheduled in worker thread are pushed
+ * into its own queue, tasks scheduled in other threads are delivered to the
+ * inbox of workers in round-robin. idle workers steal tasks from others, and
+ * park on their epoll fd when there is nothing to do.
+ *
+ * function task is executed in a coroutine taken from CoroutinePool, so that
+ * it can use hooked I/O and sleep. coroutine task can be resumed in any
+ * worker, it must use independent stack
+ */
+class IOManager {
+public:
+  typedef std::shared_ptr<IOManager> ptr;
+
+  struct Stats {
+    uint64_t executed_; // the number of tasks executed
+    uint64_t stolen_;   // the number of tasks stolen from other workers
+    uint64_t parked_;   // the times of workers parking on epoll fd
+  };
+
+  /**
+   * @param threads the number of worker threads
+   * @param name the name of worker threads
+   */
+  explicit IOManager(size_t threads = 1, const std::string &name = "IOManager");
+  ~IOManager();
+
+  void Start();
+
+  /**
+   * @brief wait for all scheduled tasks(including function tasks suspended by
+   * I/O or timer) to finish, then join worker threads
+   */
+  void Stop();
+
+  void Schedule(std::function<void()> func);
+
+  void Schedule(std::shared_ptr<Coroutine> co);
+
+  /**
+   * @brief the attribute of coroutines executing function tasks, it should be
+   * set before Start()
+   */
+  void SetCoroutineAttr(std::shared_ptr<CoroutineAttr> attr) { attr_ = attr; }
+
+  size_t GetWorkerCount() const { return workers_.size(); }
+
+  std::string GetName() const { return name_; }
+
+  Stats GetStats() const;
+
+  // return the IOManager of current worker thread, nullptr in other threads
+  static IOManager *GetThis();
+
+  // return the index of current worker thread, -1 in other threads
+  static int GetWorkerIndex();
+
+  /**
+   * @brief put current coroutine back to the run queue and yield, other tasks
+   * get the chance to run. it must be invoked in a coroutine of worker
+   */
+  static void YieldToQueue();
+
+private:
+  struct Task {
+    std::function<void()> func_;
+    std::shared_ptr<Coroutine> co_;
+  };
+
+  struct Worker {
+    Worker() : idx_(0), event_fd_(-1), idle_(false) {}
+    size_t idx_;
+    std::thread thread_;
+    WorkStealingQueue<Task *> queue_; // tasks of current worker
+    Mutex inbox_mu_;
+    std::deque<Task *> inbox_; // tasks scheduled by other threads
+    int event_fd_;             // used to wake up parked worker
+    std::atomic<bool> idle_;
+    std::shared_ptr<Epoll> epoll_;
+    std::shared_ptr<CoroutineAttr> attr_;
+    std::atomic<uint64_t> executed_{0};
+    std::atomic<uint64_t> stolen_{0};
+    std::atomic<uint64_t> parked_{0};
+  };
+
+  void Submit(Task *task);
+  void Run(Worker *worker);
+  bool GetTask(Worker *worker, Task *&task);
+  bool HasTask(Worker *worker);
+  void Execute(Worker *worker, Task *task);
+  void Requeue(Worker *worker);
+  void Done();
+  void Idle(Worker *worker);
+  void Tickle(Worker *worker);
+  void TickleIdle();
+  void TickleAll();
+  bool Stopping();
+
+  std::string name_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::shared_ptr<CoroutineAttr> attr_;
+  std::atomic<size_t> next_worker_; // round-robin index of Submit
+  std::atomic<size_t> idle_cnt_;    // the number of parked workers
+  std::atomic<size_t> active_cnt_;  // the number of unfinished tasks
+  std::atomic<bool> stopping_;
+  bool started_;
+};
+
+} // namespace Sylar
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "mutex.hh"
 #include "singleton.hh"
+#include "util.hh"
 #include <cstdarg>
 #include <cstdint>
 #include <ctime>
@@ -200,7 +201,8 @@ typedef Sylar::SingletonPtr<LoggerManager> LoggerMgr;
   Sylar::LogEventWrapper(logger,                                               \
                          Sylar::LogEvent::ptr(new Sylar::LogEvent(             \
                              logger->GetName(), __FILE__, level, __LINE__, 0,  \
-                             syscall(SYS_gettid), 0, std::time(nullptr))))     \
+                             Sylar::GetThreadId(), Sylar::GetCoroutineId(),    \
+                             Sylar::Clock::WallTime())))                       \
       .GetStream()
 
 #define SYLAR_DEBUG_LOG(logger) SYLAR_LOG(logger, Sylar::LogLevel::DEBUG)
@@ -218,7 +220,8 @@ typedef Sylar::SingletonPtr<LoggerManager> LoggerMgr;
   Sylar::LogEventWrapper(logger,                                               \
                          Sylar::LogEvent::ptr(new Sylar::LogEvent(             \
                              logger->GetName(), __FILE__, level, __LINE__, 0,  \
-                             syscall(SYS_gettid), 0, std::time(nullptr))))     \
+                             Sylar::GetThreadId(), Sylar::GetCoroutineId(),    \
+                             Sylar::Clock::WallTime())))                       \
       .GetEvent()                                                              \
       ->Format(fmt, ##__VA_ARGS__)
 
@@ -62,6 +62,13 @@ public:
    */
   bool SetSockOpt(int level, int option, void *result, socklen_t len);
 
+  /**
+   * @brief busy poll the device queue for usec microseconds when receiving
+   * would block, see SO_BUSY_POLL. raising it above net.core.busy_read needs
+   * CAP_NET_ADMIN
+   */
+  bool SetBusyPoll(int usec);
+
   /**
    * @brief accept connection
    *
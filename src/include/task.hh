@@ -0,0 +1,291 @@
+#ifndef __SYLAR_TASK_HH__
+#define __SYLAR_TASK_HH__
+
+#include "cosync.hh"
+#include "coroutine.hh"
+#include "epoll.hh"
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <sys/types.h>
+#include <utility>
+
+namespace Sylar {
+
+/**
+ * stackless coroutines based on C++20 co_await. a Task keeps its locals in a
+ * heap frame of the exact size it needs instead of a whole stack, so it suits
+ * protocol code with shallow call depth and lots of idle connections.
+ *
+ * tasks are driven by the same Epoll as stackful coroutines: awaiting
+ * Readable/Writable registers the fd by Epoll::RegisterEvent and awaiting
+ * Sleep adds a timer, the task is resumed by the event loop of the thread it
+ * suspended in.
+ *
+ * @attention a suspended task is resumed in main coroutine, so it must not
+ * call functions suspending stackful coroutine, e.g. hooked read or CoMutex.
+ * use AsyncRead/AsyncWrite instead. stackful coroutines wait for a task by
+ * Await
+ */
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+// resume the awaiting task when a task finishes. symmetric transfer, so that a
+// long chain of tasks finishing synchronously doesn't grow the stack
+struct FinalAwaiter {
+  bool await_ready() noexcept { return false; }
+
+  template <typename P>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+    auto next = h.promise().continuation_;
+    return next ? next : std::noop_coroutine();
+  }
+
+  void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+  // tasks are lazy, they start when being awaited
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() { exception_ = std::current_exception(); }
+
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr exception_;
+};
+
+template <typename T> struct Promise : PromiseBase {
+  Task<T> get_return_object() noexcept;
+
+  template <typename U> void return_value(U &&val) {
+    value_.emplace(std::forward<U>(val));
+  }
+
+  T Result() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+    return std::move(*value_);
+  }
+
+  std::optional<T> value_;
+};
+
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void Result() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+};
+
+// a coroutine owning itself, its frame is freed when it finishes
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+} // namespace detail
+
+/**
+ * @brief the result of a stackless coroutine, e.g.
+ *
+ *  Task<int> Add(int a, int b) { co_await Sleep(10); co_return a + b; }
+ *  Task<> Run() { int v = co_await Add(1, 2); }
+ *
+ * a task starts when it's awaited and can be awaited only once. exceptions
+ * escaping from the task are rethrown to the awaiter
+ */
+template <typename T> class Task {
+public:
+  typedef detail::Promise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  Task() = default;
+
+  explicit Task(handle_type h) : handle_(h) {}
+
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      Destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  ~Task() { Destroy(); }
+
+  bool Valid() const { return (bool)handle_; }
+
+  bool IsDone() const { return !handle_ || handle_.done(); }
+
+  // the result of a finished task
+  T Result() { return handle_.promise().Result(); }
+
+  auto operator co_await() noexcept {
+    struct Awaiter : WaitAwaiter {
+      T await_resume() { return this->h_.promise().Result(); }
+    };
+    return Awaiter{{handle_}};
+  }
+
+  // wait for the task to finish without taking its result
+  auto WhenDone() noexcept { return WaitAwaiter{handle_}; }
+
+private:
+  struct WaitAwaiter {
+    bool await_ready() noexcept { return !h_ || h_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+      h_.promise().continuation_ = caller;
+      return h_;
+    }
+
+    void await_resume() noexcept {}
+
+    handle_type h_;
+  };
+
+  void Destroy() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+  handle_type handle_;
+};
+
+namespace detail {
+
+template <typename T> Task<T> Promise<T>::get_return_object() noexcept {
+  return Task<T>(Task<T>::handle_type::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+  return Task<void>(Task<void>::handle_type::from_promise(*this));
+}
+
+inline DetachedTask RunDetached(Task<void> task) { co_await task; }
+
+struct AwaitState {
+  bool done_ = false;
+  CoWaiter *waiter_ = nullptr;
+};
+
+template <typename T>
+DetachedTask NotifyWhenDone(Task<T> &task, AwaitState &state) {
+  co_await task.WhenDone();
+  state.done_ = true;
+  if (state.waiter_) {
+    state.waiter_->Wake();
+  }
+}
+
+} // namespace detail
+
+/**
+ * @brief run task in background, it runs until its first suspension before
+ * returning. the task must not throw, otherwise the program is terminated
+ */
+inline void Spawn(Task<void> task) { detail::RunDetached(std::move(task)); }
+
+/**
+ * @brief wait for task in stackful coroutine or main coroutine and return its
+ * result
+ *
+ * in coroutine, current coroutine is suspended until the task finishes. in
+ * main coroutine, the event loop of current thread is run until the task
+ * finishes
+ */
+template <typename T> T Await(Task<T> task) {
+  detail::AwaitState state;
+  detail::NotifyWhenDone(task, state);
+  if (!state.done_) {
+    if (Schedule::GetInvokeDeepth() >= 2) {
+      CoWaiter waiter;
+      state.waiter_ = &waiter;
+      waiter.Suspend();
+    } else {
+      auto epoll = Epoll::GetThreadEpoll();
+      while (!state.done_) {
+        Schedule::EventloopOnce(epoll, 1000);
+      }
+    }
+  }
+  return task.Result();
+}
+
+// suspend current task for ms milliseconds. the awaiter lives in the frame
+// of task, if the task is destroyed while sleeping, the timer is cancelled
+// so that it doesn't resume a freed frame
+struct SleepAwaiter {
+  ~SleepAwaiter();
+
+  bool await_ready() const noexcept { return ms_ == 0; }
+  void await_suspend(std::coroutine_handle<> h);
+  void await_resume() const noexcept {}
+
+  uint64_t ms_;
+  std::coroutine_handle<> h_ = {};
+  Epoll *epoll_ = nullptr;
+  TimerHandle timer_ = {};
+};
+
+// suspend current task until fd is ready for type, see Epoll::EventType. the
+// event is cancelled if the task is destroyed while waiting
+struct EventAwaiter {
+  ~EventAwaiter();
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h);
+  void await_resume() const noexcept {}
+
+  int fd_;
+  int type_;
+  std::coroutine_handle<> h_ = {};
+  Epoll *epoll_ = nullptr; // not nullptr while the event is registered
+};
+
+inline SleepAwaiter Sleep(uint64_t ms) { return SleepAwaiter{ms}; }
+
+inline EventAwaiter Readable(int fd) {
+  return EventAwaiter{fd, Epoll::EventType::READ};
+}
+
+inline EventAwaiter Writable(int fd) {
+  return EventAwaiter{fd, Epoll::EventType::WRITE};
+}
+
+/**
+ * @brief read or write fd, suspend current task instead of blocking thread
+ * when fd is not ready. fd is set to nonblocking
+ *
+ * @return the same as read(2) and write(2)
+ */
+Task<ssize_t> AsyncRead(int fd, void *buf, size_t count);
+
+Task<ssize_t> AsyncWrite(int fd, const void *buf, size_t count);
+
+} // namespace Sylar
+
+#endif
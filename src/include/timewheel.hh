@@ -3,7 +3,6 @@
 
 #include "util.hh"
 #include <functional>
-#include <list>
 #include <memory>
 #include <thread>
 #include <vector>
@@ -11,31 +10,120 @@
 namespace Sylar {
 
 class Coroutine;
+class TimeWheel;
+class TimerGroup;
 
-// this class represent a timeout event. we use list to organize each timeout
-// event in each node of list, we have a field point to TimeoutList, which is
-// faster to locate the head and the tail of current list
-struct TimeoutItem {
-  int remaining_ticks_;        // the remaining ticks of current timeout event
-  int repeat_interval_;        // the repeat interval of current timeout event
-  uint64_t register_time_;     // the register timestamp of this timeout event
+// the link of intrusive doubly linked list, a slot of wheel is a sentinel
+struct TimerLink {
+  TimerLink *prev_;
+  TimerLink *next_;
+
+  TimerLink() : prev_(this), next_(this) {}
+
+  bool Empty() const { return next_ == this; }
+
+  void PushBack(TimerLink *link) {
+    link->prev_ = prev_;
+    link->next_ = this;
+    prev_->next_ = link;
+    prev_ = link;
+  }
+
+  void Unlink() {
+    prev_->next_ = next_;
+    next_->prev_ = prev_;
+    prev_ = next_ = this;
+  }
+};
+
+// this class represent a timeout event, which is linked into a slot of wheel.
+// items are allocated from the pool of TimeWheel and recycled once the event
+// is triggered for the last time or cancelled
+struct TimeoutItem : public TimerLink {
+  uint64_t id_;                // changed on every allocation, see TimerHandle
+  uint64_t expire_;            // the tick to trigger
+  uint64_t align_;             // expire_ is a multiple of it, see slack
+  uint64_t repeat_interval_;   // the repeat interval of current timeout event
   int repeat_count_;           // the times of executing, -1 means infinity
   std::function<void()> func_; // the callback function of this timeout event
 
   std::shared_ptr<Coroutine>
       perform_co_; // coroutine executing this timeout event
+
+  TimerGroup *group_ = nullptr; // triggered by the callback of group if set
+  uint64_t data_ = 0;           // passed to the callback of group
+
+  uint32_t slot_;         // the index in TimeWheel::wheel_ while linked
+  bool pending_ = false; // false once it's removed from wheel
+  bool firing_ = false;  // whether its callback is being executed
+};
+
+/**
+ * @brief the handle of a timeout event returned by TimeWheel::AddTimer. it
+ * stays safe to use after the event is triggered or cancelled, since the item
+ * is never freed before the wheel and a recycled item gets a new id
+ */
+class TimerHandle {
+public:
+  TimerHandle() : item_(nullptr), id_(0) {}
+
+  // whether it's returned by AddTimer, rather than whether it's pending
+  explicit operator bool() const { return item_ != nullptr; }
+
+private:
+  friend TimeWheel;
+  TimerHandle(TimeoutItem *item, uint64_t id) : item_(item), id_(id) {}
+
+  TimeoutItem *item_;
+  uint64_t id_;
 };
 
+/**
+ * @brief timers sharing one callback, e.g. the idle timeouts of connections.
+ * the callback receives the data of all timers of group expired in the same
+ * tick, so that thousands of them are handled in one pass rather than by
+ * thousands of callbacks. see TimeWheel::AddGroupTimer
+ *
+ * @attention a group must outlive its pending timers
+ */
+class TimerGroup {
+public:
+  typedef std::function<void(std::vector<uint64_t> &)> Callback;
+
+  explicit TimerGroup(Callback callback)
+      : callback_(std::move(callback)), queued_(false) {}
+
+  TimerGroup(const TimerGroup &) = delete;
+  TimerGroup &operator=(const TimerGroup &) = delete;
+
+private:
+  friend TimeWheel;
+  Callback callback_;
+  std::vector<uint64_t> expired_; // collected by ExecuteTimeout
+  bool queued_;                   // whether it's in TimeWheel::groups_
+};
+
+/**
+ * @brief hierarchical timing wheel. the wheel of level 0 has slots of one
+ * tick, and each slot of level n covers the whole wheel of level n-1. a timer
+ * is put in the level of the highest digit(in base of slots) where its expiry
+ * differs from the current tick, and is moved to lower levels(cascaded) when
+ * the current tick reaches its slot. so adding and cancelling are O(1), and
+ * each timer is cascaded at most once per level
+ */
 class TimeWheel {
 public:
   ~TimeWheel() = default;
 
   /**
-   * @param slots the number of slot
-   * @param granularity the granularity of each slot
+   * @param slots the number of slot in each level, rounded up to power of 2
+   * @param granularity the granularity of each slot, millisecond
    */
   TimeWheel(size_t slots = 1 * 1000, size_t granularity = 1);
 
+  TimeWheel(const TimeWheel &) = delete;
+  TimeWheel &operator=(const TimeWheel &) = delete;
+
   /**
    * @brief add timeout event to timewheel
    *
@@ -53,32 +141,155 @@ public:
    * @param func callback function of this timeout event
    * @param co executing coroutine
    * @param times the times of loop
+   * @param slack the event may be triggered up to slack milliseconds later.
+   * the expiry is rounded up to a multiple of the largest power of 2 ticks
+   * within slack, so that timers nearby share a slot and are triggered
+   * together, and the event loop wakes up less often
+   *
+   * @return the handle used to cancel this timeout event
    */
-  void AddTimer(uint64_t expired, std::function<void()> func,
-                std::shared_ptr<Coroutine> co = nullptr, int times = 1);
+  TimerHandle AddTimer(uint64_t expired, std::function<void()> func,
+                       std::shared_ptr<Coroutine> co = nullptr, int times = 1,
+                       uint64_t slack = 0) {
+    return AddTimerUS(expired * 1000, std::move(func), std::move(co), times,
+                      slack * 1000);
+  }
 
-  void ExecuteTimeout(uint64_t now);
+  // AddTimer whose expire time and slack are in microseconds, it's rounded
+  // down to the granularity
+  TimerHandle AddTimerUS(uint64_t expired, std::function<void()> func,
+                         std::shared_ptr<Coroutine> co = nullptr,
+                         int times = 1, uint64_t slack = 0);
 
-  void SetGranularity(size_t granularity) { granularity_ = granularity; }
+  /**
+   * @brief add a one-shot timer of group, whose data is passed to the
+   * callback of group with other timers of group expired in the same tick.
+   * a large slack batches more of them, see AddTimer
+   *
+   * @param expired relative expire time, millisecond
+   */
+  TimerHandle AddGroupTimer(uint64_t expired, TimerGroup *group, uint64_t data,
+                            uint64_t slack = 0) {
+    return AddGroupTimerUS(expired * 1000, group, data, slack * 1000);
+  }
 
-  size_t GetGranularity() { return granularity_; }
+  TimerHandle AddGroupTimerUS(uint64_t expired, TimerGroup *group,
+                              uint64_t data, uint64_t slack = 0);
 
   /**
-   * @brief return interval ofthe next timeout event
+   * @brief remove a timeout event before it's triggered, so that timers of
+   * finished operations don't pile up in wheel. it can be invoked in the
+   * callback of any timeout event, including itself
+   *
+   * @return false if the event has been removed or triggered for the last time
+   */
+  bool CancelTimer(const TimerHandle &handle);
+
+  // trigger the timeout events expired at now, millisecond
+  void ExecuteTimeout(uint64_t now) { ExecuteTimeoutUS(now * 1000); }
+
+  void ExecuteTimeoutUS(uint64_t now);
+
+  void SetGranularity(size_t granularity) {
+    SetGranularityUS(granularity * 1000);
+  }
+
+  size_t GetGranularity() { return granularity_ / 1000; }
+
+  /**
+   * @brief set the granularity of each slot in microseconds, e.g. for pacing
+   * at sub-millisecond intervals. the wheel must be empty
+   */
+  void SetGranularityUS(uint64_t granularity);
+
+  uint64_t GetGranularityUS() const { return granularity_; }
+
+  // the number of pending timeout events
+  size_t GetTimerCount() const { return count_; }
+
+  static constexpr uint64_t kNoTimeout = UINT64_MAX;
+
+  /**
+   * @brief return interval of the next timeout event. it's O(1) if timers
+   * don't change, otherwise it finds the first occupied slot by bitmaps
    *
    * @return uint64_t the millisecond start from now and end to next timeout
-   * event, zero means timewheel is empty
+   * event(rounded up), zero means it's due, kNoTimeout means timewheel is
+   * empty
    */
-  uint64_t GetNextTimeout(uint64_t now);
+  uint64_t GetNextTimeout(uint64_t now) {
+    uint64_t us = GetNextTimeoutUS(now * 1000);
+    return us == kNoTimeout ? kNoTimeout : (us + 999) / 1000;
+  }
+
+  // GetNextTimeout in microseconds
+  uint64_t GetNextTimeoutUS(uint64_t now);
 
   std::string Dump();
 
 protected:
-  std::vector<std::list<std::shared_ptr<TimeoutItem>>> wheel_;
-  size_t slots_;          // the size of wheel, default is 1 * 1000(which is 1s)
-  size_t granularity_;    // the granularity of each slot
-  uint64_t last_trigger_; // last trigger timestamp
-  uint64_t current_slot;  // the index of iterating time wheel
+  // the slot of level, a level has slots_ of them
+  TimerLink &Slot(int level, size_t idx) {
+    return wheel_[(level << bits_) + idx];
+  }
+
+  // link item into the slot by its expiry, relative to current_
+  void Place(TimeoutItem *item);
+
+  void Unlink(TimeoutItem *item);
+
+  // move the items in the slot of level to lower levels
+  void Cascade(int level, size_t idx);
+
+  // move current_ forward to tick, which is at most the start of next round
+  // of level 0. the slots beginning at tick are cascaded at once, so a slot
+  // of the current digit in higher levels is always empty
+  void AdvanceTo(uint64_t tick);
+
+  // the first occupied slot of level whose index >= from, -1 if none
+  int FindSlot(int level, size_t from) const;
+
+  // the earliest tick of pending timers, kNoTimeout if it's empty
+  uint64_t FindNextTick();
+
+  // invoke the callbacks of groups_ with their expired timers
+  void RunGroups();
+
+  // an item expiring after timeout and slack microseconds from now
+  TimeoutItem *NewItem(uint64_t timeout, uint64_t slack);
+
+  // the first tick >= tick which is a multiple of align
+  static uint64_t AlignTick(uint64_t tick, uint64_t align) {
+    return (tick + align - 1) & ~(align - 1);
+  }
+
+  TimeoutItem *AllocItem();
+  void FreeItem(TimeoutItem *item);
+
+  std::vector<TimerLink> wheel_; // levels_ * slots_ sentinels
+  // a bit per slot, set if it's occupied. each level has words_ of them
+  std::vector<uint64_t> occupied_;
+  size_t words_;
+  size_t slots_;                 // the size of each level, power of 2
+  int bits_;                     // log2 of slots_
+  int levels_;                   // enough to hold any tick of uint64_t
+  uint64_t granularity_;         // the granularity of each slot, microsecond
+  uint64_t start_;               // the timestamp of tick 0, microsecond
+  uint64_t current_;             // the next tick to be handled
+  size_t count_;                 // pending timeout events
+  // the cache of FindNextTick, invalidated when the earliest timer is
+  // triggered or cancelled
+  uint64_t next_tick_;
+  bool next_valid_;
+  // groups having timers expired in the slot being handled
+  std::vector<TimerGroup *> groups_;
+
+  // TimeoutItems are allocated by chunks and recycled by a free list, so
+  // adding and removing timers don't call malloc
+  static constexpr size_t kItemChunkSize = 1024;
+  std::vector<std::unique_ptr<TimeoutItem[]>> chunks_;
+  TimeoutItem *free_items_; // linked by next_
+  uint64_t next_id_;
 };
 
 } // namespace Sylar
@@ -0,0 +1,238 @@
+#ifndef __SYLAR_URING_HH__
+#define __SYLAR_URING_HH__
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <vector>
+
+namespace Sylar {
+
+class Coroutine;
+class Epoll;
+
+// the work done by an IoUring, used to measure the batching of submission
+struct UringStats {
+  uint64_t enter_;    // io_uring_enter syscalls
+  uint64_t submit_;   // sqes submitted
+  uint64_t complete_; // cqes reaped
+};
+
+/**
+ * @brief an io_uring driven by the event loop of its thread, which performs
+ * socket I/O in one step instead of waiting for readiness by epoll and
+ * retrying the syscall.
+ *
+ * the ring is set up by raw syscalls. its fd is registered in the Epoll of
+ * the owning thread, so completions are dispatched by Schedule::EventloopOnce
+ * like any other event, and sqes queued in one iteration are submitted
+ * together by Epoll::FlushChanges before waiting.
+ *
+ * an operation suspends the calling coroutine until its completion arrives.
+ * the deadline of coroutine is enforced by a linked timeout in kernel, and
+ * Cancel requests the kernel to cancel the operation. either way the
+ * coroutine is resumed only after kernel releases the buffers.
+ *
+ * hooked I/O on sockets goes through the ring of current thread once
+ * SetEnable(true) is invoked, and falls back to epoll if kernel doesn't
+ * support io_uring or the operations used here.
+ *
+ * @attention a ring is only used by its owning thread
+ */
+class IoUring {
+public:
+  typedef std::shared_ptr<IoUring> ptr;
+
+  /**
+   * @brief whether io_uring and all the operations used here are supported,
+   * probed once by setting up a tiny ring
+   */
+  static bool IsSupported();
+
+  // whether hooked I/O uses io_uring, false by default
+  static void SetEnable(bool val) { s_enable_.store(val); }
+
+  static bool IsEnabled() {
+    return s_enable_.load(std::memory_order_relaxed) && IsSupported();
+  }
+
+  /**
+   * @brief the ring of current thread, which is created and registered into
+   * the Epoll of current thread on the first access
+   *
+   * @return nullptr if io_uring is not supported
+   */
+  static IoUring *GetThreadRing();
+
+  /**
+   * @brief set up a ring
+   *
+   * @param entries the size of submission queue, rounded up to power of 2
+   * @param epoll completions resume coroutines by it, see Coroutine::Park
+   *
+   * @attention only the ring of GetThreadRing is submitted and reaped by
+   * event loop, others are driven by their owner
+   */
+  IoUring(unsigned entries, Epoll *epoll);
+
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  bool Valid() const { return fd_ >= 0; }
+
+  int GetFd() const { return fd_; }
+
+  /**
+   * @brief run the operation prepared by prep(io_uring_sqe *) and wait for
+   * its completion. a coroutine is suspended, while the main coroutine waits
+   * in io_uring_enter and cannot time out or be cancelled
+   *
+   * @return the res of cqe, i.e. the result of syscall or -errno. -ETIMEDOUT
+   * if the deadline passes and -ECANCELED if cancelled
+   */
+  template <typename Prep> int Execute(Prep &&prep) {
+    int err = CheckCurrent();
+    if (err != 0) {
+      return -err;
+    }
+    io_uring_sqe *sqe = GetSqe(2);
+    if (!sqe) {
+      return -EBUSY;
+    }
+    prep(sqe);
+    return Wait(sqe);
+  }
+
+  // the following operations return like syscalls: -1 and errno on failure
+
+  ssize_t Recv(int fd, void *buf, size_t len, int flags);
+
+  ssize_t Send(int fd, const void *buf, size_t len, int flags);
+
+  ssize_t RecvMsg(int fd, struct msghdr *msg, int flags);
+
+  ssize_t SendMsg(int fd, const struct msghdr *msg, int flags);
+
+  int Accept(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+
+  int Connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+  // suspend current coroutine for ms milliseconds by a kernel timeout
+  int Sleep(uint64_t ms);
+
+  /**
+   * @brief register count buffers of size bytes, so that ReadFixed and
+   * WriteFixed don't map and pin user pages on every operation. the former
+   * buffers are unregistered
+   *
+   * @return false if kernel refuses, e.g. by RLIMIT_MEMLOCK
+   */
+  bool RegisterBuffers(size_t count, size_t size);
+
+  // an index of free registered buffer, -1 if all of them are in use
+  int AcquireBuffer();
+
+  void ReleaseBuffer(int idx);
+
+  char *GetBuffer(int idx) { return buffers_ + (size_t)idx * buffer_size_; }
+
+  size_t GetBufferSize() const { return buffer_size_; }
+
+  /**
+   * @brief read into or write from the registered buffer idx. fd must not be
+   * nonblocking, otherwise kernel returns EAGAIN instead of polling it
+   *
+   * @param offset the file offset, -1 for the current position
+   */
+  ssize_t ReadFixed(int fd, int idx, size_t len, off_t offset = -1);
+
+  ssize_t WriteFixed(int fd, int idx, size_t len, off_t offset = -1);
+
+  /**
+   * @brief a free sqe, which is submitted by next Submit. sqes are submitted
+   * first if less than n are free, so that n sqes can be linked
+   *
+   * @return nullptr if the ring is broken
+   */
+  io_uring_sqe *GetSqe(unsigned n = 1);
+
+  // submit queued sqes by one syscall, return the number submitted
+  int Submit();
+
+  // handle all the completions, return the number of cqes
+  int Reap();
+
+  /**
+   * @brief cancel the operations on fd at once, invoked by hooked close.
+   * they hold a reference of the file, which isn't released by closing fd
+   */
+  void CancelFd(int fd);
+
+  const UringStats &GetStats() const { return stats_; }
+
+private:
+  // the state of an operation, which lives on the stack of waiter
+  struct Op {
+    std::shared_ptr<Coroutine> co_; // nullptr if waited by main coroutine
+    uint64_t seq_;
+    int res_;
+    int pending_; // the number of cqes not arrived, the link timeout has one
+    bool timed_out_;
+    __kernel_timespec ts_;
+  };
+
+  // the errno if current coroutine cannot start waiting, or 0
+  int CheckCurrent();
+
+  int Wait(io_uring_sqe *sqe);
+
+  int Enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+  void UnregisterBuffers();
+
+  int fd_;
+  Epoll *epoll_;
+  // submission queue, the pointers point into the mapped rings
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_flags_;
+  unsigned *sq_array_;
+  io_uring_sqe *sqes_;
+  unsigned sq_entries_;
+  unsigned sq_local_tail_; // sqes prepared, published to kernel by Submit
+  unsigned sq_submitted_;  // sqes passed to io_uring_enter
+  // completion queue
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  io_uring_cqe *cqes_;
+
+  void *ring_ptr_;
+  size_t ring_size_;
+  void *cq_ptr_; // nullptr if it's mapped with submission queue
+  size_t cq_size_;
+  size_t sqes_size_;
+
+  char *buffers_;
+  size_t buffer_size_;
+  size_t buffer_cnt_;
+  std::vector<int> free_buffers_;
+
+  size_t inflight_; // operations waiting for completion
+  UringStats stats_;
+
+  static std::atomic<bool> s_enable_;
+};
+
+} // namespace Sylar
+
+#endif
@@ -9,8 +9,12 @@
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
 
 namespace Sylar {
 
@@ -30,12 +34,83 @@ namespace Sylar {
 // return process id
 pid_t GetProcessId();
 
-// return thread id
+// return thread id, which is cached in thread local storage
 pid_t GetThreadId();
 
+// return the id of running coroutine, main coroutine is 0
+uint64_t GetCoroutineId();
+
 // get time from system reboot
 uint64_t GetElapseFromRebootMS();
 
+// the same clock as GetElapseFromRebootMS in microseconds and nanoseconds
+uint64_t GetElapseFromRebootUS();
+
+uint64_t GetElapseFromRebootNS();
+
+// read the cycle counter of cpu, e.g. rdtsc on x86-64, which is cheap enough
+// for the path of switching coroutines. it falls back to nanoseconds of
+// monotonic clock on other architectures
+inline uint64_t ReadCycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t val;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+  return val;
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// convert cycles of ReadCycles to nanoseconds, the rate is calibrated against
+// monotonic clock since the process started
+uint64_t CyclesToNS(uint64_t cycles);
+
+/**
+ * @brief a per-thread clock for hot paths, e.g. adding timers, checking
+ * deadlines and stamping log events.
+ *
+ * the event loop refreshes it once after waking up, then callbacks and
+ * timers of that iteration read the cached time without a syscall. the
+ * cached time lags behind by the time spent in this iteration so far, so a
+ * timer added by a callback may fire that much earlier, and a timer due
+ * meanwhile fires in next iteration. outside the event loop, i.e. after
+ * Release, the clock is read every time.
+ *
+ * with SetTscEnable(true), the clock is derived from ReadCycles by a rate
+ * calibrated once, and every thread re-anchors it to the monotonic clock
+ * each second, so that it doesn't drift.
+ */
+class Clock {
+public:
+  // microseconds in the same clock as GetElapseFromRebootUS
+  static uint64_t NowUS();
+
+  static uint64_t NowMS() { return NowUS() / 1000; }
+
+  // seconds since epoch, for log events
+  static time_t WallTime();
+
+  // read the clock and cache it until Release, return the time read
+  static uint64_t Refresh();
+
+  static void Release();
+
+  /**
+   * @brief derive the clock from the cycle counter. the first enabling
+   * blocks for about 10ms to calibrate it
+   *
+   * @return false if the counter isn't invariant, e.g. it stops in deep
+   * sleep states, then the clock is read by clock_gettime
+   */
+  static bool SetTscEnable(bool val);
+
+  static bool IsTscEnabled();
+};
+
 void BackTrace(std::vector<std::string> &bt, int sz, int skip);
 
 std::string BacktraceToString(int sz, int skip, const std::string &prefix = "");
@@ -0,0 +1,342 @@
+#include "include/introspect.hh"
+#include "include/log.hh"
+#include <algorithm>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace Sylar {
+
+std::atomic<bool> CoroutineRegistry::s_timing_{true};
+std::atomic<bool> CoroutineRegistry::s_dump_requested_{false};
+
+// schedules of living threads, function local so that it's usable during
+// static initialization
+static Mutex &SchedulesMutex() {
+  static Mutex mu;
+  return mu;
+}
+
+static std::unordered_set<Schedule *> &Schedules() {
+  static std::unordered_set<Schedule *> schedules;
+  return schedules;
+}
+
+static Mutex &SinkMutex() {
+  static Mutex mu;
+  return mu;
+}
+
+static std::function<void(const std::string &)> &Sink() {
+  static std::function<void(const std::string &)> sink;
+  return sink;
+}
+
+static void EraseSchedule(Schedule *sc) {
+  Mutex::ScopeLock lock(SchedulesMutex());
+  Schedules().erase(sc);
+}
+
+// the schedule of a thread is kept alive by its main coroutine, so remove it
+// from registry when the thread exits
+struct ScheduleGuard {
+  ~ScheduleGuard() {
+    if (sc_) {
+      EraseSchedule(sc_);
+    }
+  }
+  Schedule *sc_ = nullptr;
+};
+
+static thread_local ScheduleGuard t_schedule_guard;
+
+void CoroutineRegistry::AddSchedule(Schedule *sc) {
+  {
+    Mutex::ScopeLock lock(SchedulesMutex());
+    Schedules().insert(sc);
+  }
+  t_schedule_guard.sc_ = sc;
+}
+
+void CoroutineRegistry::RemoveSchedule(Schedule *sc) { EraseSchedule(sc); }
+
+void CoroutineRegistry::Link(Schedule *sc, Coroutine *co) {
+  SpinLock::ScopeLock lock(sc->live_mu_);
+  co->live_prev_ = nullptr;
+  co->live_next_ = sc->live_head_;
+  if (sc->live_head_) {
+    sc->live_head_->live_prev_ = co;
+  }
+  sc->live_head_ = co;
+  sc->live_cnt_++;
+}
+
+void CoroutineRegistry::Unlink(Schedule *sc, Coroutine *co) {
+  SpinLock::ScopeLock lock(sc->live_mu_);
+  if (co->live_prev_) {
+    co->live_prev_->live_next_ = co->live_next_;
+  } else {
+    sc->live_head_ = co->live_next_;
+  }
+  if (co->live_next_) {
+    co->live_next_->live_prev_ = co->live_prev_;
+  }
+  co->live_prev_ = co->live_next_ = nullptr;
+  sc->live_cnt_--;
+}
+
+std::vector<CoroutineInfo> CoroutineRegistry::Snapshot() {
+  std::vector<CoroutineInfo> infos;
+  uint64_t now = ReadCycles();
+  Mutex::ScopeLock lock(SchedulesMutex());
+  for (auto sc : Schedules()) {
+    SpinLock::ScopeLock live_lock(sc->live_mu_);
+    infos.reserve(infos.size() + sc->live_cnt_);
+    // fields written by the running thread are read racily, it's only a
+    // snapshot for diagnosis
+    Coroutine *running = sc->running_co_;
+    uint64_t switch_cycles = sc->switch_cycles_.load();
+    for (Coroutine *co = sc->live_head_; co; co = co->live_next_) {
+      CoroutineInfo info;
+      info.id_ = co->id_;
+      info.tid_ = sc->tid_;
+      info.state_ = co->co_state_;
+      info.main_ = co->is_main_co_;
+      info.running_ = co == running;
+      info.shared_stack_ = co->use_shared_stk_;
+      info.site_ = co->site_;
+      info.switches_ = co->switches_.load(std::memory_order_relaxed);
+      uint64_t cycles = co->run_cycles_.load(std::memory_order_relaxed);
+      uint64_t slice = 0;
+      if (info.running_ && IsTiming() && switch_cycles != 0 &&
+          now > switch_cycles) {
+        slice = now - switch_cycles;
+      }
+      info.run_ns_ = CyclesToNS(cycles + slice);
+      info.slice_ns_ = CyclesToNS(slice);
+      info.stack_size_ = co->stack_mem_ ? co->stack_mem_->size_ : 0;
+      info.stack_hwm_ = co->stack_hwm_.load(std::memory_order_relaxed);
+      infos.push_back(info);
+    }
+  }
+  return infos;
+}
+
+std::string CoroutineRegistry::SymbolizeSite(void *site) {
+  if (!site) {
+    return "unknown";
+  }
+  std::stringstream ss;
+  Dl_info dl;
+  if (dladdr(site, &dl) == 0) {
+    ss << site;
+    return ss.str();
+  }
+  if (dl.dli_sname) {
+    int status = 0;
+    char *name = abi::__cxa_demangle(dl.dli_sname, nullptr, nullptr, &status);
+    ss << (status == 0 && name ? name : dl.dli_sname) << "+0x" << std::hex
+       << ((char *)site - (char *)dl.dli_saddr);
+    free(name);
+  } else {
+    // not exported, resolve it by `addr2line -e binary offset`
+    ss << (dl.dli_fname ? dl.dli_fname : "?") << "+0x" << std::hex
+       << ((char *)site - (char *)dl.dli_fbase);
+  }
+  return ss.str();
+}
+
+static const char *StateName(const CoroutineInfo &info) {
+  switch (info.state_) {
+  case Coroutine::CO_READY:
+    return "ready";
+  case Coroutine::CO_RUNNING:
+    return "running";
+  case Coroutine::CO_TERMINAL:
+    return "terminal";
+  default:
+    return "unknown";
+  }
+}
+
+std::string CoroutineRegistry::Dump() {
+  auto infos = Snapshot();
+  std::map<pid_t, std::vector<const CoroutineInfo *>> threads;
+  for (auto &info : infos) {
+    threads[info.tid_].push_back(&info);
+  }
+  std::stringstream ss;
+  ss << "coroutines: " << infos.size() << ", threads: " << threads.size()
+     << std::endl;
+  ss << std::fixed << std::setprecision(3);
+  for (auto &[tid, cos] : threads) {
+    ss << "thread " << tid << ": " << cos.size() << " coroutines" << std::endl;
+    for (auto info : cos) {
+      ss << "  id=" << info->id_ << (info->main_ ? " main" : "")
+         << " state=" << StateName(*info) << " switches=" << info->switches_
+         << " run=" << info->run_ns_ / 1e6 << "ms";
+      if (info->running_) {
+        ss << " current_slice=" << info->slice_ns_ / 1e6 << "ms";
+      }
+      if (!info->main_) {
+        ss << " stack=" << info->stack_hwm_ << "/" << info->stack_size_
+           << (info->shared_stack_ ? "(shared)" : "")
+           << " site=" << SymbolizeSite(info->site_);
+      }
+      ss << std::endl;
+    }
+  }
+  return ss.str();
+}
+
+static void OnDumpSignal(int) { CoroutineRegistry::RequestDump(); }
+
+void CoroutineRegistry::InstallDumpSignal(int signo) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &OnDumpSignal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(signo, &sa, nullptr);
+}
+
+bool CoroutineRegistry::HandleDumpRequest() {
+  if (!s_dump_requested_.exchange(false)) {
+    return false;
+  }
+  std::string dump = Dump();
+  std::function<void(const std::string &)> sink;
+  {
+    Mutex::ScopeLock lock(SinkMutex());
+    sink = Sink();
+  }
+  if (sink) {
+    sink(dump);
+  } else {
+    SYLAR_INFO_LOG(SYLAR_LOG_ROOT) << "coroutine dump" << std::endl << dump;
+  }
+  return true;
+}
+
+void CoroutineRegistry::SetDumpSink(
+    std::function<void(const std::string &)> sink) {
+  Mutex::ScopeLock lock(SinkMutex());
+  Sink() = std::move(sink);
+}
+
+struct StackSite {
+  uint64_t samples_ = 0;
+  size_t max_used_ = 0;
+  size_t total_used_ = 0;
+  size_t stack_size_ = 0;
+};
+
+static Mutex &StackSitesMutex() {
+  static Mutex mu;
+  return mu;
+}
+
+static std::unordered_map<void *, StackSite> &StackSites() {
+  static std::unordered_map<void *, StackSite> sites;
+  return sites;
+}
+
+static std::atomic<uint64_t> s_min_samples{16};
+
+void StackProfiler::Paint(char *stack, size_t size) {
+  uint64_t *words = (uint64_t *)stack;
+  for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+    words[i] = kCanary;
+  }
+}
+
+size_t StackProfiler::MeasureUsage(const char *stack, size_t size) {
+  // stack grows towards lower address, the first word overwritten from the
+  // bottom is the deepest point
+  const uint64_t *words = (const uint64_t *)stack;
+  size_t cnt = size / sizeof(uint64_t);
+  size_t i = 0;
+  while (i < cnt && words[i] == kCanary) {
+    i++;
+  }
+  return size - i * sizeof(uint64_t);
+}
+
+void StackProfiler::Record(void *site, size_t used, size_t stack_size) {
+  Mutex::ScopeLock lock(StackSitesMutex());
+  auto &stats = StackSites()[site];
+  stats.samples_++;
+  stats.max_used_ = std::max(stats.max_used_, used);
+  stats.total_used_ += used;
+  stats.stack_size_ = stack_size;
+}
+
+static size_t RecommendLocked(const StackSite &stats) {
+  if (stats.samples_ == 0 || stats.samples_ < s_min_samples.load()) {
+    return 0;
+  }
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = stats.max_used_ +
+                std::max(stats.max_used_ / 2, StackProfiler::kMinHeadroom);
+  return (size + page - 1) / page * page;
+}
+
+size_t StackProfiler::Recommend(void *site) {
+  Mutex::ScopeLock lock(StackSitesMutex());
+  auto it = StackSites().find(site);
+  return it == StackSites().end() ? 0 : RecommendLocked(it->second);
+}
+
+size_t StackProfiler::PickStackSize(void *site, size_t configured) {
+  size_t size = Recommend(site);
+  return size == 0 ? configured : std::min(size, configured);
+}
+
+void StackProfiler::SetMinSamples(uint64_t n) { s_min_samples = n; }
+
+uint64_t StackProfiler::GetMinSamples() { return s_min_samples.load(); }
+
+std::vector<StackSiteStats> StackProfiler::GetStats() {
+  std::vector<StackSiteStats> res;
+  Mutex::ScopeLock lock(StackSitesMutex());
+  for (auto &[site, stats] : StackSites()) {
+    res.push_back(StackSiteStats{site, stats.samples_, stats.max_used_,
+                                 stats.total_used_, stats.stack_size_,
+                                 RecommendLocked(stats)});
+  }
+  std::sort(res.begin(), res.end(),
+            [](const StackSiteStats &a, const StackSiteStats &b) {
+              return a.max_used_ > b.max_used_;
+            });
+  return res;
+}
+
+std::string StackProfiler::Dump() {
+  std::stringstream ss;
+  for (auto &stats : GetStats()) {
+    ss << "site=" << CoroutineRegistry::SymbolizeSite(stats.site_)
+       << " samples=" << stats.samples_ << " max=" << stats.max_used_
+       << " avg=" << stats.total_used_ / stats.samples_
+       << " stack=" << stats.stack_size_;
+    if (stats.recommended_ != 0) {
+      ss << " recommended=" << stats.recommended_;
+    }
+    if (stats.max_used_ + kMinHeadroom > stats.stack_size_) {
+      ss << " (near overflow)";
+    }
+    ss << std::endl;
+  }
+  return ss.str();
+}
+
+void StackProfiler::Clear() {
+  Mutex::ScopeLock lock(StackSitesMutex());
+  StackSites().clear();
+}
+
+} // namespace Sylar
@@ -0,0 +1,341 @@
+#include "include/iomanager.hh"
+#include "include/hook.hh"
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+namespace Sylar {
+
+static thread_local IOManager *t_manager = nullptr;
+static thread_local int t_worker_idx = -1;
+// the coroutine which invokes YieldToQueue in current thread
+static thread_local std::shared_ptr<Coroutine> t_requeue = nullptr;
+
+// the max milliseconds of a parked worker waiting on its epoll fd. tickle
+// should always wake it up, this is just a fallback
+static const uint64_t kIdleTimeout = 100;
+// poll ready I/O events and timers once every kPollInterval tasks, coroutines
+// suspended by I/O won't starve when the run queue is always busy
+static const uint64_t kPollInterval = 64;
+
+IOManager::IOManager(size_t threads, const std::string &name)
+    : name_(name), attr_(std::make_shared<CoroutineAttr>()), next_worker_(0),
+      idle_cnt_(0), active_cnt_(0), stopping_(false), started_(false) {
+  SYLAR_ASSERT(threads > 0);
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(new Worker());
+    workers_.back()->idx_ = i;
+    workers_.back()->event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (workers_.back()->event_fd_ < 0) {
+      throw std::runtime_error("IOManager: eventfd failed");
+    }
+    FdManager::Reset(workers_.back()->event_fd_,
+                     FdManager::FD_INIT | FdManager::FD_POLLABLE |
+                         FdManager::FD_NONBLOCK);
+  }
+}
+
+IOManager::~IOManager() {
+  if (started_) {
+    Stop();
+  }
+  // tasks scheduled but never started
+  for (auto &worker : workers_) {
+    Task *task = nullptr;
+    while (worker->queue_.Pop(task)) {
+      delete task;
+    }
+    for (auto task : worker->inbox_) {
+      delete task;
+    }
+    FdManager::Remove(worker->event_fd_);
+    close_f(worker->event_fd_);
+  }
+}
+
+void IOManager::Start() {
+  if (started_) {
+    return;
+  }
+  SYLAR_ASSERT(!attr_->shared_mem_);
+  started_ = true;
+  stopping_ = false;
+  for (auto &worker : workers_) {
+    Worker *w = worker.get();
+    w->thread_ = std::thread([this, w]() { Run(w); });
+  }
+}
+
+void IOManager::Stop() {
+  if (!started_) {
+    return;
+  }
+  stopping_ = true;
+  TickleAll();
+  for (auto &worker : workers_) {
+    if (worker->thread_.joinable()) {
+      worker->thread_.join();
+    }
+  }
+  started_ = false;
+}
+
+void IOManager::Schedule(std::function<void()> func) {
+  if (!func) {
+    return;
+  }
+  Task *task = new Task();
+  task->func_.swap(func);
+  Submit(task);
+}
+
+void IOManager::Schedule(std::shared_ptr<Coroutine> co) {
+  if (!co) {
+    return;
+  }
+  // the coroutine may be resumed in any worker, its stack cannot be shared
+  // with coroutines of other threads
+  SYLAR_ASSERT(!co->IsSharedStack());
+  Task *task = new Task();
+  task->co_ = std::move(co);
+  Submit(task);
+}
+
+IOManager::Stats IOManager::GetStats() const {
+  Stats stats = {0, 0, 0};
+  for (auto &worker : workers_) {
+    stats.executed_ += worker->executed_.load(std::memory_order_relaxed);
+    stats.stolen_ += worker->stolen_.load(std::memory_order_relaxed);
+    stats.parked_ += worker->parked_.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+IOManager *IOManager::GetThis() { return t_manager; }
+
+int IOManager::GetWorkerIndex() { return t_worker_idx; }
+
+void IOManager::YieldToQueue() {
+  SYLAR_ASSERT(t_manager && Sylar::Schedule::GetInvokeDeepth() >= 2);
+  // we cannot put current coroutine into run queue here, it may be stolen and
+  // resumed by another worker before it is swapped out. the worker requeues
+  // it after Resume returns
+  t_requeue = Sylar::Schedule::GetCurrentCo();
+  Sylar::Schedule::Yield();
+}
+
+void IOManager::Submit(Task *task) {
+  active_cnt_++;
+  if (t_manager == this) {
+    // scheduled by worker, push into its own queue
+    workers_[t_worker_idx]->queue_.Push(task);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle_cnt_.load() > 0) {
+      TickleIdle();
+    }
+    return;
+  }
+  Worker *worker = workers_[next_worker_++ % workers_.size()].get();
+  {
+    Mutex::ScopeLock lock(worker->inbox_mu_);
+    worker->inbox_.push_back(task);
+  }
+  if (worker->idle_.load()) {
+    Tickle(worker);
+  } else if (idle_cnt_.load() > 0) {
+    TickleIdle();
+  }
+}
+
+void IOManager::Run(Worker *worker) {
+  t_manager = this;
+  t_worker_idx = worker->idx_;
+  std::string name = name_ + "_" + std::to_string(worker->idx_);
+  // the name of thread is restricted to 16 characters, including '\0'
+  pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+  // each worker has its own copy, attribute is modified when allocating
+  worker->attr_ = std::make_shared<CoroutineAttr>(*attr_);
+  worker->epoll_ = Epoll::GetThreadEpoll();
+  auto &epoll = worker->epoll_;
+  int efd = worker->event_fd_;
+  epoll->RegisterEvent(
+      Epoll::EventType::READ, efd,
+      [efd]() {
+        // don't use hooked read, we are in main coroutine
+        uint64_t val;
+        while (read_f(efd, &val, sizeof(val)) > 0) {
+        }
+      },
+      nullptr);
+
+  uint64_t tasks = 0;
+  Task *task = nullptr;
+  while (true) {
+    if (GetTask(worker, task)) {
+      Execute(worker, task);
+      if (++tasks % kPollInterval == 0) {
+        Sylar::Schedule::EventloopOnce(epoll, 0);
+        Requeue(worker);
+      }
+      continue;
+    }
+    if (Stopping()) {
+      break;
+    }
+    Idle(worker);
+  }
+
+  epoll->CancelEvent(Epoll::EventType::READ, efd);
+  CoroutinePool::GetThreadPool()->Clear();
+  worker->epoll_ = nullptr;
+  t_manager = nullptr;
+  t_worker_idx = -1;
+}
+
+bool IOManager::GetTask(Worker *worker, Task *&task) {
+  if (worker->queue_.Pop(task)) {
+    return true;
+  }
+  // move tasks in inbox to run queue, so that other workers can steal them
+  std::deque<Task *> inbox;
+  {
+    Mutex::ScopeLock lock(worker->inbox_mu_);
+    inbox.swap(worker->inbox_);
+  }
+  if (!inbox.empty()) {
+    // run queue is LIFO for owner, push in reverse to keep FIFO order
+    for (auto it = inbox.rbegin(); it != inbox.rend(); it++) {
+      worker->queue_.Push(*it);
+    }
+    if (inbox.size() > 1 && idle_cnt_.load() > 0) {
+      TickleIdle();
+    }
+    return worker->queue_.Pop(task);
+  }
+  // steal from others, start from the next worker to spread contention
+  size_t n = workers_.size();
+  for (size_t i = 1; i < n; i++) {
+    Worker *victim = workers_[(worker->idx_ + i) % n].get();
+    if (victim->queue_.Steal(task)) {
+      worker->stolen_++;
+      return true;
+    }
+  }
+  // victim may be busy in a long task, and its inbox is never drained
+  for (size_t i = 1; i < n; i++) {
+    Worker *victim = workers_[(worker->idx_ + i) % n].get();
+    Mutex::ScopeLock lock(victim->inbox_mu_);
+    if (!victim->inbox_.empty()) {
+      task = victim->inbox_.front();
+      victim->inbox_.pop_front();
+      worker->stolen_++;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IOManager::HasTask(Worker *worker) {
+  // the own queue is the most likely to be fed, and checked without a lock
+  if (!worker->queue_.Empty()) {
+    return true;
+  }
+  for (auto &w : workers_) {
+    if (w.get() != worker && !w->queue_.Empty()) {
+      return true;
+    }
+    Mutex::ScopeLock lock(w->inbox_mu_);
+    if (!w->inbox_.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void IOManager::Execute(Worker *worker, Task *task) {
+  std::shared_ptr<Coroutine> co;
+  bool is_func = (bool)task->func_;
+  if (is_func) {
+    // the coroutine of function task finishes the task by itself, it may be
+    // suspended by I/O and resumed by Eventloop later
+    co = CoroutinePool::GetThreadPool()->Acquire(
+        worker->attr_, [this, func = std::move(task->func_)]() {
+          func();
+          Done();
+        });
+  } else {
+    co = std::move(task->co_);
+  }
+  delete task;
+
+  co->Resume();
+  worker->executed_++;
+  Requeue(worker);
+  if (!is_func) {
+    // the coroutine task is finished once it yields, a requeued coroutine is
+    // counted as a new task
+    Done();
+  }
+  if (co->GetCoState() == Coroutine::CO_TERMINAL) {
+    CoroutinePool::GetThreadPool()->Release(co);
+  }
+}
+
+void IOManager::Requeue(Worker *worker) {
+  if (!t_requeue) {
+    return;
+  }
+  Task *task = new Task();
+  task->co_ = std::move(t_requeue);
+  t_requeue = nullptr;
+  active_cnt_++;
+  // put it into inbox instead of run queue, which is LIFO for owner, other
+  // tasks get the chance to run first
+  Mutex::ScopeLock lock(worker->inbox_mu_);
+  worker->inbox_.push_back(task);
+}
+
+void IOManager::Done() {
+  if (--active_cnt_ == 0 && stopping_) {
+    TickleAll();
+  }
+}
+
+void IOManager::Idle(Worker *worker) {
+  worker->idle_.store(true);
+  idle_cnt_++;
+  // pairs with the fence in Submit, either we see the task or the submitter
+  // sees us idle
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!HasTask(worker) && !Stopping()) {
+    worker->parked_++;
+    Sylar::Schedule::EventloopOnce(worker->epoll_, kIdleTimeout);
+    Requeue(worker);
+  }
+  idle_cnt_--;
+  worker->idle_.store(false);
+}
+
+void IOManager::Tickle(Worker *worker) {
+  uint64_t val = 1;
+  write_f(worker->event_fd_, &val, sizeof(val));
+}
+
+void IOManager::TickleIdle() {
+  for (auto &worker : workers_) {
+    if (worker->idle_.load()) {
+      Tickle(worker.get());
+      return;
+    }
+  }
+}
+
+void IOManager::TickleAll() {
+  for (auto &worker : workers_) {
+    Tickle(worker.get());
+  }
+}
+
+bool IOManager::Stopping() { return stopping_ && active_cnt_ == 0; }
+
+} // namespace Sylar
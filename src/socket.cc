@@ -37,8 +37,7 @@ Socket::Socket(int family, int type, int protocol)
     SetSockOpt(IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
   }
 
-  int flag = fcntl(socket_, F_GETFL);
-  fcntl(socket_, F_SETFL, flag | O_NONBLOCK);
+  FdManager::SetNonblock(socket_);
 
   if (socket_ == -1) {
     SYLAR_ERROR_LOG(SYLAR_LOG_ROOT)
@@ -73,6 +72,10 @@ bool Socket::SetSockOpt(int level, int option, void *result, socklen_t len) {
   return true;
 }
 
+bool Socket::SetBusyPoll(int usec) {
+  return SetSockOpt(SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+}
+
 bool Socket::Bind(const Address::ptr addr) {
   if (addr->GetFamily() != family_) {
     SYLAR_ERROR_LOG(SYLAR_LOG_ROOT) << "Socket::Bind error: family inconsist";
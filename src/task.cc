@@ -0,0 +1,81 @@
+#include "include/task.hh"
+#include "include/fdmanager.hh"
+#include "include/hook.hh"
+#include <cerrno>
+
+namespace Sylar {
+
+SleepAwaiter::~SleepAwaiter() {
+  // false if the timer has fired, the handle stays safe to use
+  if (epoll_) {
+    epoll_->CancelTimer(timer_);
+  }
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> h) {
+  h_ = h;
+  epoll_ = Epoll::GetThreadEpoll().get();
+  // the frame may be destroyed once resumed, don't touch this afterwards
+  timer_ = epoll_->AddTimer(ms_, [this]() { h_.resume(); });
+}
+
+EventAwaiter::~EventAwaiter() {
+  if (epoll_) {
+    epoll_->CancelEvent(type_, fd_);
+  }
+}
+
+void EventAwaiter::await_suspend(std::coroutine_handle<> h) {
+  h_ = h;
+  epoll_ = Epoll::GetThreadEpoll().get();
+  // unregister before resuming, the task may wait for fd again or close it.
+  // capturing this only keeps the callback inside std::function
+  auto func = [this]() {
+    auto handle = h_;
+    epoll_->CancelEvent(type_, fd_);
+    epoll_ = nullptr;
+    handle.resume();
+  };
+  if (type_ & Epoll::EventType::READ) {
+    epoll_->RegisterEvent(Epoll::EventType::READ, fd_, func, nullptr);
+  } else {
+    epoll_->RegisterEvent(Epoll::EventType::WRITE, fd_, nullptr, func);
+  }
+}
+
+Task<ssize_t> AsyncRead(int fd, void *buf, size_t count) {
+  FdManager::SetNonblock(fd);
+  while (true) {
+    // the original function, hooked one would suspend stackful coroutine
+    ssize_t n = read_f(fd, buf, count);
+    if (n >= 0) {
+      co_return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      co_return -1;
+    }
+    co_await Readable(fd);
+  }
+}
+
+Task<ssize_t> AsyncWrite(int fd, const void *buf, size_t count) {
+  FdManager::SetNonblock(fd);
+  while (true) {
+    ssize_t n = write_f(fd, buf, count);
+    if (n >= 0) {
+      co_return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      co_return -1;
+    }
+    co_await Writable(fd);
+  }
+}
+
+} // namespace Sylar
@@ -4,94 +4,313 @@
 namespace Sylar {
 
 TimeWheel::TimeWheel(size_t slots, size_t granularity)
-    : slots_(slots), granularity_(granularity),
-      last_trigger_(GetElapseFromRebootMS()), current_slot(0) {
-  wheel_.resize(slots_);
+    : slots_(2), bits_(1), current_(0), count_(0), next_tick_(kNoTimeout),
+      next_valid_(true), free_items_(nullptr), next_id_(0) {
+  SetGranularityUS(granularity * 1000);
+  while (slots_ < slots) {
+    slots_ <<= 1;
+    bits_++;
+  }
+  levels_ = (64 + bits_ - 1) / bits_;
+  wheel_ = std::vector<TimerLink>(levels_ * slots_);
+  words_ = (slots_ + 63) / 64;
+  occupied_.assign(levels_ * words_, 0);
+}
+
+void TimeWheel::SetGranularityUS(uint64_t granularity) {
+  granularity_ = std::max<uint64_t>(granularity, 1);
+  // ticks are aligned to the clock, so that a millisecond timestamp passed to
+  // ExecuteTimeout ends the tick of it
+  uint64_t now = GetElapseFromRebootUS();
+  start_ = now - now % granularity_;
+  current_ = 0;
+}
+
+TimeoutItem *TimeWheel::AllocItem() {
+  if (!free_items_) {
+    chunks_.emplace_back(new TimeoutItem[kItemChunkSize]);
+    auto chunk = chunks_.back().get();
+    for (size_t i = 0; i < kItemChunkSize; i++) {
+      chunk[i].next_ = free_items_;
+      free_items_ = &chunk[i];
+    }
+  }
+  TimeoutItem *item = free_items_;
+  free_items_ = static_cast<TimeoutItem *>(item->next_);
+  item->prev_ = item->next_ = item;
+  item->id_ = ++next_id_;
+  return item;
 }
 
-void TimeWheel::AddTimer(uint64_t timeout, std::function<void()> func,
-                         std::shared_ptr<Coroutine> co, int times) {
-  auto item = std::make_shared<TimeoutItem>();
-  item->remaining_ticks_ = (timeout / granularity_) / slots_;
+void TimeWheel::FreeItem(TimeoutItem *item) {
+  // release the captures of callback at once rather than on reuse
+  item->func_ = nullptr;
+  item->perform_co_ = nullptr;
+  item->group_ = nullptr;
+  item->pending_ = false;
+  item->id_ = 0;
+  item->next_ = free_items_;
+  free_items_ = item;
+  count_--;
+}
+
+void TimeWheel::Place(TimeoutItem *item) {
+  // the highest digit where expiry differs from the current tick. if none of
+  // them but the lowest differ, the item is in level 0
+  uint64_t diff = item->expire_ ^ current_;
+  int level = diff < slots_ ? 0 : (63 - __builtin_clzll(diff)) / bits_;
+  size_t idx = (item->expire_ >> (level * bits_)) & (slots_ - 1);
+  Slot(level, idx).PushBack(item);
+  item->slot_ = (level << bits_) + idx;
+  occupied_[level * words_ + idx / 64] |= 1ull << (idx % 64);
+}
+
+void TimeWheel::Unlink(TimeoutItem *item) {
+  item->Unlink();
+  // the slot may be taken by ExecuteTimeout already, then its bit is clear
+  if (wheel_[item->slot_].Empty()) {
+    size_t idx = item->slot_ & (slots_ - 1);
+    int level = item->slot_ >> bits_;
+    occupied_[level * words_ + idx / 64] &= ~(1ull << (idx % 64));
+  }
+}
+
+void TimeWheel::Cascade(int level, size_t idx) {
+  TimerLink &slot = Slot(level, idx);
+  while (!slot.Empty()) {
+    auto item = static_cast<TimeoutItem *>(slot.next_);
+    item->Unlink();
+    Place(item);
+  }
+  occupied_[level * words_ + idx / 64] &= ~(1ull << (idx % 64));
+}
+
+void TimeWheel::AdvanceTo(uint64_t tick) {
+  current_ = tick;
+  for (int level = 1; level < levels_; level++) {
+    if (tick & ((1ull << (level * bits_)) - 1)) {
+      break;
+    }
+    Cascade(level, (tick >> (level * bits_)) & (slots_ - 1));
+  }
+}
+
+int TimeWheel::FindSlot(int level, size_t from) const {
+  const uint64_t *words = &occupied_[level * words_];
+  size_t w = from / 64;
+  if (w >= words_) {
+    return -1;
+  }
+  uint64_t bits = words[w] & (~0ull << (from % 64));
+  while (true) {
+    if (bits) {
+      return (int)(w * 64 + __builtin_ctzll(bits));
+    }
+    if (++w == words_) {
+      return -1;
+    }
+    bits = words[w];
+  }
+}
+
+uint64_t TimeWheel::FindNextTick() {
+  // lower levels hold earlier timers, and so do lower slots of one level,
+  // since the slot of the current digit is cascaded already
+  for (int level = 0; level < levels_; level++) {
+    int shift = level * bits_;
+    int idx = FindSlot(level, (current_ >> shift) & (slots_ - 1));
+    if (idx < 0) {
+      continue;
+    }
+    if (level == 0) {
+      return (current_ & ~(uint64_t)(slots_ - 1)) + idx;
+    }
+    // timers in a slot of higher level expire at different ticks
+    uint64_t tick = kNoTimeout;
+    TimerLink &slot = Slot(level, idx);
+    for (auto link = slot.next_; link != &slot; link = link->next_) {
+      tick = std::min(tick, static_cast<TimeoutItem *>(link)->expire_);
+    }
+    return tick;
+  }
+  return kNoTimeout;
+}
+
+TimeoutItem *TimeWheel::NewItem(uint64_t timeout, uint64_t slack) {
+  // current_ lags behind if ExecuteTimeout isn't invoked for a while, count
+  // from now so that the timer doesn't fire early
+  uint64_t now = Clock::NowUS();
+  uint64_t tick = now > start_ ? (now - start_) / granularity_ : 0;
+  uint64_t slack_ticks = slack / granularity_;
+  auto item = AllocItem();
+  item->align_ = slack_ticks ? 1ull << (63 - __builtin_clzll(slack_ticks)) : 1;
+  uint64_t expire = std::max(tick, current_) + timeout / granularity_;
+  item->expire_ = AlignTick(expire, item->align_);
   item->repeat_interval_ = timeout;
+  item->pending_ = true;
+  count_++;
+  Place(item);
+  next_tick_ = std::min(next_tick_, item->expire_);
+  return item;
+}
+
+TimerHandle TimeWheel::AddTimerUS(uint64_t timeout, std::function<void()> func,
+                                  std::shared_ptr<Coroutine> co, int times,
+                                  uint64_t slack) {
+  auto item = NewItem(timeout, slack);
   item->repeat_count_ = times;
-  item->register_time_ = GetElapseFromRebootMS();
   item->func_.swap(func);
-  item->perform_co_ = co;
+  item->perform_co_ = std::move(co);
+  return TimerHandle(item, item->id_);
+}
 
-  auto slot = (current_slot + timeout / granularity_) % slots_;
-  wheel_[slot].emplace_back(item);
+TimerHandle TimeWheel::AddGroupTimerUS(uint64_t timeout, TimerGroup *group,
+                                       uint64_t data, uint64_t slack) {
+  auto item = NewItem(timeout, slack);
+  item->repeat_count_ = 1;
+  item->group_ = group;
+  item->data_ = data;
+  return TimerHandle(item, item->id_);
 }
 
-void TimeWheel::ExecuteTimeout(uint64_t now) {
-  if (now <= last_trigger_) {
+bool TimeWheel::CancelTimer(const TimerHandle &handle) {
+  TimeoutItem *item = handle.item_;
+  if (!item || item->id_ != handle.id_ || !item->pending_) {
+    return false;
+  }
+  item->pending_ = false;
+  // the executing item is recycled by ExecuteTimeout after callback returns
+  if (!item->firing_) {
+    if (item->expire_ == next_tick_) {
+      next_valid_ = false;
+    }
+    Unlink(item);
+    FreeItem(item);
+  }
+  return true;
+}
+
+void TimeWheel::ExecuteTimeoutUS(uint64_t now) {
+  if (now <= start_) {
     return;
   }
-  auto dis = (now - last_trigger_) / granularity_;
-  for (uint64_t i = 0; i < dis; i++) {
-    auto &list = wheel_[current_slot];
-    current_slot = (current_slot + 1) % slots_;
-    for (auto it = list.begin(); it != list.end();) {
-      auto &item = *it;
-      item->remaining_ticks_--;
-      if (item->remaining_ticks_ < 0) {
-        if (!item->perform_co_) {
-          item->func_();
-        } else {
-          item->perform_co_->Resume();
-        }
-        if (item->repeat_count_ > 0) {
-          item->repeat_count_--;
-        }
-        if (item->repeat_count_ == 0) {
-          it = list.erase(it);
-        } else {
-          item->remaining_ticks_ =
-              item->repeat_interval_ / granularity_ / slots_;
-          auto new_slot = (current_slot + item->remaining_ticks_) % slots_;
-          if (new_slot != current_slot) {
-            wheel_[new_slot].splice(wheel_[new_slot].end(), list, it);
-            it = list.begin();
-          } else {
-            it++;
-          }
+  uint64_t target = (now - start_) / granularity_;
+  TimerLink expired;
+  while (current_ < target) {
+    // skip to the next occupied slot of level 0 or the end of this round
+    uint64_t round = current_ & ~(uint64_t)(slots_ - 1);
+    int idx = FindSlot(0, current_ & (slots_ - 1));
+    uint64_t tick = idx < 0 ? round + slots_ : round + idx;
+    if (idx < 0 || tick >= target) {
+      AdvanceTo(std::min(tick, target));
+      continue;
+    }
+    // take all of them first, timers added by callbacks belong to later ticks
+    TimerLink &slot = Slot(0, idx);
+    expired.next_ = slot.next_;
+    expired.prev_ = slot.prev_;
+    expired.next_->prev_ = &expired;
+    expired.prev_->next_ = &expired;
+    slot.prev_ = slot.next_ = &slot;
+    occupied_[idx / 64] &= ~(1ull << (idx % 64));
+    AdvanceTo(tick + 1);
+    if (next_tick_ <= tick) {
+      next_valid_ = false;
+    }
+    // the callback may cancel other items in this batch, which unlinks them
+    while (!expired.Empty()) {
+      auto item = static_cast<TimeoutItem *>(expired.next_);
+      item->Unlink();
+      if (item->group_) {
+        // collected and recycled at once, the group is called after the slot
+        TimerGroup *group = item->group_;
+        group->expired_.push_back(item->data_);
+        if (!group->queued_) {
+          group->queued_ = true;
+          groups_.push_back(group);
         }
+        FreeItem(item);
+        continue;
+      }
+      item->firing_ = true;
+      if (!item->perform_co_) {
+        item->func_();
       } else {
-        it++;
+        item->perform_co_->Resume();
+      }
+      item->firing_ = false;
+      if (item->repeat_count_ > 0) {
+        item->repeat_count_--;
+      }
+      if (item->repeat_count_ == 0 || !item->pending_) {
+        FreeItem(item);
+      } else {
+        // triggered again after interval ticks, at least the next one
+        item->expire_ = AlignTick(
+            tick + std::max<uint64_t>(item->repeat_interval_ / granularity_, 1),
+            item->align_);
+        Place(item);
+        next_tick_ = std::min(next_tick_, item->expire_);
       }
     }
+    RunGroups();
   }
-  last_trigger_ = now;
 }
 
-uint64_t TimeWheel::GetNextTimeout(uint64_t now) {
-  if (now < last_trigger_) {
-    return 0;
+void TimeWheel::RunGroups() {
+  if (groups_.empty()) {
+    return;
   }
-  uint64_t dis = INT64_MAX;
-  for (int i = 0; i < wheel_.size(); i++) {
-    auto sidx = (current_slot + i) % slots_;
-    auto &list = wheel_[sidx];
-    if (!list.empty()) {
-      uint64_t trigger =
-          list.front()->repeat_interval_ - (now - list.front()->register_time_);
-      dis = std::min(dis, trigger);
+  // callbacks may add timers of groups, which expire in later ticks
+  std::vector<TimerGroup *> groups;
+  groups.swap(groups_);
+  std::vector<uint64_t> batch;
+  for (TimerGroup *group : groups) {
+    batch.swap(group->expired_);
+    group->queued_ = false;
+    group->callback_(batch);
+    batch.clear();
+    // keep the larger capacity for the next batch
+    if (group->expired_.empty()) {
+      batch.swap(group->expired_);
     }
   }
-  return dis == INT64_MAX ? 0 : dis;
+  groups.clear();
+  if (groups_.empty()) {
+    groups.swap(groups_);
+  }
+}
+
+uint64_t TimeWheel::GetNextTimeoutUS(uint64_t now) {
+  if (!next_valid_) {
+    next_tick_ = FindNextTick();
+    next_valid_ = true;
+  }
+  if (next_tick_ == kNoTimeout) {
+    return kNoTimeout;
+  }
+  // the tick is handled once now reaches its end
+  uint64_t due = start_ + (next_tick_ + 1) * granularity_;
+  return due > now ? due - now : 0;
 }
 
 std::string TimeWheel::Dump() {
   std::stringstream ss;
-  for (int i = 0; i < wheel_.size(); i++) {
-    ss << "[" << i << "]:" << std::endl;
-    for (auto it = wheel_[i].begin(); it != wheel_[i].end(); it++) {
-      auto &item = *it;
-      ss << "[remaining]: " << item->remaining_ticks_
-         << ", [repeat]: " << item->repeat_count_ << std::endl;
+  for (int level = 0; level < levels_; level++) {
+    for (size_t i = 0; i < slots_; i++) {
+      TimerLink &slot = Slot(level, i);
+      if (slot.Empty()) {
+        continue;
+      }
+      ss << "[" << level << ", " << i << "]:" << std::endl;
+      for (auto link = slot.next_; link != &slot; link = link->next_) {
+        auto item = static_cast<TimeoutItem *>(link);
+        ss << "[expire]: " << item->expire_
+           << ", [repeat]: " << item->repeat_count_ << std::endl;
+      }
     }
   }
   return ss.str();
 }
 
-} // namespace Sylar
\ No newline at end of file
+} // namespace Sylar
@@ -0,0 +1,526 @@
+#include "include/uring.hh"
+#include "include/coroutine.hh"
+#include "include/epoll.hh"
+#include "include/fdmanager.hh"
+#include "include/hook.hh"
+#include "include/util.hh"
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Sylar {
+
+std::atomic<bool> IoUring::s_enable_{false};
+
+// the size of submission queue of the ring of each thread
+static constexpr unsigned kThreadRingEntries = 256;
+
+// set in user_data of the link timeout of an operation, Op is 8 bytes aligned
+static constexpr uint64_t kTimeoutTag = 1;
+
+static int SysSetup(unsigned entries, io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int SysRegister(int fd, unsigned opcode, const void *arg,
+                       unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool Probe() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = SysSetup(4, &params);
+  if (fd < 0) {
+    // ENOSYS on old kernels, EPERM if it's disabled by sysctl or seccomp
+    return false;
+  }
+  // FAST_POLL makes kernel poll sockets internally instead of returning EAGAIN
+  bool ok = (params.features & IORING_FEAT_FAST_POLL) &&
+            (params.features & IORING_FEAT_NODROP);
+  const int kMaxOps = 256;
+  std::vector<char> mem(sizeof(io_uring_probe) +
+                        kMaxOps * sizeof(io_uring_probe_op));
+  auto probe = (io_uring_probe *)mem.data();
+  if (ok && SysRegister(fd, IORING_REGISTER_PROBE, probe, kMaxOps) < 0) {
+    ok = false;
+  }
+  const int used[] = {IORING_OP_RECV,         IORING_OP_SEND,
+                      IORING_OP_RECVMSG,      IORING_OP_SENDMSG,
+                      IORING_OP_ACCEPT,       IORING_OP_CONNECT,
+                      IORING_OP_TIMEOUT,      IORING_OP_LINK_TIMEOUT,
+                      IORING_OP_ASYNC_CANCEL, IORING_OP_READ_FIXED,
+                      IORING_OP_WRITE_FIXED};
+  for (int op : used) {
+    if (!ok) {
+      break;
+    }
+    ok = op <= probe->last_op &&
+         (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  close_f(fd);
+  return ok;
+}
+
+bool IoUring::IsSupported() {
+  static const bool supported = Probe();
+  return supported;
+}
+
+IoUring *IoUring::GetThreadRing() {
+  // the ring is owned by the epoll of current thread, and dies with it when
+  // the thread exits
+  static thread_local IoUring *t_ring = nullptr;
+  if (t_ring || !IsSupported()) {
+    return t_ring;
+  }
+  auto epoll = Epoll::GetThreadEpoll();
+  std::unique_ptr<IoUring> ring(new IoUring(kThreadRingEntries, epoll.get()));
+  if (!ring->Valid()) {
+    return nullptr;
+  }
+  int fd = ring->GetFd();
+  FdManager::Reset(fd, FdManager::FD_INIT | FdManager::FD_POLLABLE);
+  IoUring *raw = ring.get();
+  // the ring fd is readable as long as the completion queue isn't empty
+  int type =
+      Epoll::EventType::READ | static_cast<int>(Epoll::EventFlag::LEVEL);
+  epoll->RegisterEvent(type, fd, [raw]() { raw->Reap(); }, nullptr);
+  epoll->uring_ = std::move(ring);
+  t_ring = raw;
+  return t_ring;
+}
+
+IoUring::IoUring(unsigned entries, Epoll *epoll)
+    : fd_(-1), epoll_(epoll), sq_head_(nullptr), sq_tail_(nullptr),
+      sq_mask_(nullptr), sq_flags_(nullptr), sq_array_(nullptr),
+      sqes_(nullptr), sq_entries_(0), sq_local_tail_(0), sq_submitted_(0),
+      cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(nullptr), cqes_(nullptr),
+      ring_ptr_(MAP_FAILED), ring_size_(0), cq_ptr_(nullptr), cq_size_(0),
+      sqes_size_(0), buffers_(nullptr), buffer_size_(0), buffer_cnt_(0),
+      inflight_(0), stats_{0, 0, 0} {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = SysSetup(entries, &params);
+  if (fd < 0) {
+    return;
+  }
+  ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    ring_size_ = std::max(ring_size_, cq_size_);
+  }
+  ring_ptr_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  void *cq = ring_ptr_;
+  if (ring_ptr_ != MAP_FAILED && !single) {
+    cq = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    cq_ptr_ = cq == MAP_FAILED ? nullptr : cq;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = MAP_FAILED;
+  if (ring_ptr_ != MAP_FAILED && cq != MAP_FAILED) {
+    sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  }
+  if (sqes == MAP_FAILED) {
+    if (cq_ptr_) {
+      munmap(cq_ptr_, cq_size_);
+      cq_ptr_ = nullptr;
+    }
+    if (ring_ptr_ != MAP_FAILED) {
+      munmap(ring_ptr_, ring_size_);
+    }
+    close_f(fd);
+    return;
+  }
+  char *sq_base = (char *)ring_ptr_;
+  sq_head_ = (unsigned *)(sq_base + params.sq_off.head);
+  sq_tail_ = (unsigned *)(sq_base + params.sq_off.tail);
+  sq_mask_ = (unsigned *)(sq_base + params.sq_off.ring_mask);
+  sq_flags_ = (unsigned *)(sq_base + params.sq_off.flags);
+  sq_array_ = (unsigned *)(sq_base + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  sqes_ = (io_uring_sqe *)sqes;
+  char *cq_base = (char *)cq;
+  cq_head_ = (unsigned *)(cq_base + params.cq_off.head);
+  cq_tail_ = (unsigned *)(cq_base + params.cq_off.tail);
+  cq_mask_ = (unsigned *)(cq_base + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe *)(cq_base + params.cq_off.cqes);
+  // sqes are used in order, so the indirection array is filled only once
+  for (unsigned i = 0; i < sq_entries_; i++) {
+    sq_array_[i] = i;
+  }
+  sq_local_tail_ = sq_submitted_ = *sq_tail_;
+  fd_ = fd;
+}
+
+IoUring::~IoUring() {
+  if (fd_ < 0) {
+    return;
+  }
+  // operations in flight are dropped with the ring, their coroutines are never
+  // resumed, just like waiting for events of a destructed epoll
+  if (buffers_) {
+    munmap(buffers_, buffer_cnt_ * buffer_size_);
+  }
+  munmap(sqes_, sqes_size_);
+  if (cq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  munmap(ring_ptr_, ring_size_);
+  FdManager::Remove(fd_);
+  close_f(fd_);
+}
+
+int IoUring::Enter(unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  stats_.enter_++;
+  int ret = syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags,
+                    nullptr, 0);
+  return ret < 0 ? -errno : ret;
+}
+
+io_uring_sqe *IoUring::GetSqe(unsigned n) {
+  if (fd_ < 0) {
+    return nullptr;
+  }
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_local_tail_ + n - head > sq_entries_) {
+    Submit();
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sq_local_tail_ + n - head > sq_entries_) {
+      return nullptr;
+    }
+  }
+  io_uring_sqe *sqe = &sqes_[sq_local_tail_ & *sq_mask_];
+  sq_local_tail_++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int IoUring::Submit() {
+  unsigned cnt = sq_local_tail_ - sq_submitted_;
+  if (cnt == 0) {
+    return 0;
+  }
+  __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+  int ret = Enter(cnt, 0, 0);
+  if (ret > 0) {
+    // sqes not consumed, e.g. by EBUSY, are submitted next time
+    sq_submitted_ += ret;
+    stats_.submit_ += ret;
+  }
+  return ret;
+}
+
+int IoUring::Reap() {
+  int cnt = 0;
+  while (true) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // with NODROP, cqes overflowed are kept by kernel until entering it
+      if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+          IORING_SQ_CQ_OVERFLOW) {
+        Enter(0, 0, IORING_ENTER_GETEVENTS);
+        if (__atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) != head) {
+          continue;
+        }
+      }
+      break;
+    }
+    // release the slot before handling it, the waiter may submit and reap
+    // again when it's resumed
+    io_uring_cqe cqe = cqes_[head & *cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    cnt++;
+    stats_.complete_++;
+    if (cqe.user_data == 0) {
+      continue;
+    }
+    Op *op = (Op *)(cqe.user_data & ~kTimeoutTag);
+    if (cqe.user_data & kTimeoutTag) {
+      op->timed_out_ = cqe.res == -ETIME;
+    } else {
+      op->res_ = cqe.res;
+    }
+    if (--op->pending_ == 0) {
+      inflight_--;
+      if (op->co_) {
+        // op is released once the waiter is resumed
+        std::shared_ptr<Coroutine> co = op->co_;
+        if (co->Wake(op->seq_, Coroutine::WAKE_EVENT)) {
+          co->Resume();
+        }
+      }
+    }
+  }
+  return cnt;
+}
+
+void IoUring::CancelFd(int fd) {
+  if (inflight_ == 0) {
+    return;
+  }
+  io_uring_sqe *sqe = GetSqe();
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  Submit();
+}
+
+int IoUring::CheckCurrent() {
+  if (Schedule::GetInvokeDeepth() < 2) {
+    return 0;
+  }
+  auto co = Schedule::GetCurrentCo();
+  if (co->IsCancelled()) {
+    return ECANCELED;
+  }
+  uint64_t deadline = co->GetDeadline();
+  if (deadline != 0 && Clock::NowMS() >= deadline) {
+    return ETIMEDOUT;
+  }
+  return 0;
+}
+
+int IoUring::Wait(io_uring_sqe *sqe) {
+  Op op;
+  op.seq_ = 0;
+  op.res_ = 0;
+  op.pending_ = 1;
+  op.timed_out_ = false;
+  sqe->user_data = (uint64_t)&op;
+  inflight_++;
+
+  if (Schedule::GetInvokeDeepth() < 2) {
+    // main coroutine cannot be suspended, wait in kernel. completions of
+    // others reaped meanwhile resume their coroutines
+    while (op.pending_ > 0) {
+      unsigned cnt = sq_local_tail_ - sq_submitted_;
+      __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+      int ret = Enter(cnt, 1, IORING_ENTER_GETEVENTS);
+      if (ret > 0) {
+        sq_submitted_ += ret;
+        stats_.submit_ += ret;
+      } else if (ret < 0 && ret != -EINTR && ret != -EAGAIN &&
+                 ret != -EBUSY) {
+        // the ring is broken, op may still be referenced by kernel
+        return ret;
+      }
+      Reap();
+    }
+    return op.res_;
+  }
+
+  auto co = Schedule::GetCurrentCo();
+  op.co_ = co;
+  uint64_t deadline = co->GetDeadline();
+  if (deadline != 0) {
+    // kernel cancels the operation when the linked timeout fires. the sqe is
+    // reserved by Execute, so GetSqe doesn't submit the linked one alone
+    uint64_t now = Clock::NowMS();
+    uint64_t left = deadline > now ? deadline - now : 0;
+    op.ts_.tv_sec = left / 1000;
+    op.ts_.tv_nsec = (left % 1000) * 1000000;
+    io_uring_sqe *timeout = GetSqe();
+    sqe->flags |= IOSQE_IO_LINK;
+    timeout->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout->fd = -1;
+    timeout->addr = (uint64_t)&op.ts_;
+    timeout->len = 1;
+    timeout->user_data = (uint64_t)&op | kTimeoutTag;
+    op.pending_++;
+  }
+
+  bool cancelling = false;
+  while (op.pending_ > 0) {
+    op.seq_ = co->Park(epoll_);
+    // Cancel invoked before parking cannot see the parking, check it again
+    bool woken = !cancelling && co->IsCancelled() &&
+                 co->Wake(op.seq_, Coroutine::WAKE_CANCEL);
+    if (!woken) {
+      Schedule::Yield();
+    }
+    auto reason = co->Unpark();
+    if (reason == Coroutine::WAKE_CANCEL && !cancelling && op.pending_ > 0) {
+      // kernel still owns the buffers, wait until it gives up the operation
+      io_uring_sqe *cancel = GetSqe();
+      if (cancel) {
+        cancel->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel->fd = -1;
+        cancel->addr = (uint64_t)&op;
+      }
+      cancelling = true;
+    }
+  }
+  if (op.res_ == -ECANCELED && op.timed_out_) {
+    return -ETIMEDOUT;
+  }
+  return op.res_;
+}
+
+// convert the res of cqe to the return value of syscall
+static ssize_t ToSyscall(int res) {
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+ssize_t IoUring::Recv(int fd, void *buf, size_t len, int flags) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+  }));
+}
+
+ssize_t IoUring::Send(int fd, const void *buf, size_t len, int flags) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+  }));
+}
+
+ssize_t IoUring::RecvMsg(int fd, struct msghdr *msg, int flags) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+  }));
+}
+
+ssize_t IoUring::SendMsg(int fd, const struct msghdr *msg, int flags) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+  }));
+}
+
+int IoUring::Accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+                    int flags) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)addr;
+    sqe->addr2 = (uint64_t)addrlen;
+    sqe->accept_flags = flags;
+  }));
+}
+
+int IoUring::Connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)addr;
+    sqe->off = addrlen;
+  }));
+}
+
+int IoUring::Sleep(uint64_t ms) {
+  __kernel_timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  int res = Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)&ts;
+    sqe->len = 1;
+  });
+  // a timeout completes with ETIME when it expires
+  return ToSyscall(res == -ETIME ? 0 : res);
+}
+
+bool IoUring::RegisterBuffers(size_t count, size_t size) {
+  if (fd_ < 0 || count == 0 || size == 0) {
+    return false;
+  }
+  UnregisterBuffers();
+  void *mem = mmap(nullptr, count * size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+  std::vector<iovec> iovs(count);
+  for (size_t i = 0; i < count; i++) {
+    iovs[i].iov_base = (char *)mem + i * size;
+    iovs[i].iov_len = size;
+  }
+  if (SysRegister(fd_, IORING_REGISTER_BUFFERS, iovs.data(), count) < 0) {
+    munmap(mem, count * size);
+    return false;
+  }
+  buffers_ = (char *)mem;
+  buffer_size_ = size;
+  buffer_cnt_ = count;
+  free_buffers_.clear();
+  for (size_t i = count; i > 0; i--) {
+    free_buffers_.push_back(i - 1);
+  }
+  return true;
+}
+
+void IoUring::UnregisterBuffers() {
+  if (!buffers_) {
+    return;
+  }
+  SysRegister(fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+  munmap(buffers_, buffer_cnt_ * buffer_size_);
+  buffers_ = nullptr;
+  buffer_size_ = buffer_cnt_ = 0;
+  free_buffers_.clear();
+}
+
+int IoUring::AcquireBuffer() {
+  if (free_buffers_.empty()) {
+    return -1;
+  }
+  int idx = free_buffers_.back();
+  free_buffers_.pop_back();
+  return idx;
+}
+
+void IoUring::ReleaseBuffer(int idx) { free_buffers_.push_back(idx); }
+
+ssize_t IoUring::ReadFixed(int fd, int idx, size_t len, off_t offset) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)GetBuffer(idx);
+    sqe->len = len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = idx;
+  }));
+}
+
+ssize_t IoUring::WriteFixed(int fd, int idx, size_t len, off_t offset) {
+  return ToSyscall(Execute([&](io_uring_sqe *sqe) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)GetBuffer(idx);
+    sqe->len = len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = idx;
+  }));
+}
+
+} // namespace Sylar
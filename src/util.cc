@@ -1,12 +1,31 @@
 #include "include/util.hh"
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <mutex>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 namespace Sylar {
 
 // return process id
 pid_t GetProcessId() { return syscall(SYS_getpid); }
 
+static thread_local pid_t t_thread_id = 0;
+
+// the child of fork runs in a copy of the forking thread, which has another id
+static int s_atfork =
+    pthread_atfork(nullptr, nullptr, []() { t_thread_id = 0; });
+
 // return thread id
-pid_t GetThreadId() { return syscall(SYS_gettid); }
+pid_t GetThreadId() {
+  if (t_thread_id == 0) {
+    t_thread_id = syscall(SYS_gettid);
+  }
+  return t_thread_id;
+}
 
 /**
  * @brief used to get backtrace information
@@ -52,8 +71,151 @@ uint64_t GetElapseFromRebootMS() {
    * running since it was booted.
    */
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+uint64_t GetElapseFromRebootUS() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+uint64_t GetElapseFromRebootNS() {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the start point of calibrating ReadCycles
+static const uint64_t s_calibrate_cycles = ReadCycles();
+static const uint64_t s_calibrate_ns = GetElapseFromRebootNS();
+
+uint64_t CyclesToNS(uint64_t cycles) {
+  uint64_t elapse_cycles = ReadCycles() - s_calibrate_cycles;
+  uint64_t elapse_ns = GetElapseFromRebootNS() - s_calibrate_ns;
+  if (elapse_cycles == 0 || elapse_ns == 0) {
+    return cycles;
+  }
+  return (uint64_t)((double)cycles * elapse_ns / elapse_cycles);
+}
+
+namespace {
+
+struct ThreadClock {
+  uint64_t cached_us_ = 0;
+  bool cached_ = false;
+  time_t wall_ = 0;
+  bool wall_valid_ = false;
+  // the point where the cycle counter was read with monotonic clock
+  uint64_t anchor_cycles_ = 0;
+  uint64_t anchor_ns_ = 0;
+  // re-anchoring may step back a little, the clock never does
+  uint64_t last_us_ = 0;
+};
+
+} // namespace
+
+static thread_local ThreadClock t_clock;
+
+static std::atomic<bool> s_tsc_enable{false};
+static std::once_flag s_tsc_once;
+static bool s_tsc_valid = false;
+// nanoseconds per cycle in 32.32 fixed point
+static uint64_t s_tsc_mult = 0;
+// cycles of a second, after which a thread re-anchors
+static uint64_t s_tsc_period = 0;
+
+static bool IsTscInvariant() {
+#if defined(__x86_64__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return edx & (1u << 8);
+#elif defined(__aarch64__)
+  // the generic timer ticks at a fixed frequency
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void CalibrateTsc() {
+  if (!IsTscInvariant()) {
+    return;
+  }
+  uint64_t st_cycles = ReadCycles();
+  uint64_t st_ns = GetElapseFromRebootNS();
+  uint64_t ns;
+  do {
+    ns = GetElapseFromRebootNS();
+  } while (ns - st_ns < 10 * 1000 * 1000);
+  uint64_t cycles = ReadCycles() - st_cycles;
+  if (cycles == 0) {
+    return;
+  }
+  s_tsc_mult = (uint64_t)((double)(ns - st_ns) / cycles * (1ull << 32));
+  s_tsc_period = cycles * 100;
+  s_tsc_valid = s_tsc_mult != 0;
+}
+
+// read the clock without caching
+static uint64_t ReadClockUS() {
+  if (!s_tsc_enable.load(std::memory_order_relaxed)) {
+    return GetElapseFromRebootUS();
+  }
+  auto &clock = t_clock;
+  uint64_t delta = ReadCycles() - clock.anchor_cycles_;
+  // the counters of cpus may differ a little, then delta wraps around
+  if (clock.anchor_ns_ == 0 || delta >= s_tsc_period) {
+    clock.anchor_ns_ = GetElapseFromRebootNS();
+    clock.anchor_cycles_ = ReadCycles();
+    delta = 0;
+  }
+  uint64_t us = (clock.anchor_ns_ + (delta * s_tsc_mult >> 32)) / 1000;
+  clock.last_us_ = std::max(clock.last_us_, us);
+  return clock.last_us_;
+}
+
+uint64_t Clock::NowUS() {
+  auto &clock = t_clock;
+  return clock.cached_ ? clock.cached_us_ : ReadClockUS();
+}
+
+time_t Clock::WallTime() {
+  auto &clock = t_clock;
+  if (!clock.cached_) {
+    return std::time(nullptr);
+  }
+  if (!clock.wall_valid_) {
+    clock.wall_ = std::time(nullptr);
+    clock.wall_valid_ = true;
+  }
+  return clock.wall_;
+}
+
+uint64_t Clock::Refresh() {
+  auto &clock = t_clock;
+  clock.cached_us_ = ReadClockUS();
+  clock.cached_ = true;
+  clock.wall_valid_ = false;
+  return clock.cached_us_;
+}
+
+void Clock::Release() { t_clock.cached_ = false; }
+
+bool Clock::SetTscEnable(bool val) {
+  if (val) {
+    std::call_once(s_tsc_once, CalibrateTsc);
+    if (!s_tsc_valid) {
+      return false;
+    }
+  }
+  s_tsc_enable.store(val);
+  return true;
+}
+
+bool Clock::IsTscEnabled() { return s_tsc_enable.load(); }
+
 } // namespace Sylar
\ No newline at end of file
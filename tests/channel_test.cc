@@ -0,0 +1,233 @@
+#include "../src/include/channel.hh"
+#include "../src/include/iomanager.hh"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// run event loop of current thread until all coroutines terminate
+void RunUntilDone(const std::vector<Sylar::Coroutine::ptr> &cos) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  while (true) {
+    bool done = true;
+    for (auto &co : cos) {
+      if (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+        done = false;
+      }
+    }
+    if (done) {
+      break;
+    }
+    Sylar::Schedule::EventloopOnce(epoll, 10);
+  }
+}
+
+Sylar::Coroutine::ptr Go(std::function<void()> func) {
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(),
+      std::make_shared<Sylar::CoroutineAttr>(), std::move(func));
+  co->Resume();
+  return co;
+}
+
+TEST(Channel, Buffered) {
+  Sylar::Channel<int> ch(2);
+  std::vector<int> recv;
+  std::vector<Sylar::Coroutine::ptr> cos;
+  cos.push_back(Go([&]() {
+    for (int i = 0; i < 10; i++) {
+      EXPECT_TRUE(ch.Send(i));
+      EXPECT_LE(ch.Size(), 2);
+    }
+    ch.Close();
+  }));
+  // producer is suspended when the channel is full
+  EXPECT_EQ(ch.Size(), 2);
+  cos.push_back(Go([&]() {
+    int val;
+    while (ch.Recv(val)) {
+      recv.push_back(val);
+    }
+  }));
+  RunUntilDone(cos);
+  ASSERT_EQ(recv.size(), 10);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(recv[i], i);
+  }
+}
+
+TEST(Channel, UnboundedMoveOnly) {
+  Sylar::Channel<std::unique_ptr<std::string>> ch;
+  EXPECT_EQ(ch.Capacity(), Sylar::Channel<int>::kUnbounded);
+  for (int i = 0; i < 1000; i++) {
+    auto p = std::make_unique<std::string>(std::to_string(i));
+    EXPECT_TRUE(ch.TrySend(std::move(p)));
+    EXPECT_EQ(p, nullptr);
+  }
+  EXPECT_EQ(ch.Size(), 1000);
+  std::unique_ptr<std::string> out;
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_TRUE(ch.TryRecv(out));
+    EXPECT_EQ(*out, std::to_string(i));
+  }
+  EXPECT_FALSE(ch.TryRecv(out));
+}
+
+TEST(Channel, Close) {
+  Sylar::Channel<int> ch(4);
+  EXPECT_TRUE(ch.Send(1));
+  EXPECT_TRUE(ch.Send(2));
+  ch.Close();
+  EXPECT_TRUE(ch.IsClosed());
+  EXPECT_FALSE(ch.Send(3));
+  int val = 0;
+  // buffered values are still received after closing
+  EXPECT_TRUE(ch.Recv(val));
+  EXPECT_EQ(val, 1);
+  EXPECT_TRUE(ch.Recv(val));
+  EXPECT_EQ(val, 2);
+  EXPECT_FALSE(ch.Recv(val));
+
+  // blocked receivers are woken up by Close
+  Sylar::Channel<int> ch2(0);
+  bool ret = true;
+  std::vector<Sylar::Coroutine::ptr> cos;
+  cos.push_back(Go([&]() { ret = ch2.Recv(val); }));
+  EXPECT_EQ(cos[0]->GetCoState(), Sylar::Coroutine::CO_READY);
+  ch2.Close();
+  RunUntilDone(cos);
+  EXPECT_FALSE(ret);
+}
+
+TEST(Channel, RendezvousAcrossThreads) {
+  // capacity 0, every value is handed off from sender to receiver directly
+  Sylar::Channel<int> ch(0);
+  Sylar::WaitGroup wg;
+  Sylar::IOManager iom(4, "channel");
+  iom.Start();
+  const int P = 4, N = 1000;
+  wg.Add(P);
+  for (int p = 0; p < P; p++) {
+    iom.Schedule([&, p]() {
+      for (int i = 1; i <= N; i++) {
+        EXPECT_TRUE(ch.Send(i));
+      }
+      wg.Done();
+    });
+  }
+  std::thread closer([&]() {
+    wg.Wait();
+    ch.Close();
+  });
+  // main coroutine blocks the thread
+  int64_t sum = 0;
+  int val;
+  while (ch.Recv(val)) {
+    sum += val;
+  }
+  closer.join();
+  iom.Stop();
+  EXPECT_EQ(sum, (int64_t)P * N * (N + 1) / 2);
+}
+
+TEST(Channel, MPMC) {
+  Sylar::Channel<int> ch(16);
+  Sylar::WaitGroup producers, consumers;
+  std::atomic<int64_t> sum(0);
+  Sylar::IOManager iom(4, "mpmc");
+  iom.Start();
+  const int P = 4, C = 4, N = 5000;
+  producers.Add(P);
+  consumers.Add(C);
+  for (int c = 0; c < C; c++) {
+    iom.Schedule([&]() {
+      int val;
+      while (ch.Recv(val)) {
+        sum += val;
+      }
+      consumers.Done();
+    });
+  }
+  for (int p = 0; p < P; p++) {
+    iom.Schedule([&]() {
+      for (int i = 1; i <= N; i++) {
+        ch.Send(i);
+      }
+      producers.Done();
+    });
+  }
+  producers.Wait();
+  ch.Close();
+  consumers.Wait();
+  iom.Stop();
+  EXPECT_EQ(sum.load(), (int64_t)P * N * (N + 1) / 2);
+}
+
+TEST(Channel, Select) {
+  Sylar::Channel<int> ch1(1), ch2(1);
+  int v1 = 0, v2 = 0;
+  Sylar::Selector sel;
+  sel.AddRecv(ch1, v1);
+  sel.AddRecv(ch2, v2);
+
+  // nothing is ready, polling returns immediately
+  EXPECT_EQ(sel.Select(0), -1);
+  ch2.Send(7);
+  EXPECT_EQ(sel.Select(0), 1);
+  EXPECT_EQ(v2, 7);
+
+  std::vector<int> fired;
+  std::vector<Sylar::Coroutine::ptr> cos;
+  cos.push_back(Go([&]() {
+    for (int i = 0; i < 2; i++) {
+      fired.push_back(sel.Select());
+    }
+  }));
+  EXPECT_TRUE(fired.empty());
+  ch1.Send(1);
+  ch2.Send(2);
+  RunUntilDone(cos);
+  std::sort(fired.begin(), fired.end());
+  EXPECT_EQ(fired, std::vector<int>({0, 1}));
+  EXPECT_EQ(v1, 1);
+  EXPECT_EQ(v2, 2);
+  // waiters of the case not fired are removed
+  EXPECT_EQ(ch1.Size(), 0);
+  EXPECT_TRUE(ch1.TrySend(3));
+  EXPECT_EQ(ch1.Size(), 1);
+}
+
+TEST(Channel, SelectTimeoutAndSend) {
+  Sylar::Channel<int> in(0), out(1);
+  int val = 0, send = 42;
+  bool ok = false;
+  std::vector<int> fired;
+  int64_t elapse = 0;
+  std::vector<Sylar::Coroutine::ptr> cos;
+  cos.push_back(Go([&]() {
+    Sylar::Selector sel;
+    sel.AddRecv(in, val);
+    sel.AddSend(out, send, &ok);
+    // out has room, the send case fires immediately
+    fired.push_back(sel.Select(50));
+    EXPECT_TRUE(ok);
+    // out is full and nobody sends to in
+    auto st = std::chrono::steady_clock::now();
+    fired.push_back(sel.Select(50));
+    elapse = std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::steady_clock::now() - st)
+                 .count();
+  }));
+  RunUntilDone(cos);
+  EXPECT_EQ(fired, std::vector<int>({1, -1}));
+  EXPECT_FALSE(ok);
+  EXPECT_GE(elapse, 40);
+  int got = 0;
+  EXPECT_TRUE(out.TryRecv(got));
+  EXPECT_EQ(got, 42);
+}
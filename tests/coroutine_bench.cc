@@ -0,0 +1,287 @@
+#include "../src/include/coroutine.hh"
+#include "../src/include/introspect.hh"
+#include "../src/include/task.hh"
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <memory>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// micro benchmark of coroutine switch latency, usage:
+//  ./coroutine_bench [iterations] [coroutines...]
+//
+// each iteration is a Resume/Yield pair, which is two context switches. then
+// measure a three-stage pipeline switching by SwitchTo. after that, compare
+// memory usage and switch cost of independent stack and shared stack with the
+// given number of coroutines(10k, 100k and 1M by default), and stackless
+// tasks with the same number
+
+static uint64_t g_iterations = 1e7;
+
+// count user space instructions retired by current thread through
+// perf_event_open, which may be forbidden by kernel.perf_event_paranoid or in
+// container. in this scenario, Valid() returns false
+class InstCounter {
+public:
+  InstCounter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~InstCounter() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+  bool Valid() const { return fd_ >= 0; }
+  void Start() {
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  uint64_t Stop() {
+    uint64_t cnt = 0;
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+        cnt = 0;
+      }
+    }
+    return cnt;
+  }
+
+private:
+  int fd_;
+};
+
+// print the instructions per switch, if the counter is available
+void PrintInst(const InstCounter &counter, uint64_t inst, uint64_t switches) {
+  if (counter.Valid()) {
+    std::cout << ", instructions per switch: " << (double)inst / switches;
+  }
+  std::cout << std::endl;
+}
+
+void Loop() {
+  while (true) {
+    Sylar::Schedule::Yield();
+  }
+}
+
+double NowNS() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void BenchSwitch(const std::string &name,
+                 std::shared_ptr<Sylar::CoroutineAttr> attr) {
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(&Loop));
+  // warm up
+  for (int i = 0; i < 1000; i++) {
+    co->Resume();
+  }
+  InstCounter counter;
+  double st = NowNS();
+  counter.Start();
+  for (uint64_t i = 0; i < g_iterations; i++) {
+    co->Resume();
+  }
+  uint64_t inst = counter.Stop();
+  double ed = NowNS();
+  double pair = (ed - st) / g_iterations;
+  std::cout << "[" << name << "] iterations: " << g_iterations
+            << ", resume/yield pair: " << pair << " ns"
+            << ", per switch: " << pair / 2 << " ns";
+  PrintInst(counter, inst, g_iterations * 2);
+}
+
+// three-stage pipeline handing off control by SwitchTo, each round is three
+// context switches without touching the execute stack
+void BenchPipeline(std::shared_ptr<Sylar::CoroutineAttr> attr) {
+  Sylar::Coroutine::ptr stages[3];
+  uint64_t rounds = 0;
+  for (int i = 0; i < 3; i++) {
+    stages[i] = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [&stages, &rounds, i]() {
+          while (true) {
+            if (i == 2 && ++rounds >= g_iterations) {
+              Sylar::Schedule::Yield();
+            }
+            stages[(i + 1) % 3]->SwitchTo();
+          }
+        });
+  }
+  InstCounter counter;
+  double st = NowNS();
+  counter.Start();
+  stages[0]->Resume();
+  uint64_t inst = counter.Stop();
+  double ed = NowNS();
+  std::cout << "[pipeline] rounds: " << rounds
+            << ", per round: " << (ed - st) / rounds << " ns"
+            << ", per switch: " << (ed - st) / rounds / 3 << " ns";
+  PrintInst(counter, inst, rounds * 3);
+}
+
+// current resident set size in bytes
+uint64_t GetRSS() {
+  uint64_t vm = 0, rss = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp) {
+    if (fscanf(fp, "%lu %lu", &vm, &rss) != 2) {
+      rss = 0;
+    }
+    fclose(fp);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+void BenchScale(const std::string &name, size_t cnt,
+                std::shared_ptr<Sylar::CoroutineAttr> attr) {
+  // each independent stack commits at least one page, skip if the machine
+  // cannot afford it
+  struct sysinfo info;
+  sysinfo(&info);
+  if (!attr->shared_mem_ &&
+      cnt * (sysconf(_SC_PAGESIZE) + 512) > info.freeram / 10 * 7) {
+    std::cout << "[" << name << "] coroutines: " << cnt
+              << ", skipped, not enough memory" << std::endl;
+    return;
+  }
+
+  uint64_t mem_st = GetRSS();
+  std::vector<std::shared_ptr<Sylar::Coroutine>> cvec;
+  cvec.reserve(cnt);
+  for (size_t i = 0; i < cnt; i++) {
+    cvec.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, std::bind(&Loop)));
+  }
+  // every coroutine has run and been suspended, its stack has been touched
+  for (size_t i = 0; i < cnt; i++) {
+    cvec[i]->Resume();
+  }
+  uint64_t mem_ed = GetRSS();
+
+  double st = NowNS();
+  for (size_t i = 0; i < cnt; i++) {
+    cvec[i]->Resume();
+  }
+  double ed = NowNS();
+
+  std::cout << "[" << name << "] coroutines: " << cnt
+            << ", memory: " << (mem_ed - mem_st) / 1024.0 / 1024.0 << " MB ("
+            << (double)(mem_ed - mem_st) / cnt << " bytes per coroutine)"
+            << ", resume/yield pair: " << (ed - st) / cnt << " ns"
+            << std::endl;
+}
+
+// an idle task suspended until being resumed by hand, which is how a task
+// waiting for a quiet connection looks like
+struct Park {
+  bool await_ready() noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) { parked_->push_back(h); }
+  void await_resume() noexcept {}
+
+  std::vector<std::coroutine_handle<>> *parked_;
+};
+
+Sylar::Task<> ParkedTask(std::vector<std::coroutine_handle<>> *parked) {
+  while (true) {
+    co_await Park{parked};
+  }
+}
+
+void BenchTask(size_t cnt) {
+  std::vector<std::coroutine_handle<>> parked;
+  parked.reserve(cnt);
+
+  // frames live in heap, which may reuse the memory freed by former
+  // benchmarks, so count allocated bytes instead of RSS
+  uint64_t mem_st = mallinfo2().uordblks;
+  for (size_t i = 0; i < cnt; i++) {
+    Sylar::Spawn(ParkedTask(&parked));
+  }
+  uint64_t mem_ed = mallinfo2().uordblks;
+
+  std::vector<std::coroutine_handle<>> handles;
+  handles.swap(parked);
+  double st = NowNS();
+  for (auto h : handles) {
+    h.resume();
+  }
+  double ed = NowNS();
+
+  // the tasks never finish, don't bother freeing them
+  std::cout << "[stackless task] tasks: " << cnt
+            << ", memory: " << (mem_ed - mem_st) / 1024.0 / 1024.0 << " MB ("
+            << (double)(mem_ed - mem_st) / cnt << " bytes per task)"
+            << ", resume/suspend pair: " << (ed - st) / cnt << " ns"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    g_iterations = std::stoull(argv[1]);
+  }
+  std::vector<size_t> counts;
+  for (int i = 2; i < argc; i++) {
+    counts.push_back(std::stoull(argv[i]));
+  }
+  if (counts.empty()) {
+    counts = {10000, 100000, 1000000};
+  }
+  // libstdc++ uses non-atomic refcount of shared_ptr until the first thread
+  // is created, which is not the case of real server
+  std::thread([]() {}).join();
+#ifdef SYLAR_COCTX_UCONTEXT
+  std::cout << "context backend: ucontext" << std::endl;
+#else
+  std::cout << "context backend: assembly" << std::endl;
+#endif
+
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  BenchSwitch("private stack", attr);
+  // the cost of reading cycle counter for CoroutineRegistry on every switch
+  Sylar::CoroutineRegistry::SetTiming(false);
+  BenchSwitch("private stack, no timing", attr);
+  Sylar::CoroutineRegistry::SetTiming(true);
+
+  auto shared_attr = std::make_shared<Sylar::CoroutineAttr>();
+  shared_attr->shared_mem_ = Sylar::SharedMem::AllocSharedMem(1, 64 * 1024);
+  BenchSwitch("shared stack", shared_attr);
+
+  BenchPipeline(attr);
+
+  for (auto cnt : counts) {
+    auto private_attr = std::make_shared<Sylar::CoroutineAttr>();
+    BenchScale("private stack", cnt, private_attr);
+
+    // every coroutine is evicted from the shared stack when resuming them in
+    // turn, which is the worst case of shared stack
+    auto scale_attr = std::make_shared<Sylar::CoroutineAttr>();
+    scale_attr->shared_mem_ = Sylar::SharedMem::AllocSharedMem(64, 64 * 1024);
+    BenchScale("shared stack", cnt, scale_attr);
+
+    BenchTask(cnt);
+  }
+
+  return 0;
+}
@@ -266,4 +266,487 @@ TEST(Coroutine, MultiThread) {
   t2.join();
 
   EXPECT_EQ(g_cnt, 4 * sum);
-}
\ No newline at end of file
+}
+
+TEST(Coroutine, PoolReuse) {
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  pool->Clear();
+  auto st = pool->GetStats();
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+
+  int cnt = 0;
+  auto co1 = pool->Acquire(attr, [&]() { cnt++; });
+  co1->Resume();
+  EXPECT_EQ(co1->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  auto raw = co1.get();
+  EXPECT_TRUE(pool->Release(co1));
+  EXPECT_EQ(co1, nullptr);
+  EXPECT_EQ(pool->GetCachedCount(), 1);
+
+  // steady state, coroutine object and its stack are reused
+  for (int i = 0; i < 100; i++) {
+    auto co = pool->Acquire(attr, [&]() { cnt++; });
+    EXPECT_EQ(co.get(), raw);
+    co->Resume();
+    EXPECT_TRUE(pool->Release(co));
+  }
+  EXPECT_EQ(cnt, 101);
+  EXPECT_EQ(pool->GetStats().misses_ - st.misses_, 1);
+  EXPECT_EQ(pool->GetStats().hits_ - st.hits_, 100);
+}
+
+TEST(Coroutine, PoolRejectUnfinished) {
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  pool->Clear();
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+
+  auto co1 = pool->Acquire(attr, std::bind(&swap));
+  co1->Resume();
+  // suspended coroutine cannot be recycled
+  EXPECT_FALSE(pool->Release(co1));
+  co1->Resume();
+  // still referenced by others
+  auto ref = co1;
+  EXPECT_FALSE(pool->Release(co1));
+  ref = nullptr;
+  EXPECT_TRUE(pool->Release(co1));
+
+  // shared stack coroutine is never cached
+  attr->shared_mem_ = Sylar::SharedMem::AllocSharedMem(1, 64 * 1024);
+  auto co2 = pool->Acquire(attr, []() {});
+  co2->Resume();
+  EXPECT_FALSE(pool->Release(co2));
+  EXPECT_EQ(pool->GetCachedCount(), 1);
+}
+
+TEST(Coroutine, PoolWatermark) {
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  pool->Clear();
+  pool->SetWatermark(2, 4);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+
+  std::vector<std::shared_ptr<Sylar::Coroutine>> cvec;
+  for (int i = 0; i < 5; i++) {
+    cvec.push_back(pool->Acquire(attr, []() {}));
+    cvec.back()->Resume();
+  }
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(pool->Release(cvec[i]));
+  }
+  EXPECT_EQ(pool->GetCachedCount(), 4);
+  // exceed high watermark, trim to low watermark
+  EXPECT_TRUE(pool->Release(cvec[4]));
+  EXPECT_EQ(pool->GetCachedCount(), 2);
+
+  pool->SetWatermark(64, 1024);
+}
+
+void TouchStack(size_t bytes) {
+  volatile char *buf = (volatile char *)alloca(bytes);
+  for (size_t i = 0; i < bytes; i += 4096) {
+    buf[i] = 0xff;
+  }
+  Sylar::Schedule::Yield();
+}
+
+TEST(Coroutine, MmapStackLazyCommit) {
+  auto stats = Sylar::MmapStackStats::GetThreadStats();
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->use_mmap_stack_ = true;
+  attr->stack_size_ = 1024 * 1024;
+  {
+    auto co1 = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, std::bind(&swap));
+    auto co2 = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr,
+        std::bind(&TouchStack, 512 * 1024));
+    EXPECT_EQ(stats->GetStackCount(), 2);
+    EXPECT_EQ(stats->GetReservedBytes(), 2 * 1024 * 1024);
+    // only the entry frame prepared at the top of stack is touched
+    EXPECT_LE(stats->GetResidentBytes(), 2 * 4096);
+
+    co1->Resume();
+    // only the top of stack is committed
+    auto resident = stats->GetResidentBytes();
+    EXPECT_GT(resident, 0);
+    EXPECT_LT(resident, 64 * 1024);
+
+    co2->Resume();
+    EXPECT_GE(stats->GetResidentBytes(), resident + 512 * 1024);
+
+    co1->Resume();
+    co2->Resume();
+  }
+  EXPECT_EQ(stats->GetStackCount(), 0);
+  EXPECT_EQ(stats->GetReservedBytes(), 0);
+}
+
+// always true, the compiler cannot prove the recursion endless and warn
+static volatile bool g_recurse = true;
+
+int Overflow(int depth) {
+  volatile char buf[1024];
+  buf[0] = depth;
+  if (!g_recurse) {
+    return buf[0];
+  }
+  return Overflow(depth + 1) + buf[0];
+}
+
+TEST(Coroutine, MmapStackGuardPage) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->use_mmap_stack_ = true;
+  // stack overflow hits the guard page instead of corrupting heap silently
+  EXPECT_DEATH(
+      {
+        auto co = Sylar::Coroutine::CreateCoroutine(
+            Sylar::Schedule::GetThreadSchedule(), attr,
+            []() { Overflow(0); });
+        co->Resume();
+      },
+      "");
+}
+
+TEST(Coroutine, PoolSeparateStackKind) {
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  pool->Clear();
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto mmap_attr = std::make_shared<Sylar::CoroutineAttr>();
+  mmap_attr->use_mmap_stack_ = true;
+
+  auto co = pool->Acquire(attr, []() {});
+  co->Resume();
+  EXPECT_TRUE(pool->Release(co));
+  auto misses = pool->GetStats().misses_;
+  // malloc stack cannot be reused by coroutine requiring mmap stack
+  auto mco = pool->Acquire(mmap_attr, []() {});
+  EXPECT_EQ(pool->GetStats().misses_, misses + 1);
+  mco->Resume();
+  EXPECT_TRUE(pool->Release(mco));
+  mco = pool->Acquire(mmap_attr, []() {});
+  EXPECT_EQ(pool->GetStats().misses_, misses + 1);
+  mco->Resume();
+  pool->Clear();
+}
+
+void CheckLargeFrame(int seed, int *ok) {
+  // live stack region is larger than inline save buffer of coroutine
+  const int sz = 4096;
+  volatile char buf[sz];
+  for (int i = 0; i < sz; i++) {
+    buf[i] = (char)(seed + i);
+  }
+  Sylar::Schedule::Yield();
+  Sylar::Schedule::Yield();
+  for (int i = 0; i < sz; i++) {
+    if (buf[i] != (char)(seed + i)) {
+      return;
+    }
+  }
+  (*ok)++;
+}
+
+TEST(Coroutine, SharedMemoryLargeFrame) {
+  int ok = 0;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->shared_mem_ = Sylar::SharedMem::AllocSharedMem(1, 128 * 1024);
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr,
+      std::bind(&CheckLargeFrame, 1, &ok));
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr,
+      std::bind(&CheckLargeFrame, 7, &ok));
+  for (int i = 0; i < 3; i++) {
+    co1->Resume();
+    co2->Resume();
+  }
+  EXPECT_EQ(co1->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(co2->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(ok, 2);
+}
+
+TEST(Coroutine, SharedMemoryPickStack) {
+  auto shared_mem = Sylar::SharedMem::AllocSharedMem(2, 64 * 1024);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->shared_mem_ = shared_mem;
+
+  // coroutines are spread over stack memories
+  auto s1 = Sylar::SharedMem::GetStackMem(shared_mem);
+  auto s2 = Sylar::SharedMem::GetStackMem(shared_mem);
+  auto s3 = Sylar::SharedMem::GetStackMem(shared_mem);
+  EXPECT_NE(s1, s2);
+  EXPECT_EQ(s1, s3);
+  EXPECT_EQ(s1->bind_cnt_, 2);
+  EXPECT_EQ(s2->bind_cnt_, 1);
+  s1->bind_cnt_ = s2->bind_cnt_ = 0;
+
+  // with the same number of coroutines, pick the least-recently-evicted one
+  s1->last_evict_ = 10;
+  s2->last_evict_ = 5;
+  EXPECT_EQ(Sylar::SharedMem::GetStackMem(shared_mem), s2);
+  s2->bind_cnt_ = 0;
+
+  {
+    auto co1 = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, []() {});
+    EXPECT_EQ(s2->bind_cnt_, 1);
+  }
+  // binding is released when coroutine destructs
+  EXPECT_EQ(s2->bind_cnt_, 0);
+}
+
+TEST(Coroutine, SwitchToPipeline) {
+  // parser -> handler -> writer -> parser ..., each stage transfers control to
+  // the next stage directly, the execute stack never grows
+  std::vector<int> trace;
+  Sylar::Coroutine::ptr parser, handler, writer;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  size_t depth = 0;
+  parser = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        for (int i = 0; i < 3; i++) {
+          trace.push_back(1);
+          depth = std::max(depth, Sylar::Schedule::GetInvokeDeepth());
+          handler->SwitchTo();
+        }
+      });
+  handler = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        while (true) {
+          trace.push_back(2);
+          depth = std::max(depth, Sylar::Schedule::GetInvokeDeepth());
+          writer->SwitchTo();
+        }
+      });
+  writer = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        while (true) {
+          trace.push_back(3);
+          depth = std::max(depth, Sylar::Schedule::GetInvokeDeepth());
+          if (trace.size() == 6) {
+            // back to main coroutine, which resumes parser
+            Sylar::Schedule::Yield();
+          } else {
+            parser->SwitchTo();
+          }
+        }
+      });
+
+  parser->Resume();
+  EXPECT_EQ(trace, std::vector<int>({1, 2, 3, 1, 2, 3}));
+  EXPECT_EQ(depth, 2);
+  EXPECT_EQ(Sylar::Schedule::GetInvokeDeepth(), 1);
+  EXPECT_EQ(parser->GetCoState(), Sylar::Coroutine::CO_READY);
+  EXPECT_EQ(writer->GetCoState(), Sylar::Coroutine::CO_READY);
+
+  // equivalent to Resume in main coroutine. parser terminates in its third
+  // round, then control returns to main coroutine
+  writer->SwitchTo();
+  EXPECT_EQ(trace, std::vector<int>({1, 2, 3, 1, 2, 3, 3, 1, 2, 3}));
+  EXPECT_EQ(parser->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(Sylar::Schedule::GetInvokeDeepth(), 1);
+  // switching to a terminated coroutine does nothing
+  parser->SwitchTo();
+  EXPECT_EQ(trace.size(), 10);
+}
+
+TEST(Coroutine, SwitchToNested) {
+  // main -> co1 -(resume)-> co2 -(switch)-> co3, co3 terminates and
+  // returns to co1
+  std::vector<int> trace;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto co3 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        trace.push_back(3);
+        EXPECT_EQ(Sylar::Schedule::GetInvokeDeepth(), 3);
+      });
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        trace.push_back(2);
+        co3->SwitchTo();
+        trace.push_back(4);
+      });
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        co2->Resume();
+        trace.push_back(1);
+        co2->Resume();
+      });
+  co1->Resume();
+  EXPECT_EQ(trace, std::vector<int>({2, 3, 1, 4}));
+  EXPECT_EQ(co1->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(co2->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(co3->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+}
+
+TEST(Coroutine, SwitchToResumer) {
+  // co2 cannot take its own place, co1 is waiting for it in execute stack
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  Sylar::Coroutine::ptr co1;
+  bool thrown = false;
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        try {
+          co1->SwitchTo();
+        } catch (const std::runtime_error &) {
+          thrown = true;
+        }
+      });
+  co1 = Sylar::Coroutine::CreateCoroutine(Sylar::Schedule::GetThreadSchedule(),
+                                          attr, [&]() { co2->Resume(); });
+  co1->Resume();
+  EXPECT_TRUE(thrown);
+  EXPECT_EQ(co1->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  EXPECT_EQ(co2->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+}
+
+void CheckLocal(int val) {
+  volatile int local = val;
+  Sylar::Schedule::Yield();
+  EXPECT_EQ(local, val);
+}
+
+TEST(Coroutine, SharedMemoryOccupierDestructed) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->shared_mem_ = Sylar::SharedMem::AllocSharedMem(1, 64 * 1024);
+  auto stack_mem = attr->shared_mem_->stack_array_[0];
+
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(&CheckLocal, 1));
+  co1->Resume();
+  {
+    // co2 evicts co1, then it's destructed while occupying the stack
+    auto co2 = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, std::bind(&CheckLocal, 2));
+    co2->Resume();
+    EXPECT_EQ(stack_mem->occupy_co_, co2.get());
+  }
+  EXPECT_EQ(stack_mem->occupy_co_, nullptr);
+  // the stack of co1 must be resumed even if nobody occupies the stack
+  co1->Resume();
+  EXPECT_EQ(co1->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+}
+
+struct LocalValue {
+  static int alive_;
+  LocalValue() { alive_++; }
+  ~LocalValue() { alive_--; }
+  int val_ = 0;
+};
+int LocalValue::alive_ = 0;
+
+static Sylar::CoroutineLocal<LocalValue> g_local;
+static Sylar::CoroutineLocal<std::string> g_local_str;
+static Sylar::CoroutineLocal<int> g_local_int;
+
+TEST(Coroutine, CoroutineId) {
+  EXPECT_EQ(Sylar::GetCoroutineId(), 0);
+  std::vector<uint64_t> ids;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto func = [&]() {
+    ids.push_back(Sylar::GetCoroutineId());
+    Sylar::Schedule::Yield();
+    ids.push_back(Sylar::GetCoroutineId());
+  };
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, func);
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, func);
+  EXPECT_NE(co1->GetId(), 0);
+  EXPECT_NE(co1->GetId(), co2->GetId());
+  co1->Resume();
+  co2->Resume();
+  co1->Resume();
+  EXPECT_EQ(Sylar::GetCoroutineId(), 0);
+  EXPECT_EQ(ids, std::vector<uint64_t>(
+                     {co1->GetId(), co2->GetId(), co1->GetId()}));
+
+  // coroutine reused by pool gets a new id
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  uint64_t old_id = co1->GetId();
+  auto raw = co1.get();
+  EXPECT_TRUE(pool->Release(co1));
+  auto co3 = pool->Acquire(attr, []() {});
+  EXPECT_EQ(co3.get(), raw);
+  EXPECT_GT(co3->GetId(), old_id);
+  pool->Clear();
+}
+
+TEST(Coroutine, CoroutineLocal) {
+  int base = LocalValue::alive_;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::vector<int> seen;
+  auto func = [&](int val) {
+    EXPECT_FALSE(g_local.Has());
+    g_local->val_ = val;
+    g_local_str.Set(std::to_string(val));
+    Sylar::Schedule::Yield();
+    // values are not overwritten by other coroutines
+    seen.push_back(g_local->val_);
+    EXPECT_EQ(*g_local_str, std::to_string(val));
+  };
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(func, 1));
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(func, 2));
+  co1->Resume();
+  co2->Resume();
+  EXPECT_EQ(LocalValue::alive_, base + 2);
+  // main coroutine has its own value
+  EXPECT_EQ(g_local->val_, 0);
+  co2->Resume();
+  co1->Resume();
+  EXPECT_EQ(seen, std::vector<int>({2, 1}));
+  // values are destroyed when coroutine terminates
+  EXPECT_EQ(LocalValue::alive_, base + 1);
+  g_local.Reset();
+  EXPECT_EQ(LocalValue::alive_, base);
+
+  // values of unfinished coroutine are destroyed with coroutine
+  {
+    auto co = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, std::bind(func, 3));
+    co->Resume();
+    EXPECT_EQ(LocalValue::alive_, base + 1);
+  }
+  EXPECT_EQ(LocalValue::alive_, base);
+}
+
+TEST(Coroutine, CoroutineLocalInline) {
+  static_assert(Sylar::CoroutineLocal<int>::kInline);
+  static_assert(!Sylar::CoroutineLocal<std::string>::kInline);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::vector<int> seen;
+  auto func = [&](int val) {
+    EXPECT_FALSE(g_local_int.Has());
+    // zero is a value as well, rather than an empty slot
+    EXPECT_EQ(g_local_int.Get(), 0);
+    EXPECT_TRUE(g_local_int.Has());
+    g_local_int.Set(val);
+    Sylar::Schedule::Yield();
+    seen.push_back(*g_local_int);
+  };
+  auto co1 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(func, 1));
+  auto co2 = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::bind(func, 2));
+  co1->Resume();
+  co2->Resume();
+  co2->Resume();
+  co1->Resume();
+  EXPECT_EQ(seen, std::vector<int>({2, 1}));
+
+  // a coroutine reused by pool starts without the value
+  auto pool = Sylar::CoroutinePool::GetThreadPool();
+  auto co3 = pool->Acquire(attr, std::bind(func, 3));
+  co3->Resume();
+  co3->Resume();
+  EXPECT_TRUE(pool->Release(co3));
+  auto co4 = pool->Acquire(attr, std::bind(func, 4));
+  co4->Resume();
+  co4->Resume();
+  EXPECT_EQ(seen, std::vector<int>({2, 1, 3, 4}));
+  pool->Clear();
+  g_local_int.Reset();
+  EXPECT_FALSE(g_local_int.Has());
+}
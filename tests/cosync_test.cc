@@ -0,0 +1,180 @@
+#include "../src/include/cosync.hh"
+#include "../src/include/iomanager.hh"
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// run event loop of current thread until all coroutines terminate
+void RunUntilDone(const std::vector<Sylar::Coroutine::ptr> &cos) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  while (true) {
+    bool done = true;
+    for (auto &co : cos) {
+      if (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+        done = false;
+      }
+    }
+    if (done) {
+      break;
+    }
+    Sylar::Schedule::EventloopOnce(epoll, 10);
+  }
+}
+
+TEST(CoSync, MutexInOneThread) {
+  Sylar::CoMutex mu;
+  int in_cs = 0, cnt = 0;
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::vector<Sylar::Coroutine::ptr> cos;
+  for (int i = 0; i < 3; i++) {
+    cos.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+          for (int j = 0; j < 5; j++) {
+            Sylar::CoMutex::ScopeLock lock(mu);
+            EXPECT_EQ(++in_cs, 1);
+            // other coroutines run while we are sleeping in critical section
+            usleep(2000);
+            cnt++;
+            in_cs--;
+          }
+        }));
+  }
+  for (auto &co : cos) {
+    co->Resume();
+  }
+  EXPECT_FALSE(mu.TryLock());
+  RunUntilDone(cos);
+  EXPECT_EQ(cnt, 15);
+  EXPECT_TRUE(mu.TryLock());
+  mu.Unlock();
+}
+
+TEST(CoSync, MutexAcrossThreads) {
+  Sylar::CoMutex mu;
+  std::atomic<int> in_cs(0);
+  int cnt = 0;
+  Sylar::IOManager iom(4, "mutex");
+  iom.Start();
+  for (int i = 0; i < 200; i++) {
+    iom.Schedule([&]() {
+      Sylar::CoMutex::ScopeLock lock(mu);
+      EXPECT_EQ(++in_cs, 1);
+      if (cnt % 10 == 0) {
+        usleep(1000);
+      }
+      cnt++;
+      in_cs--;
+    });
+  }
+  // main coroutine blocks the thread
+  for (int i = 0; i < 50; i++) {
+    Sylar::CoMutex::ScopeLock lock(mu);
+    EXPECT_EQ(++in_cs, 1);
+    cnt++;
+    in_cs--;
+  }
+  iom.Stop();
+  EXPECT_EQ(cnt, 250);
+}
+
+TEST(CoSync, CondVar) {
+  Sylar::CoMutex mu;
+  Sylar::CoCondVar cv;
+  std::deque<int> queue;
+  std::atomic<int> sum(0);
+  bool closed = false;
+
+  Sylar::IOManager iom(2, "condvar");
+  iom.Start();
+  for (int i = 0; i < 4; i++) {
+    iom.Schedule([&]() {
+      while (true) {
+        Sylar::CoMutex::ScopeLock lock(mu);
+        while (queue.empty() && !closed) {
+          cv.Wait(mu);
+        }
+        if (queue.empty()) {
+          break;
+        }
+        sum += queue.front();
+        queue.pop_front();
+      }
+    });
+  }
+  for (int i = 1; i <= 1000; i++) {
+    Sylar::CoMutex::ScopeLock lock(mu);
+    queue.push_back(i);
+    cv.NotifyOne();
+  }
+  {
+    Sylar::CoMutex::ScopeLock lock(mu);
+    closed = true;
+    cv.NotifyAll();
+  }
+  iom.Stop();
+  EXPECT_EQ(sum.load(), 1000 * 1001 / 2);
+}
+
+TEST(CoSync, SemaphoreLimit) {
+  Sylar::CoSemaphore sem(2);
+  std::atomic<int> running(0), max_running(0), cnt(0);
+  Sylar::IOManager iom(2, "semaphore");
+  iom.Start();
+  for (int i = 0; i < 20; i++) {
+    iom.Schedule([&]() {
+      sem.Wait();
+      int cur = ++running;
+      int prev = max_running.load();
+      while (cur > prev && !max_running.compare_exchange_weak(prev, cur)) {
+      }
+      usleep(2000);
+      running--;
+      cnt++;
+      sem.Notify();
+    });
+  }
+  iom.Stop();
+  EXPECT_EQ(cnt.load(), 20);
+  EXPECT_LE(max_running.load(), 2);
+  EXPECT_EQ(sem.GetCount(), 2);
+  EXPECT_TRUE(sem.TryWait());
+  EXPECT_TRUE(sem.TryWait());
+  EXPECT_FALSE(sem.TryWait());
+}
+
+TEST(CoSync, WaitGroup) {
+  Sylar::WaitGroup wg;
+  std::atomic<int> cnt(0);
+  Sylar::IOManager iom(2, "waitgroup");
+  iom.Start();
+
+  // coroutine waits for other tasks
+  std::atomic<bool> waited(false);
+  Sylar::WaitGroup inner;
+  inner.Add(10);
+  wg.Add(1);
+  iom.Schedule([&]() {
+    inner.Wait();
+    waited = (cnt.load() == 10);
+    wg.Done();
+  });
+  wg.Add(10);
+  for (int i = 0; i < 10; i++) {
+    iom.Schedule([&]() {
+      usleep(1000);
+      cnt++;
+      inner.Done();
+      wg.Done();
+    });
+  }
+  // main coroutine blocks the thread
+  wg.Wait();
+  EXPECT_EQ(cnt.load(), 10);
+  EXPECT_TRUE(waited.load());
+  iom.Stop();
+}
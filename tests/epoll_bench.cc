@@ -0,0 +1,326 @@
+#include "../src/include/coroutine.hh"
+#include "../src/include/fdmanager.hh"
+#include "../src/include/uring.hh"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+// micro benchmark of registering and dispatching events, usage:
+//  ./epoll_bench [fds] [rounds]
+//
+// register the given number of eventfds(100k by default), then make all of
+// them readable and measure the cost of dispatching each event by event loop.
+// after that, coroutines ping-pong over socketpairs by hooked read and write,
+// through epoll and then io_uring if it's supported, and report the syscalls
+// other than read/write per round trip. at last, measure re-arming a one-shot
+// registration in its callback and posting tasks from other threads, and
+// the latency of posted tasks with and without busy polling
+
+double NowNS() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// raise the limit of open files, return the number of fds can be opened
+size_t RaiseFdLimit(size_t want) {
+  rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  if (lim.rlim_cur < want + 64) {
+    lim.rlim_cur = std::min<rlim_t>(want + 64, lim.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &lim);
+    getrlimit(RLIMIT_NOFILE, &lim);
+  }
+  return lim.rlim_cur > 64 ? std::min<size_t>(want, lim.rlim_cur - 64) : 0;
+}
+
+// pairs of coroutines ping-pong over socketpairs by hooked read and write
+// concurrently, through epoll or the io_uring of current thread
+void BenchPingPong(int rounds, int pairs, bool uring) {
+  Sylar::IoUring::SetEnable(uring);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::vector<int> fds(pairs * 2);
+  std::vector<Sylar::Coroutine::ptr> cos;
+  for (int p = 0; p < pairs; p++) {
+    int *sv = &fds[p * 2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    cos.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [sv, rounds]() {
+          char c;
+          for (int i = 0; i < rounds; i++) {
+            read(sv[1], &c, 1);
+            write(sv[1], &c, 1);
+          }
+        }));
+    cos.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [sv, rounds]() {
+          char c = 'x';
+          for (int i = 0; i < rounds; i++) {
+            write(sv[0], &c, 1);
+            read(sv[0], &c, 1);
+          }
+        }));
+  }
+  auto ring = uring ? Sylar::IoUring::GetThreadRing() : nullptr;
+  Sylar::UringStats ring_before{0, 0, 0};
+  if (ring) {
+    ring_before = ring->GetStats();
+  }
+  auto before = Sylar::FdManager::ThreadSyscalls();
+  double st = NowNS();
+  for (auto &co : cos) {
+    co->Resume();
+  }
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  auto done = [&]() {
+    for (auto &co : cos) {
+      if (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (!done()) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  double ed = NowNS();
+  auto after = Sylar::FdManager::ThreadSyscalls();
+  double total = (double)rounds * pairs;
+  std::cout << "[hooked ping-pong by " << (ring ? "io_uring" : "epoll")
+            << "] pairs: " << pairs << ", round trips: " << rounds * pairs
+            << ", per round trip: " << (ed - st) / total << " ns"
+            << ", fcntl: " << (after.fcntl_ - before.fcntl_) / total
+            << ", fstat: " << (after.fstat_ - before.fstat_) / total
+            << ", epoll_ctl: "
+            << (after.epoll_ctl_ - before.epoll_ctl_) / total;
+  if (ring) {
+    auto stats = ring->GetStats();
+    std::cout << ", io_uring_enter: "
+              << (stats.enter_ - ring_before.enter_) / total
+              << ", sqes: " << (stats.submit_ - ring_before.submit_) / total;
+  }
+  std::cout << std::endl;
+  for (int fd : fds) {
+    close(fd);
+  }
+  Sylar::IoUring::SetEnable(false);
+}
+
+// ping-pong by ReadFixed and WriteFixed, which skip pinning user pages
+void BenchFixedBuffers(int rounds) {
+  auto ring = Sylar::IoUring::GetThreadRing();
+  if (!ring || !ring->RegisterBuffers(2, 4096)) {
+    std::cout << "[fixed buffers] skipped, buffers cannot be registered"
+              << std::endl;
+    return;
+  }
+  // the fds must stay blocking, see IoUring::ReadFixed
+  int fds[2];
+  socketpair_f(AF_UNIX, SOCK_STREAM, 0, fds);
+  int ping_buf = ring->AcquireBuffer();
+  int pong_buf = ring->AcquireBuffer();
+  ring->GetBuffer(ping_buf)[0] = 'x';
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto pong = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        for (int i = 0; i < rounds; i++) {
+          ring->ReadFixed(fds[1], pong_buf, 1);
+          ring->WriteFixed(fds[1], pong_buf, 1);
+        }
+      });
+  auto ping = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        for (int i = 0; i < rounds; i++) {
+          ring->WriteFixed(fds[0], ping_buf, 1);
+          ring->ReadFixed(fds[0], ping_buf, 1);
+        }
+      });
+  double st = NowNS();
+  pong->Resume();
+  ping->Resume();
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  while (ping->GetCoState() != Sylar::Coroutine::CO_TERMINAL ||
+         pong->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  double ed = NowNS();
+  std::cout << "[fixed buffers ping-pong by io_uring] round trips: " << rounds
+            << ", per round trip: " << (ed - st) / rounds << " ns"
+            << std::endl;
+  close_f(fds[0]);
+  close_f(fds[1]);
+}
+
+// the callback handles an event and re-arms a one-shot registration, which is
+// the pattern of handing a fd to one worker at a time
+void BenchOneShot(int events) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  int fd = eventfd(0, EFD_NONBLOCK);
+  int fired = 0;
+  std::function<void()> func;
+  func = [&]() {
+    uint64_t val;
+    read(fd, &val, sizeof(val));
+    fired++;
+    epoll->RegisterEvent(Sylar::Epoll::EventType::READ |
+                             static_cast<int>(Sylar::Epoll::EventFlag::ONESHOT),
+                         fd, func, nullptr);
+  };
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ |
+                           static_cast<int>(Sylar::Epoll::EventFlag::ONESHOT),
+                       fd, func, nullptr);
+  uint64_t val = 1;
+  auto before = Sylar::FdManager::ThreadSyscalls();
+  double st = NowNS();
+  for (int i = 0; i < events; i++) {
+    write(fd, &val, sizeof(val));
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  double ed = NowNS();
+  auto after = Sylar::FdManager::ThreadSyscalls();
+  std::cout << "[oneshot re-arm] events: " << fired
+            << ", per event: " << (ed - st) / events << " ns, epoll_ctl: "
+            << (double)(after.epoll_ctl_ - before.epoll_ctl_) / events
+            << std::endl;
+  close(fd);
+}
+
+// producer threads post tasks to the event loop of current thread
+void BenchPost(int producers, int tasks) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  int handled = 0;
+  std::vector<std::thread> threads;
+  double st = NowNS();
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < tasks; i++) {
+        epoll->Post([&handled]() { handled++; });
+      }
+    });
+  }
+  int loops = 0;
+  while (handled < producers * tasks) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+    loops++;
+  }
+  double ed = NowNS();
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::cout << "[post] producers: " << producers << ", tasks: " << handled
+            << ", per task: " << (ed - st) / handled
+            << " ns, tasks per wakeup: " << (double)handled / loops
+            << std::endl;
+}
+
+// another thread posts a task every 100us, measure the latency from posting
+// to running it
+void BenchBusyPoll(uint64_t spin_us, int tasks) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  epoll->SetBusyPoll(spin_us);
+  epoll->ResetLoopStats();
+  Sylar::LatencyHistogram hist;
+  int handled = 0;
+  std::thread producer([&]() {
+    for (int i = 0; i < tasks; i++) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      uint64_t posted = Sylar::ReadCycles();
+      epoll->Post([&hist, &handled, posted]() {
+        hist.Record(Sylar::ReadCycles() - posted);
+        handled++;
+      });
+    }
+  });
+  while (handled < tasks) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  producer.join();
+  auto &stats = epoll->GetLoopStats();
+  std::cout << "[busy poll] spin: " << spin_us
+            << " us, p50: " << Sylar::CyclesToNS(hist.Percentile(0.5))
+            << " ns, p99: " << Sylar::CyclesToNS(hist.Percentile(0.99))
+            << " ns, spin hit ratio: " << stats.SpinHitRatio()
+            << ", dispatch p99: " << stats.LatencyNS(0.99) << " ns"
+            << std::endl;
+  epoll->SetBusyPoll(0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t cnt = argc > 1 ? std::stoull(argv[1]) : 100000;
+  int rounds = argc > 2 ? std::stoi(argv[2]) : 10;
+  size_t limit = RaiseFdLimit(cnt);
+  if (limit < cnt) {
+    std::cout << "open files limited, use " << limit << " fds" << std::endl;
+    cnt = limit;
+  }
+
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  std::vector<int> fds;
+  fds.reserve(cnt);
+  for (size_t i = 0; i < cnt; i++) {
+    fds.push_back(eventfd(0, EFD_NONBLOCK));
+  }
+  uint64_t fired = 0;
+  double st = NowNS();
+  for (int fd : fds) {
+    epoll->RegisterEvent(Sylar::Epoll::EventType::READ, fd,
+                         [&fired]() { fired++; }, nullptr);
+  }
+  // changes are applied by event loop, include them
+  epoll->FlushChanges();
+  double ed = NowNS();
+  std::cout << "[register] fds: " << cnt << ", per fd: " << (ed - st) / cnt
+            << " ns" << std::endl;
+
+  // the eventfds are never read, edge triggered epoll reports each write once
+  uint64_t val = 1;
+  double dispatch = 0;
+  for (int r = 0; r < rounds; r++) {
+    for (int fd : fds) {
+      write(fd, &val, sizeof(val));
+    }
+    fired = 0;
+    st = NowNS();
+    while (fired < cnt) {
+      Sylar::Schedule::EventloopOnce(epoll, 100);
+    }
+    dispatch += NowNS() - st;
+  }
+  std::cout << "[dispatch] events: " << cnt * rounds
+            << ", per event(including epoll_wait): "
+            << dispatch / (cnt * rounds) << " ns" << std::endl;
+
+  st = NowNS();
+  for (int fd : fds) {
+    epoll->CancelEvent(Sylar::Epoll::EventType::READ, fd);
+  }
+  epoll->FlushChanges();
+  ed = NowNS();
+  std::cout << "[cancel] per fd: " << (ed - st) / cnt << " ns" << std::endl;
+  for (int fd : fds) {
+    close(fd);
+  }
+
+  BenchPingPong(100000, 1, false);
+  BenchPingPong(1000, 100, false);
+  if (Sylar::IoUring::IsSupported()) {
+    BenchPingPong(100000, 1, true);
+    BenchPingPong(1000, 100, true);
+    BenchFixedBuffers(100000);
+  } else {
+    std::cout << "io_uring is not supported, hooked I/O uses epoll"
+              << std::endl;
+  }
+  BenchOneShot(100000);
+  BenchPost(1, 1000000);
+  BenchPost(4, 250000);
+  BenchBusyPoll(0, 10000);
+  BenchBusyPoll(1000, 10000);
+  return 0;
+}
@@ -1,5 +1,8 @@
 #include "../src/include/coroutine.hh"
+#include "../src/include/fdmanager.hh"
+#include <atomic>
 #include <gtest/gtest.h>
+#include <sys/eventfd.h>
 #include <thread>
 
 void Swap() { Sylar::Schedule::Yield(); }
@@ -71,4 +74,310 @@ TEST(Epoll, CoroutineTime) {
   Sylar::Schedule::Eventloop(epoll);
 
   t1.join();
-}
\ No newline at end of file
+}
+TEST(Epoll, ManyFds) {
+  // fds spread over several chunks of the event table
+  const int N = 2000;
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  std::vector<int> fds;
+  int fired = 0;
+  for (int i = 0; i < N; i++) {
+    int fd = eventfd(0, EFD_NONBLOCK);
+    ASSERT_GE(fd, 0);
+    fds.push_back(fd);
+    epoll->RegisterEvent(Sylar::Epoll::EventType::READ, fd,
+                         [&fired, fd]() {
+                           uint64_t val;
+                           read_f(fd, &val, sizeof(val));
+                           fired++;
+                         },
+                         nullptr);
+  }
+  auto ctx = epoll->GetEventCtx(fds.back());
+  ASSERT_NE(ctx, nullptr);
+  EXPECT_EQ(ctx->fd_, fds.back());
+  EXPECT_EQ(ctx->type_, Sylar::Epoll::EventType::READ);
+
+  // callbacks stay registered until being cancelled
+  for (int round = 0; round < 2; round++) {
+    fired = 0;
+    uint64_t val = 1;
+    for (int fd : fds) {
+      write_f(fd, &val, sizeof(val));
+    }
+    while (fired < N) {
+      Sylar::Schedule::EventloopOnce(epoll, 100);
+    }
+  }
+
+  // an event cancelled by an earlier callback of the same batch is skipped
+  int victim = fds[1];
+  bool cancelled = false;
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ, fds[0],
+                       [&]() {
+                         uint64_t val;
+                         read_f(fds[0], &val, sizeof(val));
+                         epoll->CancelEvent(Sylar::Epoll::EventType::READ,
+                                            victim);
+                         cancelled = true;
+                       },
+                       nullptr);
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ, victim,
+                       [&]() {
+                         EXPECT_FALSE(cancelled);
+                         uint64_t val;
+                         read_f(victim, &val, sizeof(val));
+                       },
+                       nullptr);
+  uint64_t val = 1;
+  write_f(victim, &val, sizeof(val));
+  write_f(fds[0], &val, sizeof(val));
+  while (!cancelled) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  EXPECT_EQ(epoll->GetEventCtx(victim)->type_, Sylar::Epoll::EventType::NONE);
+
+  for (int fd : fds) {
+    epoll->CancelEvent(Sylar::Epoll::EventType::READ, fd);
+    EXPECT_EQ(epoll->GetEventCtx(fd)->type_, Sylar::Epoll::EventType::NONE);
+    close_f(fd);
+  }
+}
+
+TEST(Epoll, BatchedChanges) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  epoll->FlushChanges();
+  auto &stats = Sylar::FdManager::ThreadSyscalls();
+  std::vector<int> fds;
+  for (int i = 0; i < 100; i++) {
+    fds.push_back(eventfd(0, EFD_NONBLOCK));
+  }
+  uint64_t before = stats.epoll_ctl_;
+  for (int fd : fds) {
+    epoll->RegisterEvent(Sylar::Epoll::EventType::READ, fd, []() {}, nullptr);
+    epoll->RegisterEvent(Sylar::Epoll::EventType::WRITE, fd, nullptr,
+                         []() {});
+  }
+  // registering and cancelling in one iteration cost nothing
+  epoll->CancelEvent(Sylar::Epoll::EventType::READ |
+                         Sylar::Epoll::EventType::WRITE,
+                     fds[0]);
+  EXPECT_EQ(stats.epoll_ctl_, before);
+  epoll->FlushChanges();
+  EXPECT_EQ(stats.epoll_ctl_, before + fds.size() - 1);
+  EXPECT_TRUE(epoll->GetEventCtx(fds[1])->in_epoll_);
+  EXPECT_FALSE(epoll->GetEventCtx(fds[0])->in_epoll_);
+
+  before = stats.epoll_ctl_;
+  for (int fd : fds) {
+    close(fd);
+  }
+  // hooked close removes fd at once
+  EXPECT_EQ(stats.epoll_ctl_, before + fds.size() - 1);
+  EXPECT_FALSE(epoll->GetEventCtx(fds[1])->in_epoll_);
+}
+
+TEST(Epoll, OneShot) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  int fd = eventfd(0, EFD_NONBLOCK);
+  int fired = 0;
+  std::function<void()> func = [&]() { fired++; };
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ |
+                           static_cast<int>(Sylar::Epoll::EventFlag::ONESHOT),
+                       fd, func, nullptr);
+  uint64_t val = 1;
+  write_f(fd, &val, sizeof(val));
+  for (int i = 0; i < 3; i++) {
+    Sylar::Schedule::EventloopOnce(epoll, 10);
+  }
+  EXPECT_EQ(fired, 1);
+  EXPECT_EQ(epoll->GetEventCtx(fd)->type_, Sylar::Epoll::EventType::NONE);
+
+  // re-arming reports the readiness again by one epoll_ctl
+  auto &stats = Sylar::FdManager::ThreadSyscalls();
+  uint64_t before = stats.epoll_ctl_;
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ |
+                           static_cast<int>(Sylar::Epoll::EventFlag::ONESHOT),
+                       fd, func, nullptr);
+  Sylar::Schedule::EventloopOnce(epoll, 10);
+  EXPECT_EQ(fired, 2);
+  EXPECT_EQ(stats.epoll_ctl_, before + 1);
+  close(fd);
+}
+
+TEST(Epoll, LevelTriggered) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  int fd = eventfd(0, EFD_NONBLOCK);
+  int fired = 0;
+  epoll->RegisterEvent(Sylar::Epoll::EventType::READ |
+                           static_cast<int>(Sylar::Epoll::EventFlag::LEVEL),
+                       fd, [&]() { fired++; }, nullptr);
+  uint64_t val = 1;
+  write_f(fd, &val, sizeof(val));
+  // reported in every iteration until being read
+  for (int i = 0; i < 3; i++) {
+    Sylar::Schedule::EventloopOnce(epoll, 10);
+  }
+  EXPECT_EQ(fired, 3);
+  read_f(fd, &val, sizeof(val));
+  Sylar::Schedule::EventloopOnce(epoll, 10);
+  EXPECT_EQ(fired, 3);
+  close(fd);
+}
+
+TEST(Epoll, Exclusive) {
+  // each worker has its own epoll waiting for the shared fd
+  int fd = eventfd(0, EFD_NONBLOCK);
+  std::atomic<int> fired(0);
+  std::atomic<int> ready(0);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 4; i++) {
+    workers.emplace_back([&]() {
+      auto epoll = Sylar::Epoll::GetThreadEpoll();
+      int type = Sylar::Epoll::EventType::READ |
+                 static_cast<int>(Sylar::Epoll::EventFlag::EXCLUSIVE);
+      epoll->RegisterEvent(type, fd,
+                           [&]() {
+                             uint64_t val;
+                             if (read_f(fd, &val, sizeof(val)) > 0) {
+                               fired++;
+                             }
+                           },
+                           nullptr);
+      epoll->FlushChanges();
+      ready++;
+      while (!stop) {
+        Sylar::Schedule::EventloopOnce(epoll, 10);
+      }
+      epoll->CancelEvent(Sylar::Epoll::EventType::READ, fd);
+      epoll->FlushChanges();
+    });
+  }
+  while (ready < 4) {
+  }
+  uint64_t val = 1;
+  write_f(fd, &val, sizeof(val));
+  while (fired == 0) {
+  }
+  stop = true;
+  for (auto &t : workers) {
+    t.join();
+  }
+  EXPECT_EQ(fired, 1);
+  close_f(fd);
+}
+
+TEST(Epoll, PostFromThreads) {
+  const int kProducers = 4;
+  const int N = 20000;
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  std::vector<int> last(kProducers, -1);
+  int handled = 0;
+  bool ordered = true;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&, p]() {
+      for (int i = 0; i < N; i++) {
+        // tasks run in the owning thread, no lock is needed
+        epoll->Post([&, p, i]() {
+          ordered = ordered && last[p] == i - 1;
+          last[p] = i;
+          handled++;
+        });
+      }
+    });
+  }
+  while (handled < kProducers * N) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  EXPECT_TRUE(ordered);
+  EXPECT_EQ(handled, kProducers * N);
+}
+
+TEST(Epoll, PostResume) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::thread::id resumed_in;
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        Sylar::Schedule::Yield();
+        resumed_in = std::this_thread::get_id();
+      });
+  co->Resume();
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  std::thread t([&]() { epoll->PostResume(co); });
+  while (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  t.join();
+  EXPECT_EQ(resumed_in, std::this_thread::get_id());
+}
+
+TEST(Epoll, StopWakesLoop) {
+  // the loop has nothing to wait for, stopping must not wait for its timeout
+  std::atomic<Sylar::Epoll *> epoll(nullptr);
+  std::atomic<uint64_t> stopped_at(0);
+  std::thread loop([&]() {
+    auto ep = Sylar::Epoll::GetThreadEpoll();
+    ep->StopEventLoop(false);
+    epoll = ep.get();
+    Sylar::Schedule::Eventloop(ep);
+    stopped_at = Sylar::GetElapseFromRebootMS();
+  });
+  while (!epoll) {
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  uint64_t st = Sylar::GetElapseFromRebootMS();
+  epoll.load()->StopEventLoop(true);
+  loop.join();
+  EXPECT_LT(stopped_at - st, 500);
+}
+
+TEST(Epoll, BusyPoll) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  epoll->SetBusyPoll(200 * 1000);
+  epoll->ResetLoopStats();
+  // the task is posted while the loop is spinning
+  bool handled = false;
+  std::thread t([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    epoll->Post([&handled]() { handled = true; });
+  });
+  while (!handled) {
+    Sylar::Schedule::EventloopOnce(epoll, 1000);
+  }
+  t.join();
+  auto &stats = epoll->GetLoopStats();
+  EXPECT_GE(stats.spin_hits_, 1);
+  EXPECT_GE(stats.latency_.Count(), 1);
+
+  // the spin budget is limited by timeout, then it blocks for the rest
+  uint64_t st = Sylar::GetElapseFromRebootMS();
+  Sylar::Schedule::EventloopOnce(epoll, 10);
+  EXPECT_LT(Sylar::GetElapseFromRebootMS() - st, 100);
+  EXPECT_GE(stats.spin_misses_, 1);
+  EXPECT_LT(stats.SpinHitRatio(), 1);
+  epoll->SetBusyPoll(0);
+  epoll->ResetLoopStats();
+}
+
+TEST(Epoll, LatencyHistogram) {
+  Sylar::LatencyHistogram hist;
+  EXPECT_EQ(hist.Percentile(0.99), 0);
+  for (uint64_t i = 1; i <= 1000; i++) {
+    hist.Record(i);
+  }
+  EXPECT_EQ(hist.Count(), 1000);
+  // a bucket covers 1/8 of its power of 2
+  EXPECT_GE(hist.Percentile(0.99), 990);
+  EXPECT_LE(hist.Percentile(0.99), 990 + 990 / 8);
+  EXPECT_GE(hist.Percentile(0.5), 500);
+  EXPECT_LE(hist.Percentile(0.5), 500 + 500 / 8);
+  EXPECT_GE(hist.Percentile(1), 1000);
+  hist.Reset();
+  hist.Record(3);
+  EXPECT_EQ(hist.Percentile(0.5), 3);
+}
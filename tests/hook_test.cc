@@ -1,7 +1,14 @@
 #include "../src/include/coroutine.hh"
+#include "../src/include/fdmanager.hh"
 #include "../src/include/hook.hh"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <thread>
+#include <vector>
 
 TEST(Hook, WithHook) {
   auto attr = std::make_shared<Sylar::CoroutineAttr>();
@@ -61,4 +68,287 @@ TEST(Hook, WithoutHook) {
   t.join();
 
   SYLAR_INFO_LOG(SYLAR_LOG_ROOT) << "stop";
-}
\ No newline at end of file
+}
+// run the event loop of current thread until all coroutines terminate
+static void RunUntilTerminal(const std::vector<Sylar::Coroutine::ptr> &cos) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  auto done = [&]() {
+    for (auto &co : cos) {
+      if (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (!done()) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+}
+
+TEST(Hook, ReadDeadline) {
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  ssize_t ret = 0;
+  int err = 0;
+  uint64_t elapse = 0;
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        auto st = Sylar::GetElapseFromRebootMS();
+        Sylar::Schedule::GetCurrentCo()->SetDeadline(st + 50);
+        char buf[8];
+        ret = read(fds[0], buf, sizeof(buf));
+        err = errno;
+        elapse = Sylar::GetElapseFromRebootMS() - st;
+      });
+  co->Resume();
+  RunUntilTerminal({co});
+  EXPECT_EQ(ret, -1);
+  EXPECT_EQ(err, ETIMEDOUT);
+  EXPECT_GE(elapse, 49);
+  EXPECT_LT(elapse, 1000);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Hook, DeadlineNotReached) {
+  // the deadline timer is removed once read returns, a stale one must not
+  // resume the coroutine sleeping later
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  ssize_t ret = 0;
+  int sleep_ret = -1;
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        auto self = Sylar::Schedule::GetCurrentCo();
+        self->SetDeadline(Sylar::GetElapseFromRebootMS() + 200);
+        char buf[8];
+        ret = read(fds[0], buf, sizeof(buf));
+        self->SetDeadline(0);
+        sleep_ret = usleep(300 * 1000);
+      });
+  co->Resume();
+  write_f(fds[1], "ping", 4);
+  auto st = Sylar::GetElapseFromRebootMS();
+  RunUntilTerminal({co});
+  EXPECT_EQ(ret, 4);
+  EXPECT_EQ(sleep_ret, 0);
+  EXPECT_GE(Sylar::GetElapseFromRebootMS() - st, 299);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Hook, Cancel) {
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  ssize_t read_ret = 0;
+  int read_err = 0;
+  int sleep_ret = 0;
+  int sleep_err = 0;
+  auto reader = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        char buf[8];
+        read_ret = read(fds[0], buf, sizeof(buf));
+        read_err = errno;
+      });
+  auto sleeper = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        sleep_ret = usleep(10 * 1000 * 1000);
+        sleep_err = errno;
+        // a cancelled coroutine fails at once
+        EXPECT_EQ(usleep(1000), -1);
+      });
+  reader->Resume();
+  sleeper->Resume();
+
+  // cancel from another thread, coroutines are resumed in their own thread
+  std::thread t([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    reader->Cancel();
+    sleeper->Cancel();
+  });
+  auto st = Sylar::GetElapseFromRebootMS();
+  RunUntilTerminal({reader, sleeper});
+  t.join();
+  EXPECT_LT(Sylar::GetElapseFromRebootMS() - st, 1000);
+  EXPECT_EQ(read_ret, -1);
+  EXPECT_EQ(read_err, ECANCELED);
+  EXPECT_EQ(sleep_ret, -1);
+  EXPECT_EQ(sleep_err, ECANCELED);
+  EXPECT_TRUE(reader->IsCancelled());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// ping-pong over a socketpair between two coroutines, return the round trips
+static int PingPong(int fds[2], int rounds) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  int done = 0;
+  auto pong = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        char c;
+        for (int i = 0; i < rounds; i++) {
+          if (read(fds[1], &c, 1) != 1 || write(fds[1], &c, 1) != 1) {
+            break;
+          }
+        }
+      });
+  auto ping = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        char c = 'x';
+        for (int i = 0; i < rounds; i++) {
+          if (write(fds[0], &c, 1) != 1 || read(fds[0], &c, 1) != 1) {
+            break;
+          }
+          done++;
+        }
+      });
+  pong->Resume();
+  ping->Resume();
+  RunUntilTerminal({ping, pong});
+  return done;
+}
+
+TEST(Hook, FdCache) {
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  uint32_t state = Sylar::FdManager::GetState(fds[0]);
+  EXPECT_TRUE(state & Sylar::FdManager::FD_SOCKET);
+  EXPECT_FALSE(state & Sylar::FdManager::FD_NONBLOCK);
+  EXPECT_EQ(PingPong(fds, 10), 10);
+  EXPECT_TRUE(Sylar::FdManager::GetState(fds[0]) &
+              Sylar::FdManager::FD_NONBLOCK);
+
+  // once fds are nonblocking, waiting issues no fcntl. epoll_ctl is only
+  // issued when fds start and stop being waited, never per round
+  auto &stats = Sylar::FdManager::ThreadSyscalls();
+  auto before = stats;
+  EXPECT_EQ(PingPong(fds, 10), 10);
+  uint64_t few_rounds = stats.epoll_ctl_ - before.epoll_ctl_;
+  before = stats;
+  EXPECT_EQ(PingPong(fds, 1000), 1000);
+  EXPECT_EQ(stats.fcntl_, before.fcntl_);
+  EXPECT_EQ(stats.fstat_, before.fstat_);
+  EXPECT_EQ(stats.epoll_ctl_ - before.epoll_ctl_, few_rounds);
+
+  // the numbers are reused by new sockets, whose state is probed again
+  int old_fds[2] = {fds[0], fds[1]};
+  close(fds[0]);
+  close(fds[1]);
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ASSERT_EQ(fds[0], old_fds[0]);
+  EXPECT_FALSE(Sylar::FdManager::GetState(fds[0]) &
+               Sylar::FdManager::FD_NONBLOCK);
+  EXPECT_EQ(PingPong(fds, 10), 10);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Hook, NonblockChangedByCaller) {
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  EXPECT_EQ(PingPong(fds, 1), 1);
+  int flags = fcntl(fds[0], F_GETFL);
+  ASSERT_NE(flags & O_NONBLOCK, 0);
+
+  // hooked I/O sets O_NONBLOCK again instead of blocking in kernel
+  ASSERT_EQ(fcntl(fds[0], F_SETFL, flags & ~O_NONBLOCK), 0);
+  EXPECT_FALSE(Sylar::FdManager::GetState(fds[0]) &
+               Sylar::FdManager::FD_NONBLOCK);
+  char c = 'x';
+  ASSERT_EQ(write(fds[1], &c, 1), 1);
+  EXPECT_EQ(read(fds[0], &c, 1), 1);
+  EXPECT_NE(fcntl(fds[0], F_GETFL) & O_NONBLOCK, 0);
+
+  int on = 0;
+  ASSERT_EQ(ioctl(fds[0], FIONBIO, &on), 0);
+  EXPECT_FALSE(Sylar::FdManager::GetState(fds[0]) &
+               Sylar::FdManager::FD_NONBLOCK);
+  on = 1;
+  ASSERT_EQ(ioctl(fds[0], FIONBIO, &on), 0);
+  EXPECT_TRUE(Sylar::FdManager::GetState(fds[0]) &
+              Sylar::FdManager::FD_NONBLOCK);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Hook, WaiterReleased) {
+  // the closure registered by a wait holds the coroutine, it must not be
+  // kept by the fd once the wait returns
+  Sylar::SetHookEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  ssize_t ret = 0;
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+        char buf[8];
+        ret = read(fds[0], buf, sizeof(buf));
+      });
+  co->Resume();
+  write_f(fds[1], "ping", 4);
+  RunUntilTerminal({co});
+  EXPECT_EQ(ret, 4);
+  EXPECT_EQ(co.use_count(), 1);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(Hook, RegularFileStaysBlocking) {
+  Sylar::SetHookEnable(true);
+  FILE *fp = tmpfile();
+  ASSERT_NE(fp, nullptr);
+  int fd = fileno(fp);
+  EXPECT_EQ(write(fd, "data", 4), 4);
+  EXPECT_FALSE(Sylar::FdManager::GetState(fd) &
+               Sylar::FdManager::FD_POLLABLE);
+  EXPECT_EQ(fcntl(fd, F_GETFL) & O_NONBLOCK, 0);
+  fclose(fp);
+}
+
+TEST(Hook, MicrosecondSleep) {
+  // a fresh thread, so that the wheel is empty when changing its granularity
+  std::thread t([]() {
+    Sylar::SetHookEnable(true);
+    auto epoll = Sylar::Epoll::GetThreadEpoll();
+    epoll->SetGranularityUS(50);
+    ASSERT_TRUE(epoll->SetPreciseTimer(true));
+    auto attr = std::make_shared<Sylar::CoroutineAttr>();
+    const int N = 10;
+    uint64_t usleep_elapse = 0;
+    uint64_t nanosleep_elapse = 0;
+    auto co = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+          uint64_t st = Sylar::GetElapseFromRebootUS();
+          for (int i = 0; i < N; i++) {
+            EXPECT_EQ(usleep(300), 0);
+          }
+          usleep_elapse = Sylar::GetElapseFromRebootUS() - st;
+          st = Sylar::GetElapseFromRebootUS();
+          timespec req{0, 300 * 1000};
+          for (int i = 0; i < N; i++) {
+            EXPECT_EQ(nanosleep(&req, nullptr), 0);
+          }
+          nanosleep_elapse = Sylar::GetElapseFromRebootUS() - st;
+        });
+    co->Resume();
+    RunUntilTerminal({co});
+    // never shorter than requested, rather than truncated to milliseconds
+    EXPECT_GE(usleep_elapse, N * 300);
+    EXPECT_GE(nanosleep_elapse, N * 300);
+    EXPECT_LT(usleep_elapse, 100 * 1000);
+    EXPECT_LT(nanosleep_elapse, 100 * 1000);
+    std::cout << "usleep(300) takes " << usleep_elapse / N
+              << " us, nanosleep(300us) takes " << nanosleep_elapse / N
+              << " us" << std::endl;
+    epoll->SetPreciseTimer(false);
+  });
+  t.join();
+}
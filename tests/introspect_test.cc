@@ -0,0 +1,208 @@
+#include "../src/include/introspect.hh"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const Sylar::CoroutineInfo *
+Find(const std::vector<Sylar::CoroutineInfo> &infos, uint64_t id) {
+  for (auto &info : infos) {
+    if (info.id_ == id) {
+      return &info;
+    }
+  }
+  return nullptr;
+}
+
+static void Spin(int ms) {
+  auto st = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - st <
+         std::chrono::milliseconds(ms)) {
+  }
+}
+
+TEST(CoroutineRegistry, Snapshot) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto yielder = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, []() {
+        for (int i = 0; i < 4; i++) {
+          Sylar::Schedule::Yield();
+        }
+      });
+  auto spinner = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, []() {
+        char buf[4096];
+        memset(buf, 1, sizeof(buf));
+        Spin(20);
+        Sylar::Schedule::Yield();
+        // keep buf alive across the switch
+        EXPECT_EQ(buf[100], 1);
+      });
+  for (int i = 0; i < 3; i++) {
+    yielder->Resume();
+  }
+  spinner->Resume();
+
+  auto infos = Sylar::CoroutineRegistry::Snapshot();
+  auto y = Find(infos, yielder->GetId());
+  auto s = Find(infos, spinner->GetId());
+  ASSERT_NE(y, nullptr);
+  ASSERT_NE(s, nullptr);
+  EXPECT_EQ(y->switches_, 3);
+  EXPECT_EQ(y->state_, Sylar::Coroutine::CO_READY);
+  EXPECT_EQ(y->tid_, Sylar::GetThreadId());
+  EXPECT_FALSE(y->main_);
+  EXPECT_FALSE(y->running_);
+  EXPECT_NE(y->site_, nullptr);
+  EXPECT_EQ(s->switches_, 1);
+  EXPECT_GE(s->run_ns_, 15 * 1000 * 1000);
+  EXPECT_GT(s->stack_hwm_, 4096);
+  EXPECT_LT(s->stack_hwm_, s->stack_size_);
+
+  // the main coroutine is running
+  auto main_co = Find(infos, 0);
+  ASSERT_NE(main_co, nullptr);
+  EXPECT_TRUE(main_co->main_);
+  EXPECT_TRUE(main_co->running_);
+
+  auto dump = Sylar::CoroutineRegistry::Dump();
+  EXPECT_NE(dump.find("id=" + std::to_string(yielder->GetId())),
+            std::string::npos);
+  std::cout << dump;
+
+  // destructed coroutines leave the registry
+  uint64_t id = yielder->GetId();
+  yielder.reset();
+  EXPECT_EQ(Find(Sylar::CoroutineRegistry::Snapshot(), id), nullptr);
+  spinner->Resume();
+}
+
+TEST(CoroutineRegistry, OtherThread) {
+  std::atomic<bool> running(false);
+  std::atomic<bool> stop(false);
+  std::atomic<pid_t> tid(0);
+  std::atomic<uint64_t> id(0);
+  std::thread t([&]() {
+    tid = Sylar::GetThreadId();
+    auto co = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(),
+        std::make_shared<Sylar::CoroutineAttr>(), [&]() {
+          running = true;
+          while (!stop) {
+          }
+        });
+    id = co->GetId();
+    co->Resume();
+  });
+  while (!running) {
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  // a stalled coroutine is found out by the long running slice
+  auto infos = Sylar::CoroutineRegistry::Snapshot();
+  auto info = Find(infos, id);
+  ASSERT_NE(info, nullptr);
+  EXPECT_EQ(info->tid_, tid.load());
+  EXPECT_TRUE(info->running_);
+  EXPECT_GE(info->slice_ns_, 5 * 1000 * 1000);
+  stop = true;
+  t.join();
+
+  // the schedule of exited thread is removed
+  for (auto &info : Sylar::CoroutineRegistry::Snapshot()) {
+    EXPECT_NE(info.tid_, tid.load());
+  }
+}
+
+TEST(CoroutineRegistry, DumpBySignal) {
+  std::string dumped;
+  Sylar::CoroutineRegistry::SetDumpSink(
+      [&dumped](const std::string &dump) { dumped = dump; });
+  Sylar::CoroutineRegistry::InstallDumpSignal(SIGUSR1);
+  raise(SIGUSR1);
+  EXPECT_TRUE(Sylar::CoroutineRegistry::IsDumpRequested());
+  Sylar::Schedule::EventloopOnce(Sylar::Epoll::GetThreadEpoll(), 0);
+  EXPECT_FALSE(Sylar::CoroutineRegistry::IsDumpRequested());
+  EXPECT_NE(dumped.find("thread " + std::to_string(Sylar::GetThreadId())),
+            std::string::npos);
+  Sylar::CoroutineRegistry::SetDumpSink(nullptr);
+  signal(SIGUSR1, SIG_DFL);
+}
+
+TEST(StackProfiler, MeasureUsage) {
+  std::vector<uint64_t> stack(1024);
+  char *buf = (char *)stack.data();
+  size_t size = stack.size() * sizeof(uint64_t);
+  Sylar::StackProfiler::Paint(buf, size);
+  EXPECT_EQ(Sylar::StackProfiler::MeasureUsage(buf, size), 0);
+  // stack grows down from buf + size
+  memset(buf + size - 1000, 1, 1000);
+  EXPECT_EQ(Sylar::StackProfiler::MeasureUsage(buf, size), 1000);
+  buf[0] = 1;
+  EXPECT_EQ(Sylar::StackProfiler::MeasureUsage(buf, size), size);
+}
+
+static void __attribute__((noinline)) TouchStack() {
+  char buf[16 * 1024];
+  memset(buf, 1, sizeof(buf));
+  asm volatile("" : : "r"(buf) : "memory");
+}
+
+// coroutines are created at one of the two sites
+static Sylar::Coroutine::ptr RunTouchStack(Sylar::CoroutineAttr::ptr attr,
+                                           bool pooled) {
+  Sylar::Coroutine::ptr co;
+  if (pooled) {
+    co = Sylar::CoroutinePool::GetThreadPool()->Acquire(attr, &TouchStack);
+  } else {
+    co = Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, &TouchStack);
+  }
+  co->Resume();
+  return co;
+}
+
+TEST(StackProfiler, AutoStackSize) {
+  Sylar::StackProfiler::Clear();
+  uint64_t min_samples = Sylar::StackProfiler::GetMinSamples();
+  Sylar::StackProfiler::SetMinSamples(4);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  attr->stack_size_ = 256 * 1024;
+  attr->auto_stack_size_ = true;
+  for (bool pooled : {false, true}) {
+    for (int i = 0; i < 4; i++) {
+      auto co = RunTouchStack(attr, pooled);
+      EXPECT_EQ(co->GetStackSize(), 256 * 1024);
+    }
+  }
+  auto stats = Sylar::StackProfiler::GetStats();
+  ASSERT_EQ(stats.size(), 2);
+  for (auto &site : stats) {
+    EXPECT_EQ(site.samples_, 4);
+    EXPECT_GE(site.max_used_, 16 * 1024);
+    EXPECT_LT(site.max_used_, 64 * 1024);
+    EXPECT_GT(site.recommended_, site.max_used_);
+    EXPECT_LT(site.recommended_, 256 * 1024);
+  }
+  EXPECT_NE(Sylar::StackProfiler::Dump().find("samples=4"), std::string::npos);
+
+  // later coroutines of the sites use the smaller stack and keep measuring
+  for (bool pooled : {false, true}) {
+    auto co = RunTouchStack(attr, pooled);
+    EXPECT_TRUE(co->GetStackSize() == stats[0].recommended_ ||
+                co->GetStackSize() == stats[1].recommended_);
+    EXPECT_LT(co->GetStackSize(), 256 * 1024);
+  }
+  for (auto &site : Sylar::StackProfiler::GetStats()) {
+    EXPECT_EQ(site.samples_, 5);
+  }
+
+  // never grows beyond the configured size
+  EXPECT_EQ(Sylar::StackProfiler::PickStackSize(stats[0].site_, 8 * 1024),
+            8 * 1024);
+  Sylar::StackProfiler::SetMinSamples(min_samples);
+  Sylar::StackProfiler::Clear();
+}
@@ -0,0 +1,189 @@
+#include "../src/include/iomanager.hh"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+TEST(WorkStealingQueue, PushPopSteal) {
+  Sylar::WorkStealingQueue<int *> q(4);
+  std::vector<int> vals(100);
+  for (int i = 0; i < 100; i++) {
+    vals[i] = i;
+    q.Push(&vals[i]);
+  }
+  EXPECT_EQ(q.Size(), 100);
+  EXPECT_GE(q.Capacity(), 100);
+
+  int *item = nullptr;
+  // owner pops the newest one, thief steals the oldest one
+  ASSERT_TRUE(q.Pop(item));
+  EXPECT_EQ(*item, 99);
+  ASSERT_TRUE(q.Steal(item));
+  EXPECT_EQ(*item, 0);
+
+  int cnt = 0;
+  while (q.Pop(item)) {
+    cnt++;
+  }
+  EXPECT_EQ(cnt, 98);
+  EXPECT_TRUE(q.Empty());
+  EXPECT_FALSE(q.Steal(item));
+}
+
+TEST(WorkStealingQueue, ConcurrentSteal) {
+  const int N = 200000;
+  Sylar::WorkStealingQueue<int *> q(64);
+  std::vector<int> vals(N, 0);
+  std::vector<std::atomic<int>> seen(N);
+  for (auto &v : seen) {
+    v = 0;
+  }
+  std::atomic<bool> done(false);
+  std::atomic<int> stolen(0);
+
+  std::vector<std::thread> thieves;
+  for (int t = 0; t < 3; t++) {
+    thieves.emplace_back([&]() {
+      int *item = nullptr;
+      while (!done.load() || !q.Empty()) {
+        if (q.Steal(item)) {
+          seen[item - vals.data()]++;
+          stolen++;
+        }
+      }
+    });
+  }
+
+  int *item = nullptr;
+  for (int i = 0; i < N; i++) {
+    q.Push(&vals[i]);
+    if (i % 3 == 0 && q.Pop(item)) {
+      seen[item - vals.data()]++;
+    }
+  }
+  while (q.Pop(item)) {
+    seen[item - vals.data()]++;
+  }
+  done = true;
+  for (auto &t : thieves) {
+    t.join();
+  }
+
+  // every item is taken exactly once
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(seen[i].load(), 1) << "item: " << i;
+  }
+  std::cout << "stolen: " << stolen.load() << std::endl;
+}
+
+TEST(IOManager, ScheduleFunction) {
+  EXPECT_EQ(Sylar::IOManager::GetThis(), nullptr);
+  EXPECT_EQ(Sylar::IOManager::GetWorkerIndex(), -1);
+
+  const int N = 10000;
+  std::atomic<int> cnt(0);
+  std::atomic<int> in_worker(0);
+  Sylar::IOManager iom(4, "test");
+  iom.Start();
+  for (int i = 0; i < N; i++) {
+    iom.Schedule([&]() {
+      if (Sylar::IOManager::GetThis() == &iom &&
+          Sylar::IOManager::GetWorkerIndex() >= 0) {
+        in_worker++;
+      }
+      cnt++;
+    });
+  }
+  iom.Stop();
+  EXPECT_EQ(cnt.load(), N);
+  EXPECT_EQ(in_worker.load(), N);
+  EXPECT_EQ(iom.GetStats().executed_, N);
+}
+
+TEST(IOManager, ScheduleInWorker) {
+  // every task spawns two children until depth reaches 10, tasks are pushed
+  // into run queue of worker and balanced by stealing
+  std::atomic<int> cnt(0);
+  Sylar::IOManager iom(4, "spawn");
+  std::function<void(int)> spawn = [&](int depth) {
+    cnt++;
+    if (depth < 10) {
+      Sylar::IOManager::GetThis()->Schedule(std::bind(spawn, depth + 1));
+      Sylar::IOManager::GetThis()->Schedule(std::bind(spawn, depth + 1));
+    }
+  };
+  iom.Start();
+  iom.Schedule(std::bind(spawn, 0));
+  iom.Stop();
+  EXPECT_EQ(cnt.load(), (1 << 11) - 1);
+  auto stats = iom.GetStats();
+  std::cout << "executed: " << stats.executed_ << ", stolen: " << stats.stolen_
+            << ", parked: " << stats.parked_ << std::endl;
+}
+
+TEST(IOManager, ScheduleCoroutine) {
+  const int N = 100;
+  std::atomic<int> cnt(0);
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  std::vector<Sylar::Coroutine::ptr> cos;
+  for (int i = 0; i < N; i++) {
+    cos.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [&]() {
+          for (int j = 0; j < 3; j++) {
+            cnt++;
+            Sylar::IOManager::YieldToQueue();
+          }
+          cnt++;
+        }));
+  }
+
+  Sylar::IOManager iom(2, "coroutine");
+  iom.Start();
+  for (auto &co : cos) {
+    iom.Schedule(co);
+  }
+  iom.Stop();
+  EXPECT_EQ(cnt.load(), N * 4);
+  for (auto &co : cos) {
+    EXPECT_EQ(co->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  }
+}
+
+TEST(IOManager, HookedSleep) {
+  // tasks suspended by hooked usleep don't block worker, they are resumed by
+  // the timer of worker epoll
+  const int N = 100;
+  std::atomic<int> cnt(0);
+  Sylar::IOManager iom(2, "sleep");
+  iom.Start();
+  auto st = std::chrono::steady_clock::now();
+  for (int i = 0; i < N; i++) {
+    iom.Schedule([&]() {
+      usleep(50 * 1000);
+      cnt++;
+    });
+  }
+  iom.Stop();
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - st)
+                .count();
+  EXPECT_EQ(cnt.load(), N);
+  // sleeping sequentially costs 5 seconds
+  EXPECT_LT(ms, 2000);
+  std::cout << "elapse: " << ms << " ms" << std::endl;
+}
+
+TEST(IOManager, StopWithoutStart) {
+  std::atomic<int> cnt(0);
+  {
+    Sylar::IOManager iom(2);
+    iom.Schedule([&]() { cnt++; });
+    iom.Stop();
+  }
+  EXPECT_EQ(cnt.load(), 0);
+}
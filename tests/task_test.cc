@@ -0,0 +1,221 @@
+#include "../src/include/task.hh"
+#include <chrono>
+#include <gtest/gtest.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+Sylar::Task<int> Add(int a, int b) {
+  co_await Sylar::Sleep(1);
+  co_return a + b;
+}
+
+Sylar::Task<int> Sum(int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum = co_await Add(sum, i);
+  }
+  co_return sum;
+}
+
+Sylar::Task<int> Identity(int v) { co_return v; }
+
+Sylar::Task<int> DeepChain(int depth) {
+  if (depth == 0) {
+    co_return 0;
+  }
+  // every level finishes synchronously and resumes its awaiter
+  co_return co_await DeepChain(depth - 1) + co_await Identity(1);
+}
+
+Sylar::Task<> Throw() {
+  co_await Sylar::Sleep(1);
+  throw std::runtime_error("task error");
+}
+
+TEST(Task, AwaitResult) {
+  EXPECT_EQ(Sylar::Await(Sum(10)), 45);
+  EXPECT_EQ(Sylar::Await(DeepChain(1000)), 1000);
+
+  // lazy, nothing runs until it's awaited
+  auto task = Identity(7);
+  EXPECT_FALSE(task.IsDone());
+  EXPECT_EQ(Sylar::Await(std::move(task)), 7);
+}
+
+TEST(Task, Exception) {
+  EXPECT_THROW(Sylar::Await(Throw()), std::runtime_error);
+}
+
+TEST(Task, Sleep) {
+  const int N = 1000;
+  int done = 0;
+  auto st = std::chrono::steady_clock::now();
+  auto sleeper = [](int &done) -> Sylar::Task<> {
+    co_await Sylar::Sleep(50);
+    done++;
+  };
+  for (int i = 0; i < N; i++) {
+    Sylar::Spawn(sleeper(done));
+  }
+  EXPECT_EQ(done, 0);
+  while (done < N) {
+    Sylar::Schedule::EventloopOnce(Sylar::Epoll::GetThreadEpoll(), 100);
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - st)
+                .count();
+  EXPECT_GE(ms, 49);
+  EXPECT_LT(ms, 1000);
+}
+
+TEST(Task, DestroyWhileSuspended) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int resumed = 0;
+  auto sleeper = [](int &resumed) -> Sylar::Task<> {
+    co_await Sylar::Sleep(10);
+    resumed++;
+  };
+  auto reader = [](int fd, int &resumed) -> Sylar::Task<> {
+    co_await Sylar::Readable(fd);
+    resumed++;
+  };
+  // started by a detached task, which never finishes since they are gone
+  auto waiter = [](Sylar::Task<> &task) -> Sylar::Task<> {
+    co_await task.WhenDone();
+  };
+  std::optional<Sylar::Task<>> sleep_task(sleeper(resumed));
+  std::optional<Sylar::Task<>> read_task(reader(fds[0], resumed));
+  Sylar::Spawn(waiter(*sleep_task));
+  Sylar::Spawn(waiter(*read_task));
+  EXPECT_FALSE(sleep_task->IsDone());
+  EXPECT_FALSE(read_task->IsDone());
+  // the timer and the event are cancelled with the frames
+  sleep_task.reset();
+  read_task.reset();
+  write(fds[1], "x", 1);
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  auto ed = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+  while (std::chrono::steady_clock::now() < ed) {
+    Sylar::Schedule::EventloopOnce(epoll, 10);
+  }
+  EXPECT_EQ(resumed, 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+Sylar::Task<std::string> Echo(int fd) {
+  char buf[64];
+  ssize_t n = co_await Sylar::AsyncRead(fd, buf, sizeof(buf));
+  if (n <= 0) {
+    co_return "";
+  }
+  co_await Sylar::AsyncWrite(fd, buf, n);
+  co_return std::string(buf, n);
+}
+
+TEST(Task, ReadWrite) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  std::thread peer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    write_f(fds[1], "hello", 5);
+    char buf[8] = {0};
+    read_f(fds[1], buf, sizeof(buf));
+    EXPECT_EQ(std::string(buf), "hello");
+  });
+  EXPECT_EQ(Sylar::Await(Echo(fds[0])), "hello");
+  peer.join();
+  close_f(fds[0]);
+  close_f(fds[1]);
+}
+
+TEST(Task, ReaderAndWriterOnSameFd) {
+  // the reader waits on fds[0] while the writer fills and drains it, one must
+  // not override the registration of the other
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int rcvbuf = 4096;
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  bool read_done = false;
+  bool write_done = false;
+  auto reader = [&]() -> Sylar::Task<> {
+    char c;
+    EXPECT_EQ(co_await Sylar::AsyncRead(fds[0], &c, 1), 1);
+    EXPECT_EQ(c, 'x');
+    read_done = true;
+  };
+  auto writer = [&]() -> Sylar::Task<> {
+    std::vector<char> buf(1 << 20, 'a');
+    size_t left = buf.size();
+    while (left > 0) {
+      ssize_t n = co_await Sylar::AsyncWrite(fds[0], buf.data(), left);
+      if (n <= 0) {
+        ADD_FAILURE() << "write error: " << errno;
+        break;
+      }
+      left -= n;
+    }
+    write_done = true;
+  };
+  Sylar::Spawn(reader());
+  Sylar::Spawn(writer());
+  std::thread peer([&]() {
+    std::vector<char> buf(1 << 20);
+    size_t total = 0;
+    while (total < buf.size()) {
+      ssize_t n = read_f(fds[1], buf.data(), buf.size() - total);
+      ASSERT_GT(n, 0);
+      total += n;
+    }
+    write_f(fds[1], "x", 1);
+  });
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  while (!read_done || !write_done) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  peer.join();
+  close_f(fds[0]);
+  close_f(fds[1]);
+}
+
+TEST(Task, StackfulInterop) {
+  // stackful coroutines wait for tasks while other coroutines keep running
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  int finished = 0;
+  int ticks = 0;
+  std::vector<Sylar::Coroutine::ptr> cos;
+  for (int i = 0; i < 4; i++) {
+    cos.push_back(Sylar::Coroutine::CreateCoroutine(
+        Sylar::Schedule::GetThreadSchedule(), attr, [&finished, i]() {
+          EXPECT_EQ(Sylar::Await(Add(i, 1)), i + 1);
+          EXPECT_EQ(Sylar::Await(Sum(5)), 10);
+          finished++;
+        }));
+  }
+  auto ticker = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, [&ticks, &finished]() {
+        while (finished < 4) {
+          ticks++;
+          usleep(1000);
+        }
+      });
+  for (auto &co : cos) {
+    co->Resume();
+  }
+  ticker->Resume();
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  while (finished < 4 ||
+         ticker->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+  EXPECT_GT(ticks, 0);
+  for (auto &co : cos) {
+    EXPECT_EQ(co->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+  }
+}
@@ -0,0 +1,106 @@
+#include "../src/include/timewheel.hh"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// micro benchmark of timers, usage:
+//  ./timewheel_bench [timers] [churn]
+//
+// keep the given number of connection-idle timers(1M by default) outstanding,
+// which expire in 30s~90s. then simulate activity on random connections, each
+// of them cancels the idle timer and adds a new one, and measure the timer
+// work of an idle event loop. at last, let 1M short timers expire in one call
+// of ExecuteTimeout, by separate callbacks and by a TimerGroup with slack
+
+double NowNS() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t cnt = argc > 1 ? std::stoull(argv[1]) : 1000000;
+  size_t churn = argc > 2 ? std::stoull(argv[2]) : 5000000;
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<uint64_t> idle(30000, 90000);
+  Sylar::TimeWheel tw;
+  uint64_t fired = 0;
+
+  // the type of handle differs between versions of TimeWheel
+  std::vector<decltype(tw.AddTimer(0, nullptr))> handles(cnt);
+  double st = NowNS();
+  for (size_t i = 0; i < cnt; i++) {
+    handles[i] = tw.AddTimer(idle(rng), [&fired]() { fired++; });
+  }
+  double ed = NowNS();
+  std::cout << "[add] timers: " << cnt << ", per timer: " << (ed - st) / cnt
+            << " ns" << std::endl;
+
+  std::uniform_int_distribution<size_t> pick(0, cnt - 1);
+  st = NowNS();
+  for (size_t i = 0; i < churn; i++) {
+    size_t conn = pick(rng);
+    tw.CancelTimer(handles[conn]);
+    handles[conn] = tw.AddTimer(idle(rng), [&fired]() { fired++; });
+    if ((i & 1023) == 0) {
+      tw.ExecuteTimeout(Sylar::GetElapseFromRebootMS());
+      tw.GetNextTimeout(Sylar::GetElapseFromRebootMS());
+    }
+  }
+  ed = NowNS();
+  std::cout << "[churn] outstanding: " << cnt << ", ops: " << churn
+            << ", per cancel and re-add: " << (ed - st) / churn << " ns"
+            << std::endl;
+
+  // what an idle event loop does in each iteration
+  const int kQueries = 1000000;
+  uint64_t sum = 0;
+  st = NowNS();
+  for (int i = 0; i < kQueries; i++) {
+    uint64_t now = Sylar::GetElapseFromRebootMS();
+    tw.ExecuteTimeout(now);
+    sum += tw.GetNextTimeout(now);
+  }
+  ed = NowNS();
+  std::cout << "[next timeout] outstanding: " << cnt
+            << ", per iteration: " << (ed - st) / kQueries << " ns"
+            << (sum == 0 ? " " : "") << std::endl;
+
+  for (auto &handle : handles) {
+    tw.CancelTimer(handle);
+  }
+  std::uniform_int_distribution<uint64_t> short_delay(0, 999);
+  for (size_t i = 0; i < cnt; i++) {
+    tw.AddTimer(short_delay(rng), [&fired]() { fired++; });
+  }
+  fired = 0;
+  st = NowNS();
+  tw.ExecuteTimeout(Sylar::GetElapseFromRebootMS() + 2000);
+  ed = NowNS();
+  std::cout << "[expire] timers: " << fired << ", per timer: "
+            << (ed - st) / fired << " ns" << std::endl;
+
+  // the same timers in a group with 64ms slack, expired in bulk
+  uint64_t batches = 0;
+  fired = 0;
+  Sylar::TimerGroup group([&](std::vector<uint64_t> &batch) {
+    batches++;
+    fired += batch.size();
+  });
+  st = NowNS();
+  for (size_t i = 0; i < cnt; i++) {
+    tw.AddGroupTimer(short_delay(rng), &group, i, 64);
+  }
+  ed = NowNS();
+  std::cout << "[group add] timers: " << cnt
+            << ", per timer: " << (ed - st) / cnt << " ns" << std::endl;
+  // the wheel is 2s ahead of clock after the last expiry
+  st = NowNS();
+  tw.ExecuteTimeout(Sylar::GetElapseFromRebootMS() + 4000);
+  ed = NowNS();
+  std::cout << "[group expire] timers: " << fired << ", batches: " << batches
+            << ", per timer: " << (ed - st) / fired << " ns" << std::endl;
+  return 0;
+}
@@ -21,3 +21,189 @@ TEST(Timewheel, Basic) {
   tw->ExecuteTimeout(15);
   std::cout << tw->Dump() << std::endl;
 }
+
+TEST(Timewheel, CancelTimer) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(10, 1);
+  int fired = 0;
+  Sylar::TimerHandle self;
+  auto a = tw->AddTimer(3, [&]() { fired++; });
+  auto b = tw->AddTimer(3, [&]() { fired += 10; });
+  // a repeating timer cancels itself in its callback
+  auto c = tw->AddTimer(2, [&]() {
+    fired += 100;
+    EXPECT_TRUE(tw->CancelTimer(self));
+  }, nullptr, -1);
+  self = c;
+  EXPECT_TRUE(tw->CancelTimer(b));
+  EXPECT_FALSE(tw->CancelTimer(b));
+
+  tw->ExecuteTimeout(Sylar::GetElapseFromRebootMS() + 100);
+  EXPECT_EQ(fired, 101);
+  EXPECT_FALSE(tw->CancelTimer(a));
+  EXPECT_FALSE(tw->CancelTimer(c));
+}
+
+TEST(Timewheel, RepeatInterval) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(10, 1);
+  auto st = Sylar::GetElapseFromRebootMS();
+  int fired = 0;
+  tw->AddTimer(3, [&]() { fired++; }, nullptr, -1);
+  // triggered every 3 ticks, rather than once a round of wheel
+  tw->ExecuteTimeout(st + 31);
+  EXPECT_GE(fired, 9);
+  EXPECT_LE(fired, 11);
+}
+
+TEST(Timewheel, Cascade) {
+  // 8 slots each level, so the timers below span several levels
+  auto tw = std::make_shared<Sylar::TimeWheel>(8, 1);
+  uint64_t base = Sylar::GetElapseFromRebootMS() + 1000;
+  tw->ExecuteTimeout(base);
+  std::vector<uint64_t> delays = {0,  1,  7,   8,   9,    63,
+                                  64, 65, 511, 512, 4095, 9999};
+  std::vector<uint64_t> fired_at(delays.size(), 0);
+  uint64_t now = base;
+  for (size_t i = 0; i < delays.size(); i++) {
+    tw->AddTimer(delays[i], [&, i]() { fired_at[i] = now; });
+  }
+  auto cancelled = tw->AddTimer(5000, [&]() { ADD_FAILURE(); });
+  EXPECT_EQ(tw->GetTimerCount(), delays.size() + 1);
+  EXPECT_EQ(tw->GetNextTimeout(base), 1);
+  EXPECT_TRUE(tw->CancelTimer(cancelled));
+  for (now = base + 1; now <= base + 10000; now++) {
+    tw->ExecuteTimeout(now);
+  }
+  // each one is triggered by the first call after its tick ends
+  for (size_t i = 0; i < delays.size(); i++) {
+    EXPECT_EQ(fired_at[i], base + delays[i] + 1) << "delay " << delays[i];
+  }
+  EXPECT_EQ(tw->GetTimerCount(), 0);
+  EXPECT_EQ(tw->GetNextTimeout(now), Sylar::TimeWheel::kNoTimeout);
+}
+
+TEST(Timewheel, StaleHandle) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(10, 1);
+  int fired = 0;
+  auto a = tw->AddTimer(1, [&]() { fired++; });
+  EXPECT_TRUE(tw->CancelTimer(a));
+  // the item of a is recycled by b, cancelling a must not affect b
+  auto b = tw->AddTimer(1, [&]() { fired += 10; });
+  EXPECT_FALSE(tw->CancelTimer(a));
+  tw->ExecuteTimeout(Sylar::GetElapseFromRebootMS() + 100);
+  EXPECT_EQ(fired, 10);
+  EXPECT_FALSE(tw->CancelTimer(b));
+  EXPECT_FALSE(tw->CancelTimer(Sylar::TimerHandle()));
+}
+
+TEST(Timewheel, NextTimeout) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(8, 1);
+  uint64_t base = Sylar::GetElapseFromRebootMS() + 1000;
+  tw->ExecuteTimeout(base);
+  EXPECT_EQ(tw->GetNextTimeout(base), Sylar::TimeWheel::kNoTimeout);
+  // exact for timers waiting in higher levels
+  auto far = tw->AddTimer(5000, []() {});
+  auto near = tw->AddTimer(100, []() {});
+  auto same_slot = tw->AddTimer(4990, []() {});
+  EXPECT_EQ(tw->GetNextTimeout(base), 101);
+  EXPECT_TRUE(tw->CancelTimer(near));
+  EXPECT_EQ(tw->GetNextTimeout(base), 4991);
+  EXPECT_EQ(tw->GetNextTimeout(base + 4000), 991);
+  EXPECT_TRUE(tw->CancelTimer(same_slot));
+  EXPECT_EQ(tw->GetNextTimeout(base), 5001);
+  // due timers are reported as 0 rather than empty
+  EXPECT_EQ(tw->GetNextTimeout(base + 6000), 0);
+  tw->ExecuteTimeout(base + 4000);
+  EXPECT_EQ(tw->GetNextTimeout(base + 4000), 1001);
+  tw->ExecuteTimeout(base + 5001);
+  EXPECT_FALSE(tw->CancelTimer(far));
+  EXPECT_EQ(tw->GetNextTimeout(base + 5001), Sylar::TimeWheel::kNoTimeout);
+}
+
+TEST(Timewheel, Microsecond) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(16, 1);
+  tw->SetGranularityUS(100);
+  EXPECT_EQ(tw->GetGranularityUS(), 100);
+  uint64_t base = Sylar::GetElapseFromRebootUS() + 1000 * 1000;
+  tw->ExecuteTimeoutUS(base);
+  int fired = 0;
+  tw->AddTimerUS(250, [&]() { fired++; });
+  // 2 ticks after the current one, which ends within 100us
+  uint64_t next = tw->GetNextTimeoutUS(base);
+  EXPECT_GT(next, 200);
+  EXPECT_LE(next, 300);
+  // rounded up in milliseconds
+  EXPECT_EQ(tw->GetNextTimeout(base / 1000),
+            (tw->GetNextTimeoutUS(base / 1000 * 1000) + 999) / 1000);
+  tw->ExecuteTimeoutUS(base + next - 1);
+  EXPECT_EQ(fired, 0);
+  tw->ExecuteTimeoutUS(base + next);
+  EXPECT_EQ(fired, 1);
+}
+
+TEST(Timewheel, Slack) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(16, 1);
+  uint64_t base = Sylar::GetElapseFromRebootMS() + 1000;
+  tw->ExecuteTimeout(base);
+  const int N = 64;
+  std::vector<uint64_t> fired(N, 0);
+  uint64_t now = base;
+  for (int i = 0; i < N; i++) {
+    tw->AddTimer(100 + i, [&fired, &now, i]() { fired[i] = now; }, nullptr, 1,
+                 32);
+  }
+  // timers within the slack of each other share a tick
+  int wakeups = 0;
+  while (tw->GetTimerCount() > 0) {
+    now += tw->GetNextTimeout(now);
+    tw->ExecuteTimeout(now);
+    wakeups++;
+  }
+  EXPECT_LE(wakeups, 3);
+  for (int i = 0; i < N; i++) {
+    // never earlier than requested, and late by less than the slack
+    EXPECT_GE(fired[i], base + 100 + i);
+    EXPECT_LT(fired[i], base + 100 + i + 32 + 1);
+  }
+}
+
+TEST(Timewheel, Group) {
+  auto tw = std::make_shared<Sylar::TimeWheel>(16, 1);
+  uint64_t base = Sylar::GetElapseFromRebootMS() + 1000;
+  tw->ExecuteTimeout(base);
+  int calls = 0;
+  std::vector<int> expired(1000, 0);
+  Sylar::TimerGroup group([&](std::vector<uint64_t> &batch) {
+    calls++;
+    for (auto data : batch) {
+      expired[data]++;
+    }
+  });
+  std::vector<Sylar::TimerHandle> handles;
+  for (int i = 0; i < 1000; i++) {
+    handles.push_back(tw->AddGroupTimer(i % 10, &group, i));
+  }
+  // the cancelled ones are never passed to group
+  for (int i = 0; i < 1000; i += 7) {
+    EXPECT_TRUE(tw->CancelTimer(handles[i]));
+  }
+  tw->ExecuteTimeout(base + 100);
+  // a call per tick, rather than per timer
+  EXPECT_EQ(calls, 10);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(expired[i], i % 7 == 0 ? 0 : 1);
+  }
+  EXPECT_FALSE(tw->CancelTimer(handles[1]));
+  EXPECT_EQ(tw->GetTimerCount(), 0);
+
+  // the callback can add timers of its group again
+  calls = 0;
+  Sylar::TimerGroup again([&](std::vector<uint64_t> &batch) {
+    if (++calls < 3) {
+      tw->AddGroupTimer(1, &again, batch.size());
+    }
+  });
+  tw->AddGroupTimer(1, &again, 0);
+  tw->ExecuteTimeout(base + 200);
+  EXPECT_EQ(calls, 3);
+  EXPECT_EQ(tw->GetTimerCount(), 0);
+}
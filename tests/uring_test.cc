@@ -0,0 +1,261 @@
+#include "../src/include/coroutine.hh"
+#include "../src/include/epoll.hh"
+#include "../src/include/hook.hh"
+#include "../src/include/uring.hh"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+static void RunUntilTerminal(const std::vector<Sylar::Coroutine::ptr> &cos) {
+  auto epoll = Sylar::Epoll::GetThreadEpoll();
+  auto done = [&]() {
+    for (auto &co : cos) {
+      if (co->GetCoState() != Sylar::Coroutine::CO_TERMINAL) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (!done()) {
+    Sylar::Schedule::EventloopOnce(epoll, 100);
+  }
+}
+
+static Sylar::Coroutine::ptr Go(std::function<void()> func) {
+  auto attr = std::make_shared<Sylar::CoroutineAttr>();
+  auto co = Sylar::Coroutine::CreateCoroutine(
+      Sylar::Schedule::GetThreadSchedule(), attr, std::move(func));
+  co->Resume();
+  return co;
+}
+
+#define SKIP_IF_UNSUPPORTED()                                                  \
+  if (!Sylar::IoUring::IsSupported()) {                                        \
+    GTEST_SKIP() << "io_uring is not supported, hooked I/O uses epoll";        \
+  }
+
+TEST(IoUring, PingPong) {
+  SKIP_IF_UNSUPPORTED();
+  Sylar::SetHookEnable(true);
+  Sylar::IoUring::SetEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  const int N = 1000;
+  int pongs = 0;
+  auto pong = Go([&]() {
+    char c;
+    while (read(fds[1], &c, 1) == 1) {
+      write(fds[1], &c, 1);
+      pongs++;
+    }
+  });
+  auto ring = Sylar::IoUring::GetThreadRing();
+  auto before = ring->GetStats();
+  auto ping = Go([&]() {
+    char c = 'x';
+    for (int i = 0; i < N; i++) {
+      ASSERT_EQ(write(fds[0], &c, 1), 1);
+      ASSERT_EQ(read(fds[0], &c, 1), 1);
+    }
+    shutdown(fds[0], SHUT_WR);
+  });
+  RunUntilTerminal({ping, pong});
+  EXPECT_EQ(pongs, N);
+  auto after = ring->GetStats();
+  // every read and write completes in the ring, none of them retries by epoll
+  EXPECT_GE(after.complete_ - before.complete_, 4ull * N);
+  EXPECT_LE(after.enter_ - before.enter_, after.submit_ - before.submit_);
+  Sylar::IoUring::SetEnable(false);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoUring, Deadline) {
+  SKIP_IF_UNSUPPORTED();
+  Sylar::SetHookEnable(true);
+  Sylar::IoUring::SetEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ssize_t ret = 0;
+  int err = 0;
+  uint64_t elapse = 0;
+  auto co = Go([&]() {
+    auto st = Sylar::GetElapseFromRebootMS();
+    Sylar::Schedule::GetCurrentCo()->SetDeadline(st + 50);
+    char buf[8];
+    ret = read(fds[0], buf, sizeof(buf));
+    err = errno;
+    elapse = Sylar::GetElapseFromRebootMS() - st;
+  });
+  RunUntilTerminal({co});
+  EXPECT_EQ(ret, -1);
+  EXPECT_EQ(err, ETIMEDOUT);
+  EXPECT_GE(elapse, 49);
+  EXPECT_LT(elapse, 1000);
+
+  // the linked timeout is removed by kernel when the operation completes
+  ret = 0;
+  co = Go([&]() {
+    auto self = Sylar::Schedule::GetCurrentCo();
+    self->SetDeadline(Sylar::GetElapseFromRebootMS() + 1000);
+    char buf[8];
+    ret = read(fds[0], buf, sizeof(buf));
+  });
+  write_f(fds[1], "ping", 4);
+  RunUntilTerminal({co});
+  EXPECT_EQ(ret, 4);
+  Sylar::IoUring::SetEnable(false);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoUring, Cancel) {
+  SKIP_IF_UNSUPPORTED();
+  Sylar::SetHookEnable(true);
+  Sylar::IoUring::SetEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ssize_t ret = 0;
+  int err = 0;
+  auto reader = Go([&]() {
+    char buf[8];
+    ret = read(fds[0], buf, sizeof(buf));
+    err = errno;
+  });
+  std::thread t([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    reader->Cancel();
+  });
+  auto st = Sylar::GetElapseFromRebootMS();
+  RunUntilTerminal({reader});
+  t.join();
+  EXPECT_LT(Sylar::GetElapseFromRebootMS() - st, 1000);
+  EXPECT_EQ(ret, -1);
+  EXPECT_EQ(err, ECANCELED);
+
+  // the buffer is released by kernel, data written later is kept in socket
+  write_f(fds[1], "late", 4);
+  char buf[8] = {0};
+  EXPECT_EQ(read_f(fds[0], buf, sizeof(buf)), 4);
+  EXPECT_EQ(std::string(buf), "late");
+  Sylar::IoUring::SetEnable(false);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(IoUring, CloseCancelsPending) {
+  SKIP_IF_UNSUPPORTED();
+  Sylar::SetHookEnable(true);
+  Sylar::IoUring::SetEnable(true);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  ssize_t ret = 0;
+  int err = 0;
+  auto reader = Go([&]() {
+    char buf[8];
+    ret = read(fds[0], buf, sizeof(buf));
+    err = errno;
+  });
+  // make sure the read is submitted before closing
+  Sylar::Epoll::GetThreadEpoll()->FlushChanges();
+  close(fds[0]);
+  RunUntilTerminal({reader});
+  EXPECT_EQ(ret, -1);
+  EXPECT_EQ(err, ECANCELED);
+  // the file is released once the read is cancelled, the peer sees EOF
+  char c;
+  EXPECT_EQ(read_f(fds[1], &c, 1), 0);
+  Sylar::IoUring::SetEnable(false);
+  close(fds[1]);
+}
+
+TEST(IoUring, AcceptConnect) {
+  SKIP_IF_UNSUPPORTED();
+  Sylar::SetHookEnable(true);
+  Sylar::IoUring::SetEnable(true);
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listen_fd, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(listen_fd, (sockaddr *)&addr, sizeof(addr)), 0);
+  socklen_t len = sizeof(addr);
+  getsockname(listen_fd, (sockaddr *)&addr, &len);
+  ASSERT_EQ(listen(listen_fd, 16), 0);
+
+  std::string received;
+  auto server = Go([&]() {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    ASSERT_GE(fd, 0);
+    char buf[16];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      received.assign(buf, n);
+    }
+    close(fd);
+  });
+  int connect_ret = -1;
+  auto client = Go([&]() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    connect_ret = connect(fd, (sockaddr *)&addr, sizeof(addr));
+    send(fd, "hello", 5, 0);
+    close(fd);
+  });
+  RunUntilTerminal({server, client});
+  EXPECT_EQ(connect_ret, 0);
+  EXPECT_EQ(received, "hello");
+  Sylar::IoUring::SetEnable(false);
+  close(listen_fd);
+}
+
+TEST(IoUring, RegisteredBuffers) {
+  SKIP_IF_UNSUPPORTED();
+  auto ring = Sylar::IoUring::GetThreadRing();
+  if (!ring->RegisterBuffers(2, 4096)) {
+    GTEST_SKIP() << "buffers cannot be registered, e.g. by RLIMIT_MEMLOCK";
+  }
+  int fds[2];
+  ASSERT_EQ(socketpair_f(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int widx = ring->AcquireBuffer();
+  int ridx = ring->AcquireBuffer();
+  ASSERT_GE(widx, 0);
+  ASSERT_GE(ridx, 0);
+  EXPECT_EQ(ring->AcquireBuffer(), -1);
+  ssize_t nread = 0;
+  auto reader = Go([&]() { nread = ring->ReadFixed(fds[1], ridx, 4096); });
+  memcpy(ring->GetBuffer(widx), "fixed", 5);
+  ssize_t nwrite = 0;
+  auto writer = Go([&]() { nwrite = ring->WriteFixed(fds[0], widx, 5); });
+  RunUntilTerminal({reader, writer});
+  EXPECT_EQ(nwrite, 5);
+  ASSERT_EQ(nread, 5);
+  EXPECT_EQ(std::string(ring->GetBuffer(ridx), 5), "fixed");
+  ring->ReleaseBuffer(widx);
+  ring->ReleaseBuffer(ridx);
+  close_f(fds[0]);
+  close_f(fds[1]);
+}
+
+TEST(IoUring, MainCoroutine) {
+  SKIP_IF_UNSUPPORTED();
+  // the main coroutine waits in kernel, coroutines completed meanwhile are
+  // resumed
+  auto ring = Sylar::IoUring::GetThreadRing();
+  bool woken = false;
+  auto co = Go([&]() {
+    EXPECT_EQ(ring->Sleep(10), 0);
+    woken = true;
+  });
+  auto st = Sylar::GetElapseFromRebootMS();
+  EXPECT_EQ(ring->Sleep(50), 0);
+  EXPECT_GE(Sylar::GetElapseFromRebootMS() - st, 49);
+  EXPECT_TRUE(woken);
+  EXPECT_EQ(co->GetCoState(), Sylar::Coroutine::CO_TERMINAL);
+}
@@ -1,7 +1,65 @@
 #include "../src/include/util.hh"
+#include <ctime>
 #include <gtest/gtest.h>
+#include <thread>
 
 TEST(Util, Backtrace) {
   std::cout << Sylar::BacktraceToString(100, 2) << std::endl;
   std::cout << Sylar::GetElapseFromRebootMS() << std::endl;
-}
\ No newline at end of file
+}
+
+TEST(Util, Clock) {
+  uint64_t ms = Sylar::GetElapseFromRebootMS();
+  uint64_t us = Sylar::GetElapseFromRebootUS();
+  uint64_t ns = Sylar::GetElapseFromRebootNS();
+  // the same clock in different units
+  EXPECT_GE(us / 1000, ms);
+  EXPECT_LT(us / 1000 - ms, 100);
+  EXPECT_GE(ns / 1000, us);
+  EXPECT_LT(ns / 1000 - us, 100 * 1000);
+}
+
+TEST(Util, CachedClock) {
+  uint64_t cached = Sylar::Clock::Refresh();
+  usleep(2000);
+  // callbacks of one iteration read the same time
+  EXPECT_EQ(Sylar::Clock::NowUS(), cached);
+  EXPECT_EQ(Sylar::Clock::NowMS(), cached / 1000);
+  EXPECT_LE(Sylar::Clock::WallTime() - std::time(nullptr), 1);
+  Sylar::Clock::Release();
+  EXPECT_GE(Sylar::Clock::NowUS(), cached + 2000);
+  EXPECT_GE(Sylar::Clock::NowUS(), Sylar::GetElapseFromRebootUS() - 100);
+}
+
+TEST(Util, TscClock) {
+  if (!Sylar::Clock::SetTscEnable(true)) {
+    GTEST_SKIP() << "the cycle counter isn't invariant";
+  }
+  EXPECT_TRUE(Sylar::Clock::IsTscEnabled());
+  uint64_t last = 0;
+  for (int i = 0; i < 20; i++) {
+    // the monotonic clock is read on both sides, so being preempted in
+    // between widens the window rather than failing the check
+    uint64_t before = Sylar::GetElapseFromRebootUS();
+    uint64_t tsc = Sylar::Clock::NowUS();
+    uint64_t after = Sylar::GetElapseFromRebootUS();
+    // never steps back, and stays within the calibration error
+    EXPECT_GE(tsc, last);
+    EXPECT_GE(tsc + 1000, before);
+    EXPECT_LE(tsc, after + 1000);
+    last = tsc;
+    usleep(1000);
+  }
+  EXPECT_TRUE(Sylar::Clock::SetTscEnable(false));
+  EXPECT_FALSE(Sylar::Clock::IsTscEnabled());
+}
+
+TEST(Util, ThreadId) {
+  pid_t tid = Sylar::GetThreadId();
+  EXPECT_EQ(tid, syscall(SYS_gettid));
+  pid_t other = 0;
+  std::thread t([&]() { other = Sylar::GetThreadId(); });
+  t.join();
+  EXPECT_NE(other, tid);
+  EXPECT_NE(other, 0);
+}